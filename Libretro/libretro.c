@@ -2,6 +2,7 @@
 #include "risc.h"
 #include "disk.h"
 #include "pclink.h"
+#include "fb-convert.h"
 #include "raw-serial.h"
 #include "sdl-ps2.h"
 
@@ -16,6 +17,7 @@ static int clamp(int x, int min, int max) {
 
 #define CPU_HZ 25000000
 #define FPS 30
+#define MAX_DAMAGE_RECTS 64
 
 static uint16_t FOR = 0x0000, AFT = 0xFFFF;
 
@@ -45,6 +47,7 @@ static struct RISC *_risc = NULL;
 static struct RISC_SPI *_spi_disk = NULL;
 
 static uint32_t _ms_counter;
+static bool _can_dupe;
 
 static int _mouse_x, _mouse_y;
 
@@ -166,7 +169,7 @@ void retro_set_audio_sample_batch(retro_audio_sample_batch_t cb) { }
 void retro_init(void)
 {
 	_risc = risc_new();
-	risc_set_serial(_risc, &pclink);
+	risc_set_serial(_risc, pclink_new(NULL));
 
 	struct retro_log_callback log_callback;
 	_log_cb = _environ_cb(RETRO_ENVIRONMENT_GET_LOG_INTERFACE, &log_callback)
@@ -189,10 +192,24 @@ void retro_reset(void) {
 	risc_reset(_risc);
 }
 
-size_t retro_serialize_size(void) { return 0; }
+size_t retro_serialize_size(void) { return risc_save_state(_risc, NULL); }
 
-bool retro_serialize(        void *data, size_t size) { return false; }
-bool retro_unserialize(const void *data, size_t size) { return false; }
+bool retro_serialize(void *data, size_t size)
+{
+	if (size < risc_save_state(_risc, NULL))
+		return false;
+	risc_save_state(_risc, data);
+	return true;
+}
+
+bool retro_unserialize(const void *data, size_t size)
+{
+	size_t state_size = risc_save_state(_risc, NULL);
+	if (size < state_size || !risc_load_state(_risc, data, state_size))
+		return false;
+	_ms_counter = risc_get_time(_risc);
+	return true;
+}
 
 void retro_cheat_reset(void) { }
 void retro_cheat_set(unsigned index, bool enabled, const char *code) { }
@@ -238,7 +255,11 @@ bool retro_load_game(const struct retro_game_info *game)
 		_framebuffer.height *
 		sizeof(uint16_t));
 
-	risc_configure_memory(_risc, 1, _framebuffer.width, _framebuffer.height);
+	risc_configure_memory(_risc, 1, false, _framebuffer.width, _framebuffer.height, false);
+
+	/* frames without damage are passed on as duplicates */
+	if (!_environ_cb(RETRO_ENVIRONMENT_GET_CAN_DUPE, &_can_dupe))
+		_can_dupe = false;
 
 	_ms_counter = 1;
 	_mouse_x = 0;
@@ -266,6 +287,8 @@ bool retro_load_game_special(
 /* Unloads a currently loaded game. */
 void retro_unload_game(void)
 {
+	if (_spi_disk)
+		disk_flush(_spi_disk);
 	if (!_risc && _spi_disk) {
 		free(_spi_disk);
 		_spi_disk = NULL;
@@ -297,16 +320,35 @@ void retro_run(void)
 	risc_mouse_button(_risc, 3,
 		_input_state_cb(0, RETRO_DEVICE_MOUSE, 0, RETRO_DEVICE_ID_MOUSE_RIGHT));
 
-	risc_set_time(_risc, _ms_counter);
-	_ms_counter += 1000 / FPS;
-	risc_run(_risc, CPU_HZ / FPS);
-
- 	struct Damage damage = risc_get_framebuffer_damage(_risc);
-	if (damage.y1 <= damage.y2) {
+	/* Run in millisecond steps, like the other front ends, and stop
+	 * as soon as the guest idles. The frontend paces the frames, so
+	 * the rest of this one is simply skipped. */
+	uint32_t frame_end = _ms_counter + 1000 / FPS;
+	while ((int32_t)(frame_end - _ms_counter) > 0) {
+		risc_set_time(_risc, _ms_counter++);
+		bool busy = risc_run(_risc, CPU_HZ / 1000);
+		risc_trigger_interrupt(_risc);
+		if (!busy)
+			break;
+	}
+	_ms_counter = frame_end;
+
+	/* write back held disk sectors about once per second */
+	if (_ms_counter % 1000 < 1000 / FPS)
+		disk_flush(_spi_disk);
+
+	struct Damage rects[MAX_DAMAGE_RECTS];
+	int count = risc_get_framebuffer_damage_rects(_risc, rects, MAX_DAMAGE_RECTS);
+	if (count == 0 && _can_dupe) {
+		_video_cb(NULL, _framebuffer.width, _framebuffer.height,
+		          _framebuffer.width << 1);
+		return;
+	}
+	uint32_t *in = risc_get_framebuffer_ptr(_risc);
+	uint16_t *out = _framebuffer.data;
 
-		uint32_t *in = risc_get_framebuffer_ptr(_risc);
-		uint16_t *out = _framebuffer.data;
-		uint16_t colors[] = { AFT, FOR };
+	for (int i = 0; i < count; i++) {
+		struct Damage damage = rects[i];
 
 		for (int line = damage.y2; line >= damage.y1; line--) {
 			int in_line = line * (_framebuffer.width / 32);
@@ -314,14 +356,8 @@ void retro_run(void)
 			int out_idx = ((_framebuffer.height-line-1) * _framebuffer.width)
 			            + damage.x1 * 32;
 
-			for (int col = damage.x1; col <= damage.x2; col++) {
-				uint32_t chunk = in[in_line + col];
-				for (int b = 0; b < 32; b++) {
-					out[out_idx] = colors[chunk&1];
-					chunk >>= 1;
-					out_idx++;
-				}
-			}
+			fb_convert_mono16(in + in_line + damage.x1, damage.x2 - damage.x1 + 1,
+			                  out + out_idx, AFT, FOR);
 		}
 	}
 
@@ -0,0 +1,551 @@
+#define _POSIX_C_SOURCE 200809L
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "risc.h"
+#include "risc-cpu.h"
+#include "risc-io.h"
+#include "disk.h"
+
+// Benchmarks for the emulator itself. Every run executes exactly the
+// same guest instructions, so the numbers only change when the
+// emulator does.
+//
+// The micro benchmarks are small hand-assembled loops, run straight
+// from RAM without a ROM or disk, plus SPI sector reads that drive
+// disk.c from the host. The io-store loop also checks that the engine
+// agrees with the interpreter. The macro benchmarks boot a disk image and
+// recompile the compiler, typed in from the keyboard. Guest time
+// follows the emulated cycles like in risc-headless.
+//
+// Each result is one line of key=value pairs on stdout.
+
+#define CPU_HZ 25000000
+#define SliceCycles (CPU_HZ / 1000)
+#define CompileRuns 5
+
+static const char *engine = "interp";
+static bool jit_option;
+static uint64_t micro_instructions = 200000000;
+static int spi_sectors = 200000;
+static const char *profile;
+
+static struct option long_options[] = {
+  { "jit",          no_argument,       NULL, 'j' },
+  { "instructions", required_argument, NULL, 'n' },
+  { "sectors",      required_argument, NULL, 's' },
+  { "only",         required_argument, NULL, 'o' },
+  { "profile",      required_argument, NULL, 'p' },
+  { NULL,           no_argument,       NULL, 0   }
+};
+
+static void usage() {
+  puts("Usage: risc-bench [OPTIONS...] [DISK-IMAGE]\n"
+       "\n"
+       "Options:\n"
+       "  --jit                 Translate hot code to native instructions\n"
+       "  --instructions MILLS  Run each CPU benchmark for MILLS million instructions\n"
+       "  --sectors COUNT       Read COUNT sectors in the SPI benchmark\n"
+       "  --only NAME           Only run benchmarks whose name starts with NAME\n"
+       "  --profile FILE        Profile the guest in the macro benchmarks, see risc-headless\n"
+       "\n"
+       "The macro benchmarks need DISK-IMAGE, which is not modified.\n"
+       );
+  exit(1);
+}
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+static void report_cpu(const char *name, uint64_t instructions, double seconds) {
+  printf("bench=%s engine=%s instructions=%llu seconds=%.3f mips=%.1f ns_per_instr=%.2f",
+         name, engine, (unsigned long long)instructions, seconds,
+         (double)instructions / seconds / 1e6, seconds * 1e9 / (double)instructions);
+}
+
+
+// A little assembler, just enough for the loops below.
+
+// The opcodes come from risc-cpu.h.
+enum { EQ = 1, AL = 7, NE = 9 };
+
+static uint32_t code[64];
+static int here;
+
+static void emit(uint32_t ir) {
+  code[here++] = ir;
+}
+
+static void op_reg(int op, int a, int b, int c) {
+  emit((uint32_t)(a << 24 | b << 20 | op << 16 | c));
+}
+
+static void op_imm(int op, int a, int b, int32_t imm) {
+  uint32_t v = imm < 0 ? 0x10000000 : 0;
+  emit(0x40000000 | v | (uint32_t)(a << 24 | b << 20 | op << 16) | ((uint32_t)imm & 0xFFFF));
+}
+
+static void mov_const(int a, uint32_t value) {
+  emit(0x60000000 | (uint32_t)(a << 24) | value >> 16);  // MOV' a, high half
+  op_imm(IOR, a, a, (int32_t)(value & 0xFFFF));
+}
+
+static void mem(uint32_t kind, int a, int b, int32_t off) {
+  emit(kind | (uint32_t)(a << 24 | b << 20) | ((uint32_t)off & 0xFFFFF));
+}
+#define LDW 0x80000000
+#define LDB 0x90000000
+#define STW 0xA0000000
+#define STB 0xB0000000
+
+static void branch(int cond, int target) {
+  emit(0xE0000000 | (uint32_t)(cond << 24) | ((uint32_t)(target - here - 1) & 0xFFFFFF));
+}
+
+static void call(int target) {
+  emit(0xF7000000 | ((uint32_t)(target - here - 1) & 0xFFFFFF));
+}
+
+static void ret(void) {
+  emit(0xC7000000 | 15);
+}
+
+// Every loop runs forever and never touches the timer or keyboard, so
+// risc_run always uses up its cycles.
+static void asm_alu(void) {
+  op_imm(MOV, 1, 0, 1);
+  op_imm(MOV, 2, 0, 3);
+  int loop = here;
+  op_reg(ADD, 1, 1, 2);
+  op_reg(XOR, 3, 3, 1);
+  op_imm(LSL, 4, 1, 3);
+  op_reg(SUB, 5, 4, 3);
+  op_imm(ASR, 6, 5, 2);
+  op_reg(AND, 7, 6, 1);
+  op_reg(IOR, 8, 7, 2);
+  op_reg(MUL, 9, 8, 1);
+  op_imm(ROR, 10, 9, 7);
+  op_imm(ADD, 2, 2, 1);
+  branch(AL, loop);
+}
+
+static void asm_load_store(void) {
+  op_imm(MOV, 0, 0, 0x4000);
+  int loop = here;
+  mem(LDW, 1, 0, 0);
+  op_imm(ADD, 1, 1, 1);
+  mem(STW, 1, 0, 4);
+  mem(LDW, 2, 0, 8);
+  mem(STW, 2, 0, 12);
+  mem(LDB, 3, 0, 5);
+  mem(STB, 3, 0, 18);
+  mem(LDW, 4, 0, 16);
+  mem(STW, 4, 0, 0);
+  branch(AL, loop);
+}
+
+static void asm_branch(void) {
+  op_imm(MOV, 1, 0, 100);
+  branch(AL, 4);  // over the subroutine
+  op_imm(ADD, 4, 4, 1);  // 2: subroutine
+  ret();
+  int loop = here;
+  op_imm(SUB, 1, 1, 1);
+  branch(NE, here + 2);
+  op_imm(MOV, 1, 0, 100);
+  op_imm(AND, 2, 1, 1);
+  branch(EQ, here + 2);
+  op_imm(ADD, 3, 3, 1);
+  op_imm(AND, 2, 1, 3);
+  branch(NE, here + 2);
+  call(2);
+  branch(AL, loop);
+}
+
+static void asm_fp(void) {
+  mov_const(1, 0x3FC00000);  // 1.5
+  mov_const(2, 0x3F800000);  // 1.0
+  op_imm(MOV, 8, 0, 12345);
+  op_imm(MOV, 9, 0, 13);
+  int loop = here;
+  op_reg(FAD, 3, 1, 2);
+  op_reg(FML, 4, 3, 1);
+  op_reg(FDV, 5, 4, 2);
+  op_reg(FSB, 6, 5, 1);
+  op_reg(DIV, 7, 8, 9);
+  op_imm(ADD, 8, 8, 7);
+  op_reg(FAD, 10, 6, 3);
+  op_reg(FML, 11, 10, 10);
+  branch(AL, loop);
+}
+
+static void asm_fb_store(void) {
+  mov_const(0, DefaultDisplayStart);
+  int loop = here;
+  op_reg(ADD, 4, 0, 3);
+  mem(STB, 1, 4, 0);
+  mem(STB, 2, 4, 1);
+  op_imm(ADD, 3, 3, 2);
+  op_imm(AND, 3, 3, 0xFFFF);
+  op_imm(ADD, 1, 1, 1);
+  op_imm(XOR, 2, 2, 0xFF);
+  branch(AL, loop);
+}
+
+// Byte stores to the LEDs, with more in the register than the byte.
+static void asm_io_store(void) {
+  mov_const(1, 0x12345600);
+  int loop = here;
+  mem(STB, 1, 0, (int32_t)(IOStart + 4));
+  op_imm(ADD, 1, 1, 0x101);
+  branch(AL, loop);
+}
+
+static struct RISC *new_risc(void) {
+  struct RISC *risc = risc_new();
+  if (jit_option) {
+    if (risc_set_jit(risc, true)) {
+      engine = "jit";
+    } else {
+      fprintf(stderr, "No JIT for this host, using the interpreter.\n");
+      jit_option = false;
+    }
+  }
+  return risc;
+}
+
+static void load_code(struct RISC *risc) {
+  risc_map_memory(risc);
+  memcpy(risc->RAM, code, (size_t)here * 4);
+  risc->PC = 0;
+}
+
+static void run_cpu_bench(const char *name, void (*assemble)(void)) {
+  here = 0;
+  assemble();
+  struct RISC *risc = new_risc();
+  load_code(risc);
+
+  double t0 = now();
+  for (uint64_t done = 0; done < micro_instructions; done += SliceCycles) {
+    risc_run(risc, SliceCycles);
+    // Like a front end, which would redraw this.
+    risc_get_framebuffer_damage(risc);
+  }
+  double t1 = now();
+  report_cpu(name, risc_get_instructions(risc), t1 - t0);
+  printf("\n");
+}
+
+// Only the low byte of a byte store reaches an IO register, whichever
+// engine runs it. The first slices are compared with the interpreter.
+
+#define IOCheckSlices 10
+
+static uint32_t led_sum, led_bad;
+
+static void sum_leds(const struct RISC_LED *leds, uint32_t value) {
+  led_sum = led_sum * 33 + value;
+  if (value > 0xFF) {
+    led_bad = value;
+  }
+}
+
+static const struct RISC_LED bench_leds = { .write = sum_leds };
+
+static void run_io_bench(void) {
+  here = 0;
+  asm_io_store();
+  struct RISC *ref = risc_new();
+  load_code(ref);
+  risc_set_leds(ref, &bench_leds);
+  led_sum = 0;
+  for (int i = 0; i < IOCheckSlices; i++) {
+    risc_run(ref, SliceCycles);
+  }
+  uint32_t expected = led_sum;
+
+  struct RISC *risc = new_risc();
+  load_code(risc);
+  risc_set_leds(risc, &bench_leds);
+  led_sum = led_bad = 0;
+  uint32_t sum = 0;
+  double t0 = now();
+  for (uint64_t done = 0; done < micro_instructions; done += SliceCycles) {
+    risc_run(risc, SliceCycles);
+    if (done == (IOCheckSlices - 1) * SliceCycles) {
+      sum = led_sum;
+    }
+  }
+  double t1 = now();
+  report_cpu("io-store", risc_get_instructions(risc), t1 - t0);
+  printf("\n");
+  fflush(stdout);
+  if (led_bad != 0) {
+    fprintf(stderr, "io-store: a byte store sent %08X to the LEDs\n", led_bad);
+    exit(1);
+  }
+  if (sum != expected) {
+    fprintf(stderr, "io-store: the LEDs saw other values than with the interpreter\n");
+    exit(1);
+  }
+}
+
+
+// Reads sectors through the SPI byte protocol, as the guest's SD card
+// driver does.
+
+static uint32_t image_offset(const char *filename, uint32_t *sectors) {
+  FILE *f = fopen(filename, "rb");
+  uint8_t word[4] = { 0 };
+  if (f == NULL || fread(word, 4, 1, f) != 1) {
+    fprintf(stderr, "Can't read \"%s\"\n", filename);
+    exit(1);
+  }
+  fseek(f, 0, SEEK_END);
+  *sectors = (uint32_t)(ftell(f) / 512);
+  fclose(f);
+  uint32_t first = (uint32_t)(word[0] | word[1] << 8 | word[2] << 16 | word[3] << 24);
+  return first == 0x9B1EA38D ? 0x80002 : 0;
+}
+
+static void run_spi_bench(const char *disk_image) {
+  uint32_t sectors;
+  uint32_t offset = image_offset(disk_image, &sectors);
+  struct RISC_SPI *spi = disk_new(disk_image);
+  uint32_t sum = 0;
+
+  double t0 = now();
+  for (int i = 0; i < spi_sectors; i++) {
+    // A stride through the whole image, so this isn't only the cache.
+    uint32_t arg = (uint32_t)((uint64_t)i * 7919 % sectors) + offset;
+    const uint32_t cmd[6] = { 81, arg >> 24, (arg >> 16) & 0xFF, (arg >> 8) & 0xFF, arg & 0xFF, 0xFF };
+    for (int b = 0; b < 6; b++) {
+      spi->write_data(spi, cmd[b]);
+    }
+    for (int b = 0; b < 2 + 128; b++) {
+      spi->write_data(spi, 0xFF);
+      sum += spi->read_data(spi);
+    }
+    spi->write_data(spi, 0xFF);
+  }
+  double t1 = now();
+
+  struct DiskStats stats;
+  disk_get_stats(spi, &stats);
+  printf("bench=spi-read sectors=%llu seconds=%.3f sectors_per_s=%.0f checksum=%08x\n",
+         (unsigned long long)stats.sectors_read, t1 - t0,
+         (double)stats.sectors_read / (t1 - t0), sum);
+}
+
+
+// The macro benchmarks run the guest until it has been idle for a
+// while after every input, so typing never outruns it.
+
+struct Machine {
+  struct RISC *risc;
+  struct RISC_SPI *disk;
+  uint32_t tick;
+};
+
+static bool run_tick(struct Machine *m) {
+  risc_set_time(m->risc, m->tick);
+  bool busy = risc_run(m->risc, SliceCycles);
+  risc_trigger_interrupt(m->risc);
+  m->tick++;
+  return busy;
+}
+
+static void settle(struct Machine *m, int idle_ticks) {
+  for (int idle = 0; idle < idle_ticks; ) {
+    idle = run_tick(m) ? 0 : idle + 1;
+  }
+}
+
+// PS/2 set 2 make codes.
+static const uint8_t letter_codes[26] = {
+  0x1C, 0x32, 0x21, 0x23, 0x24, 0x2B, 0x34, 0x33, 0x43, 0x3B, 0x42, 0x4B, 0x3A,
+  0x31, 0x44, 0x4D, 0x15, 0x2D, 0x1B, 0x2C, 0x3C, 0x2A, 0x1D, 0x22, 0x35, 0x1A
+};
+
+static void type(struct Machine *m, const char *text) {
+  for (const char *p = text; *p; p++) {
+    bool shift = isupper((unsigned char)*p) || *p == '~';
+    uint8_t code;
+    switch (*p) {
+      case '.': code = 0x49; break;
+      case ' ': code = 0x29; break;
+      case '~': code = 0x0E; break;
+      default: code = letter_codes[tolower((unsigned char)*p) - 'a']; break;
+    }
+    uint8_t keys[8];
+    int len = 0;
+    if (shift) {
+      keys[len++] = 0x12;
+    }
+    keys[len++] = code;
+    keys[len++] = 0xF0;
+    keys[len++] = code;
+    if (shift) {
+      keys[len++] = 0xF0;
+      keys[len++] = 0x12;
+    }
+    risc_keyboard_input(m->risc, keys, (uint32_t)len);
+    settle(m, 2);
+  }
+}
+
+// y counts from the top of the screen, Oberon's from the bottom.
+static void click(struct Machine *m, int x, int y, int button) {
+  risc_mouse_moved(m->risc, x, RISC_FRAMEBUFFER_HEIGHT - 1 - y);
+  settle(m, 2);
+  // The guest tracks the mouse while a button is down, it never idles.
+  risc_mouse_button(m->risc, button, true);
+  for (int i = 0; i < 20; i++) {
+    run_tick(m);
+  }
+  risc_mouse_button(m->risc, button, false);
+  settle(m, 2);
+}
+
+static uint64_t disk_sectors(struct RISC_SPI *disk) {
+  struct DiskStats stats;
+  disk_get_stats(disk, &stats);
+  return stats.sectors_read + stats.sectors_written;
+}
+
+static void report_macro(const char *name, struct Machine *m, uint64_t instructions,
+                         uint64_t sectors, double seconds) {
+  sectors = disk_sectors(m->disk) - sectors;
+  report_cpu(name, risc_get_instructions(m->risc) - instructions, seconds);
+  printf(" sectors=%llu sectors_per_s=%.0f\n",
+         (unsigned long long)sectors, (double)sectors / seconds);
+}
+
+static void run_macro_bench(const char *disk_image, bool compile) {
+  char overlay[] = "/tmp/risc-bench-XXXXXX";
+  int fd = mkstemp(overlay);
+  if (fd == -1) {
+    perror("Can't create overlay");
+    exit(1);
+  }
+  close(fd);
+  unlink(overlay);
+
+  struct Machine m = { .risc = new_risc() };
+  m.disk = disk_new_overlay(disk_image, overlay);
+  risc_set_spi(m.risc, 1, m.disk);
+  if (profile) {
+    risc_set_profile(m.risc, RISC_PROFILE_PERIOD);
+  }
+
+  double t0 = now();
+  settle(&m, 100);
+  double t1 = now();
+  report_macro("boot", &m, 0, 0, t1 - t0);
+
+  if (compile) {
+    uint64_t instructions = risc_get_instructions(m.risc);
+    uint64_t sectors = disk_sectors(m.disk);
+    t0 = now();
+    // Set the caret in System.Tool, type the command and run it.
+    click(&m, 665, 569, 1);
+    type(&m, "ORP.Compile ORS.Mod ORB.Mod ORG.Mod ORP.Mod~");
+    for (int i = 0; i < CompileRuns; i++) {
+      click(&m, 680, 569, 2);
+      settle(&m, 100);
+    }
+    t1 = now();
+    report_macro("compile", &m, instructions, sectors, t1 - t0);
+  }
+  unlink(overlay);
+  if (profile && !risc_write_profile(m.risc, profile)) {
+    fprintf(stderr, "Can't write profile \"%s\": %s\n", profile, strerror(errno));
+    exit(1);
+  }
+}
+
+static bool selected(const char *only, const char *name) {
+  return only == NULL || strncmp(name, only, strlen(only)) == 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char *only = NULL;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "jn:s:o:p:", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'j': {
+        jit_option = true;
+        break;
+      }
+      case 'n': {
+        micro_instructions = strtoull(optarg, NULL, 10) * 1000000;
+        if (micro_instructions == 0) {
+          usage();
+        }
+        break;
+      }
+      case 's': {
+        spi_sectors = atoi(optarg);
+        if (spi_sectors <= 0) {
+          usage();
+        }
+        break;
+      }
+      case 'o': {
+        only = optarg;
+        break;
+      }
+      case 'p': {
+        profile = optarg;
+        break;
+      }
+      default: {
+        usage();
+      }
+    }
+  }
+  if (optind < argc - 1) {
+    usage();
+  }
+  const char *disk_image = optind < argc ? argv[optind] : NULL;
+
+  static const struct {
+    const char *name;
+    void (*assemble)(void);
+  } cpu_benches[] = {
+    { "alu", asm_alu },
+    { "load-store", asm_load_store },
+    { "branch", asm_branch },
+    { "fp", asm_fp },
+    { "fb-store", asm_fb_store },
+  };
+  for (size_t i = 0; i < sizeof(cpu_benches) / sizeof(cpu_benches[0]); i++) {
+    if (selected(only, cpu_benches[i].name)) {
+      run_cpu_bench(cpu_benches[i].name, cpu_benches[i].assemble);
+    }
+  }
+  if (selected(only, "io-store")) {
+    run_io_bench();
+  }
+  if (disk_image == NULL) {
+    return 0;
+  }
+  if (selected(only, "spi-read")) {
+    run_spi_bench(disk_image);
+  }
+  if (selected(only, "boot") || selected(only, "compile")) {
+    run_macro_bench(disk_image, selected(only, "compile"));
+  }
+  return 0;
+}
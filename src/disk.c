@@ -8,10 +8,36 @@
 #include <dirent.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#endif
 #include "disk.h"
 
+// Sectors are little-endian words, so on little-endian hosts they can
+// be copied to and from the SPI buffers as they are.
+#if defined(_WIN32) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define DISK_LITTLE_ENDIAN 1
+#endif
+
+// Overlay images start with a header sector, followed by a bitmap of
+// the sectors that differ from the base image and then the sectors
+// themselves, at their usual offset. Header words: OVERLAY_MAGIC,
+// version, bitmap size in sectors, size of the base image, how much
+// of the base is still visible after TRIM, and the image size.
+#define OVERLAY_MAGIC    0x594C564F  // "OVLY"
+#define OVERLAY_VERSION  1
+#define OVERLAY_CAPACITY (1 << 21)   // sectors, 1 GB
+
+// Dirty sectors kept back by the stdio backend.
+#define CACHE_SECTORS 256
+#define CACHE_SLOTS   (CACHE_SECTORS * 2)
+
 enum DiskState {
   diskCommand,
   diskRead,
@@ -25,6 +51,35 @@ struct Disk {
   enum DiskState state;
   FILE *file;
   uint32_t offset;
+  uint32_t sector;
+  bool read_only;
+
+  // Overlays read unchanged sectors from the base image.
+  struct Disk *base;
+  uint8_t *bitmap;
+  uint32_t capacity;
+  uint32_t base_size, base_limit, size;
+  size_t data_start;
+
+  // The image is mapped into memory when possible; stdio is the
+  // fallback. A zero-length image is mapped but has no map.
+  bool mapped;
+  uint8_t *map;
+  size_t map_size;
+  size_t page_size;
+#ifdef _WIN32
+  HANDLE mapping;
+#endif
+  enum DiskSync sync;
+
+  // Without a mapping, writes are collected here and written out in
+  // runs of adjacent sectors. cache_slot is a hash table from sector
+  // number to entry, storing the entry number plus one.
+  uint32_t cache_cnt;
+  uint32_t cache_sector[CACHE_SECTORS];
+  uint8_t cache_data[CACHE_SECTORS][512];
+  uint16_t cache_slot[CACHE_SLOTS];
+  uint8_t cache_run[CACHE_SECTORS * 512];
 
   uint32_t rx_buf[128];
   int rx_idx;
@@ -32,43 +87,256 @@ struct Disk {
   uint32_t tx_buf[128+2];
   int tx_cnt;
   int tx_idx;
+
+  struct DiskStats stats;
 };
 
 
 static uint32_t disk_read(const struct RISC_SPI *spi);
 static void disk_write(const struct RISC_SPI *spi, uint32_t value);
 static void disk_run_command(struct Disk *disk);
-static void seek_sector(FILE *f, uint32_t secnum);
-static void read_sector(FILE *f, uint32_t buf[static 128]);
-static void write_sector(FILE *f, uint32_t buf[static 128]);
+static bool map_image(struct Disk *disk);
+static void unmap_image(struct Disk *disk);
+static bool resize_map(struct Disk *disk, size_t size);
+static void disk_read_block(const struct RISC_SPI *spi, uint32_t block, uint32_t buf[static 128]);
+static void disk_write_block(const struct RISC_SPI *spi, uint32_t block, const uint32_t buf[static 128]);
+static struct Disk *disk_alloc(void);
+static void open_image(struct Disk *disk, const char *filename, bool read_only);
+static struct Disk *open_overlay(const char *filename, const char *overlay, bool create);
+static void write_header(struct Disk *disk);
+static void overlay_write(struct Disk *disk, uint32_t sector, const uint8_t bytes[static 512], bool trim);
+static bool overlay_has(struct Disk *disk, uint32_t sector);
+static void map_failed(struct Disk *disk);
+static void image_write(struct Disk *disk, size_t pos, const uint8_t bytes[static 512]);
+static void image_truncate(struct Disk *disk, size_t pos);
+static const uint8_t *words_to_bytes(const uint32_t buf[static 128], uint8_t scratch[static 512]);
+static void bytes_to_words(uint32_t buf[static 128], const uint8_t bytes[static 512]);
+static void read_sector(struct Disk *disk, uint32_t sector, uint32_t buf[static 128]);
+static void write_sector(struct Disk *disk, uint32_t sector, const uint32_t buf[static 128]);
+static void disk_sync(const struct RISC_SPI *spi);
+static size_t disk_save_state(const struct RISC_SPI *spi, void *buf);
+static void disk_load_state(const struct RISC_SPI *spi, const void *buf);
+static void flush_cache(struct Disk *disk);
+static int cache_lookup(struct Disk *disk, uint32_t sector);
+static void cache_insert(struct Disk *disk, uint32_t sector, const uint8_t bytes[static 512]);
 
 
 struct RISC_SPI *disk_new(const char *filename) {
+  struct Disk *disk = disk_alloc();
+  if (filename) {
+    open_image(disk, filename, false);
+
+    // Check for filesystem-only image, starting directly at sector 1 (DiskAdr 29)
+    read_sector(disk, 0, &disk->tx_buf[0]);
+    disk->offset = (disk->tx_buf[0] == 0x9B1EA38D) ? 0x80002 : 0;
+  }
+  return &disk->spi;
+}
+
+struct RISC_SPI *disk_new_overlay(const char *filename, const char *overlay) {
+  struct Disk *disk = open_overlay(filename, overlay, true);
+  read_sector(disk, 0, &disk->tx_buf[0]);
+  disk->offset = (disk->tx_buf[0] == 0x9B1EA38D) ? 0x80002 : 0;
+  return &disk->spi;
+}
+
+struct RISC_SPI *disk_copy_overlay(struct RISC_SPI *spi, const char *filename, const char *overlay) {
+  struct Disk *from = (struct Disk *)spi;
+  if (from->base == NULL) {
+    fprintf(stderr, "Only overlay images can be copied\n");
+    exit(1);
+  }
+  remove(overlay);
+  struct Disk *disk = open_overlay(filename, overlay, true);
+  if (disk->capacity != from->capacity) {
+    fprintf(stderr, "\"%s\" changed in the meantime\n", filename);
+    exit(1);
+  }
+  for (uint32_t i = 0; i < from->capacity / 8; i++) {
+    for (uint32_t bit = 0; from->bitmap[i] >> bit; bit++) {
+      uint32_t sector = i * 8 + bit;
+      if (overlay_has(from, sector)) {
+        uint32_t buf[128];
+        uint8_t scratch[512];
+        read_sector(from, sector, buf);
+        overlay_write(disk, sector, words_to_bytes(buf, scratch), false);
+      }
+    }
+  }
+  disk->base_limit = from->base_limit;
+  disk->size = from->size;
+  write_header(disk);
+
+  uint8_t state[sizeof(uint32_t) * 5 + sizeof(from->rx_buf) + sizeof(from->tx_buf)];
+  disk_save_state(&from->spi, state);
+  disk_load_state(&disk->spi, state);
+  disk->offset = from->offset;
+  disk->sync = from->sync;
+  return &disk->spi;
+}
+
+void disk_merge_overlay(const char *filename, const char *overlay, const char *output) {
+  struct Disk *disk = open_overlay(filename, overlay, false);
+  struct Disk *out = disk_alloc();
+  if (output) {
+    out->file = fopen(output, "wb+");
+    if (out->file == NULL) {
+      fprintf(stderr, "Can't create file \"%s\": %s\n", output, strerror(errno));
+      exit(1);
+    }
+  } else {
+    open_image(out, filename, false);
+  }
+  if (out->mapped && out->map_size < disk->size && !resize_map(out, disk->size)) {
+    map_failed(out);
+  }
+
+  // Back into the base, only changed sectors and those cut off by
+  // TRIM need to be written.
+  uint32_t sectors = (disk->size + 511) / 512;
+  for (uint32_t i = 0; i < sectors; i++) {
+    if (output || overlay_has(disk, i) || (size_t)i * 512 >= disk->base_limit) {
+      uint32_t buf[128];
+      uint8_t scratch[512];
+      read_sector(disk, i, buf);
+      image_write(out, (size_t)i * 512, words_to_bytes(buf, scratch));
+    }
+  }
+  image_truncate(out, disk->size);
+  disk_sync(&out->spi);
+  if (!output) {
+    remove(overlay);
+  }
+}
+
+static struct Disk *disk_alloc(void) {
   struct Disk *disk = calloc(1, sizeof(*disk));
   disk->spi = (struct RISC_SPI) {
     .read_data = disk_read,
-    .write_data = disk_write
+    .write_data = disk_write,
+    .read_block = disk_read_block,
+    .write_block = disk_write_block,
+    .sync = disk_sync,
+    .save_state = disk_save_state,
+    .load_state = disk_load_state
   };
-
   disk->state = diskCommand;
+  return disk;
+}
 
-  if (filename) {
-    disk->file = fopen(filename, "rb+");
-    if (disk->file == 0) {
-      fprintf(stderr, "Can't open file \"%s\": %s\n", filename, strerror(errno));
+static void open_image(struct Disk *disk, const char *filename, bool read_only) {
+  disk->file = fopen(filename, read_only ? "rb" : "rb+");
+  if (disk->file == 0) {
+    fprintf(stderr, "Can't open file \"%s\": %s\n", filename, strerror(errno));
+    exit(1);
+  }
+  disk->read_only = read_only;
+  disk->mapped = map_image(disk);
+}
+
+static uint32_t image_size(struct Disk *disk) {
+  if (disk->mapped) {
+    return (uint32_t)disk->map_size;
+  }
+  fseek(disk->file, 0, SEEK_END);
+  return (uint32_t)ftell(disk->file);
+}
+
+static struct Disk *open_overlay(const char *filename, const char *overlay, bool create) {
+  struct Disk *disk = disk_alloc();
+  disk->base = disk_alloc();
+  open_image(disk->base, filename, true);
+  uint32_t base_size = image_size(disk->base);
+
+  uint32_t hdr[128] = { 0 };
+  disk->file = fopen(overlay, "rb+");
+  if (disk->file) {
+    uint8_t bytes[512] = { 0 };
+    fread(bytes, 512, 1, disk->file);
+    bytes_to_words(hdr, bytes);
+    if (hdr[0] != OVERLAY_MAGIC || hdr[1] != OVERLAY_VERSION || hdr[2] % 4096 != 0) {
+      fprintf(stderr, "\"%s\" is not an overlay image\n", overlay);
+      exit(1);
+    }
+    if (hdr[3] != base_size) {
+      fprintf(stderr, "\"%s\" no longer matches \"%s\"\n", overlay, filename);
       exit(1);
     }
+  } else if (errno == ENOENT && create) {
+    disk->file = fopen(overlay, "wb+");
+    hdr[0] = OVERLAY_MAGIC;
+    hdr[1] = OVERLAY_VERSION;
+    hdr[2] = OVERLAY_CAPACITY;
+    while (hdr[2] / 2 < base_size / 512) {
+      hdr[2] *= 2;
+    }
+    hdr[3] = hdr[4] = hdr[5] = base_size;
+  }
+  if (disk->file == NULL) {
+    fprintf(stderr, "Can't open file \"%s\": %s\n", overlay, strerror(errno));
+    exit(1);
+  }
 
-    // Check for filesystem-only image, starting directly at sector 1 (DiskAdr 29)
-    read_sector(disk->file, &disk->tx_buf[0]);
-    disk->offset = (disk->tx_buf[0] == 0x9B1EA38D) ? 0x80002 : 0;
+  disk->capacity = hdr[2];
+  disk->base_size = hdr[3];
+  disk->base_limit = hdr[4];
+  disk->size = hdr[5];
+  disk->data_start = 512 + disk->capacity / 8;
+  disk->bitmap = calloc(1, disk->capacity / 8);
+  if (image_size(disk) < disk->data_start) {
+    // New overlay, the data area grows on demand.
+    ftruncate(fileno(disk->file), (off_t)disk->data_start);
+    disk->file = freopen(NULL, "rb+", disk->file);
+  } else {
+    fseek(disk->file, 512, SEEK_SET);
+    fread(disk->bitmap, disk->capacity / 8, 1, disk->file);
   }
+  disk->mapped = map_image(disk);
+  write_header(disk);
+  return disk;
+}
 
-  return &disk->spi;
+void disk_set_sync(struct RISC_SPI *spi, enum DiskSync sync) {
+  struct Disk *disk = (struct Disk *)spi;
+  flush_cache(disk);
+  disk->sync = sync;
+}
+
+void disk_flush(struct RISC_SPI *spi) {
+  flush_cache((struct Disk *)spi);
+}
+
+void disk_get_stats(struct RISC_SPI *spi, struct DiskStats *stats) {
+  *stats = ((struct Disk *)spi)->stats;
+}
+
+static void disk_sync(const struct RISC_SPI *spi) {
+  struct Disk *disk = (struct Disk *)spi;
+  if (disk->file == NULL) {
+    return;
+  }
+  if (disk->mapped) {
+    if (disk->map) {
+#ifdef _WIN32
+      FlushViewOfFile(disk->map, 0);
+#else
+      msync(disk->map, disk->map_size, MS_SYNC);
+#endif
+    }
+  } else {
+    flush_cache(disk);
+    fflush(disk->file);
+  }
+#ifdef _WIN32
+  FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(disk->file)));
+#else
+  fsync(fileno(disk->file));
+#endif
 }
 
 static void disk_write(const struct RISC_SPI *spi, uint32_t value) {
   struct Disk *disk = (struct Disk *)spi;
+  disk->stats.spi_bytes++;
   disk->tx_idx++;
   switch (disk->state) {
     case diskCommand: {
@@ -102,7 +370,8 @@ static void disk_write(const struct RISC_SPI *spi, uint32_t value) {
       }
       disk->rx_idx++;
       if (disk->rx_idx == 128) {
-        write_sector(disk->file, &disk->rx_buf[0]);
+        write_sector(disk, disk->sector, &disk->rx_buf[0]);
+        disk->stats.sectors_written++;
       }
       if (disk->rx_idx == 130) {
         disk->tx_buf[0] = 5;
@@ -119,6 +388,7 @@ static void disk_write(const struct RISC_SPI *spi, uint32_t value) {
 static uint32_t disk_read(const struct RISC_SPI *spi) {
   struct Disk *disk = (struct Disk *)spi;
   uint32_t result;
+  disk->stats.spi_bytes++;
   if (disk->tx_idx >= 0 && disk->tx_idx < disk->tx_cnt) {
     result = disk->tx_buf[disk->tx_idx];
   } else {
@@ -127,6 +397,50 @@ static uint32_t disk_read(const struct RISC_SPI *spi) {
   return result;
 }
 
+static void disk_read_block(const struct RISC_SPI *spi, uint32_t block, uint32_t buf[static 128]) {
+  struct Disk *disk = (struct Disk *)spi;
+  read_sector(disk, block - disk->offset, buf);
+  disk->stats.sectors_read++;
+}
+
+static void disk_write_block(const struct RISC_SPI *spi, uint32_t block, const uint32_t buf[static 128]) {
+  struct Disk *disk = (struct Disk *)spi;
+  write_sector(disk, block - disk->offset, buf);
+  disk->stats.sectors_written++;
+}
+
+// The SPI state machine, for snapshots. The image stays as it is, so
+// held back writes go out first.
+static size_t disk_save_state(const struct RISC_SPI *spi, void *buf) {
+  struct Disk *disk = (struct Disk *)spi;
+  uint32_t words[5] = {
+    disk->state, disk->sector, (uint32_t)disk->rx_idx,
+    (uint32_t)disk->tx_cnt, (uint32_t)disk->tx_idx
+  };
+  if (buf) {
+    flush_cache(disk);
+    uint8_t *p = buf;
+    memcpy(p, words, sizeof(words));
+    memcpy(p + sizeof(words), disk->rx_buf, sizeof(disk->rx_buf));
+    memcpy(p + sizeof(words) + sizeof(disk->rx_buf), disk->tx_buf, sizeof(disk->tx_buf));
+  }
+  return sizeof(words) + sizeof(disk->rx_buf) + sizeof(disk->tx_buf);
+}
+
+static void disk_load_state(const struct RISC_SPI *spi, const void *buf) {
+  struct Disk *disk = (struct Disk *)spi;
+  uint32_t words[5];
+  const uint8_t *p = buf;
+  memcpy(words, p, sizeof(words));
+  memcpy(disk->rx_buf, p + sizeof(words), sizeof(disk->rx_buf));
+  memcpy(disk->tx_buf, p + sizeof(words) + sizeof(disk->rx_buf), sizeof(disk->tx_buf));
+  disk->state = (enum DiskState)words[0];
+  disk->sector = words[1];
+  disk->rx_idx = (int)words[2];
+  disk->tx_cnt = (int)words[3];
+  disk->tx_idx = (int)words[4];
+}
+
 static void disk_run_command(struct Disk *disk) {
   uint32_t cmd = disk->rx_buf[0];
   uint32_t arg = (disk->rx_buf[1] << 24)
@@ -139,14 +453,15 @@ static void disk_run_command(struct Disk *disk) {
       disk->state = diskRead;
       disk->tx_buf[0] = 0;
       disk->tx_buf[1] = 254;
-      seek_sector(disk->file, arg - disk->offset);
-      read_sector(disk->file, &disk->tx_buf[2]);
+      disk->sector = arg - disk->offset;
+      read_sector(disk, disk->sector, &disk->tx_buf[2]);
+      disk->stats.sectors_read++;
       disk->tx_cnt = 2 + 128;
       break;
     }
     case 88: {
       disk->state = diskWrite;
-      seek_sector(disk->file, arg - disk->offset);
+      disk->sector = arg - disk->offset;
       disk->tx_buf[0] = 0;
       disk->tx_cnt = 1;
       break;
@@ -160,61 +475,428 @@ static void disk_run_command(struct Disk *disk) {
   disk->tx_idx = -1;
 }
 
-static void seek_sector(FILE *f, uint32_t secnum) {
-  if (f) {
-    fseek(f, secnum * 512, SEEK_SET);
+#ifdef _WIN32
+
+static bool map_image(struct Disk *disk) {
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx((HANDLE)_get_osfhandle(_fileno(disk->file)), &size) ||
+      (uint64_t)size.QuadPart > SIZE_MAX) {
+    return false;
   }
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  disk->page_size = info.dwAllocationGranularity;
+  disk->map_size = (size_t)size.QuadPart;
+  return resize_map(disk, disk->map_size);
 }
 
-static void read_sector(FILE *f, uint32_t buf[static 128]) {
-  uint8_t bytes[512] = { 0 };
-  if (f) {
-    fread(bytes, 512, 1, f);
+static void unmap_image(struct Disk *disk) {
+  if (disk->map) {
+    UnmapViewOfFile(disk->map);
+    CloseHandle(disk->mapping);
+    disk->map = NULL;
   }
+}
+
+static bool resize_map(struct Disk *disk, size_t size) {
+  HANDLE file = (HANDLE)_get_osfhandle(_fileno(disk->file));
+  unmap_image(disk);
+  if (size != disk->map_size) {
+    LARGE_INTEGER end;
+    end.QuadPart = (LONGLONG)size;
+    if (!SetFilePointerEx(file, end, NULL, FILE_BEGIN) || !SetEndOfFile(file)) {
+      return false;
+    }
+    disk->map_size = size;
+  }
+  if (size > 0) {
+    uint64_t size64 = size;
+    disk->mapping = CreateFileMapping(file, NULL, disk->read_only ? PAGE_READONLY : PAGE_READWRITE,
+                                      (DWORD)(size64 >> 32), (DWORD)size64, NULL);
+    if (disk->mapping == NULL) {
+      return false;
+    }
+    disk->map = MapViewOfFile(disk->mapping, disk->read_only ? FILE_MAP_READ : FILE_MAP_WRITE, 0, 0, size);
+    if (disk->map == NULL) {
+      CloseHandle(disk->mapping);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void sync_map(struct Disk *disk, size_t pos) {
+  size_t start = pos & ~(disk->page_size - 1);
+  FlushViewOfFile(disk->map + start, pos + 512 - start);
+  if (disk->sync == DISK_SYNC_FULL) {
+    FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(disk->file)));
+  }
+}
+
+#else  // _WIN32
+
+static bool map_image(struct Disk *disk) {
+  struct stat st;
+  if (fstat(fileno(disk->file), &st) != 0 || !S_ISREG(st.st_mode) ||
+      (uintmax_t)st.st_size > SIZE_MAX) {
+    return false;
+  }
+  disk->page_size = (size_t)sysconf(_SC_PAGESIZE);
+  disk->map_size = (size_t)st.st_size;
+  return resize_map(disk, disk->map_size);
+}
+
+static void unmap_image(struct Disk *disk) {
+  if (disk->map) {
+    munmap(disk->map, disk->map_size);
+    disk->map = NULL;
+  }
+}
+
+// Unmaps the image, changes its size if needed and maps it again.
+// Resizing is rare (only after TRIM), so this beats relying on mremap.
+static bool resize_map(struct Disk *disk, size_t size) {
+  unmap_image(disk);
+  if (size != disk->map_size) {
+    if (ftruncate(fileno(disk->file), (off_t)size) != 0) {
+      return false;
+    }
+    disk->map_size = size;
+  }
+  if (size > 0) {
+    int prot = disk->read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+    void *map = mmap(NULL, size, prot, MAP_SHARED, fileno(disk->file), 0);
+    if (map == MAP_FAILED) {
+      return false;
+    }
+    disk->map = map;
+  }
+  return true;
+}
+
+static void sync_map(struct Disk *disk, size_t pos) {
+  size_t start = pos & ~(disk->page_size - 1);
+  msync(disk->map + start, pos + 512 - start,
+        disk->sync == DISK_SYNC_FULL ? MS_SYNC : MS_ASYNC);
+}
+
+#endif  // _WIN32
+
+static void bytes_to_words(uint32_t buf[static 128], const uint8_t bytes[static 512]) {
+#ifdef DISK_LITTLE_ENDIAN
+  memcpy(buf, bytes, 512);
+#else
   for (int i = 0; i < 128; i++) {
     buf[i] = (uint32_t)bytes[i*4+0]
       | ((uint32_t)bytes[i*4+1] << 8)
       | ((uint32_t)bytes[i*4+2] << 16)
       | ((uint32_t)bytes[i*4+3] << 24);
   }
+#endif
+}
+
+static const uint8_t *words_to_bytes(const uint32_t buf[static 128], uint8_t scratch[static 512]) {
+#ifdef DISK_LITTLE_ENDIAN
+  return (const uint8_t *)buf;
+#else
+  for (int i = 0; i < 128; i++) {
+    scratch[i*4+0] = (uint8_t)(buf[i]      );
+    scratch[i*4+1] = (uint8_t)(buf[i] >>  8);
+    scratch[i*4+2] = (uint8_t)(buf[i] >> 16);
+    scratch[i*4+3] = (uint8_t)(buf[i] >> 24);
+  }
+  return scratch;
+#endif
+}
+
+
+static void map_failed(struct Disk *disk) {
+  fprintf(stderr, "Can't map disk image: %s\n", strerror(errno));
+  unmap_image(disk);
+  disk->mapped = false;
+}
+
+// Reads 512 bytes from the image file at pos.
+static void image_read(struct Disk *disk, size_t pos, uint32_t buf[static 128]) {
+  if (disk->mapped && pos + 512 <= disk->map_size) {
+    bytes_to_words(buf, disk->map + pos);
+    return;
+  }
+  // Reads past the end of the image, or with stdio.
+  uint8_t bytes[512] = { 0 };
+  if (disk->mapped) {
+    if (pos < disk->map_size) {
+      memcpy(bytes, disk->map + pos, disk->map_size - pos);
+    }
+  } else if (disk->file) {
+    int entry = cache_lookup(disk, (uint32_t)(pos / 512));
+    if (entry >= 0) {
+      bytes_to_words(buf, disk->cache_data[entry]);
+      return;
+    }
+    fseek(disk->file, (long)pos, SEEK_SET);
+    fread(bytes, 512, 1, disk->file);
+  }
+  bytes_to_words(buf, bytes);
 }
 
-static void write_sector(FILE *f, uint32_t buf[static 128]) {
-  if (f) {
-    uint8_t bytes[512];
-    for (int i = 0; i < 128; i++) {
-      bytes[i*4+0] = (uint8_t)(buf[i]      );
-      bytes[i*4+1] = (uint8_t)(buf[i] >>  8);
-      bytes[i*4+2] = (uint8_t)(buf[i] >> 16);
-      bytes[i*4+3] = (uint8_t)(buf[i] >> 24);
+// Writes 512 bytes to the image file at pos, growing it if needed.
+static void image_write(struct Disk *disk, size_t pos, const uint8_t bytes[static 512]) {
+  if (disk->mapped) {
+    if (pos + 512 > disk->map_size) {
+      // Overlays keep their size in the header, so they can grow
+      // in larger steps.
+      size_t size = pos + 512;
+      if (disk->base) {
+        size += (size / 4) & ~(size_t)511;
+      }
+      if (!resize_map(disk, size)) {
+        map_failed(disk);
+      }
+    }
+    if (disk->mapped) {
+      memcpy(disk->map + pos, bytes, 512);
+      if (disk->sync != DISK_SYNC_NONE) {
+        sync_map(disk, pos);
+      }
+      return;
+    }
+  }
+  if (disk->sync == DISK_SYNC_NONE) {
+    cache_insert(disk, (uint32_t)(pos / 512), bytes);
+  } else {
+    fseek(disk->file, (long)pos, SEEK_SET);
+    fwrite(bytes, 512, 1, disk->file);
+    fflush(disk->file);
+#ifndef _WIN32
+    if (disk->sync == DISK_SYNC_FULL) {
+      fsync(fileno(disk->file));
     }
-    if (memcmp(bytes, "!!TRIM!!----", 12) == 0 && memcmp(bytes + 500, "----!!TRIM!!", 12) == 0) {
-      fflush(f);
-      ftruncate(fileno(f), ftell(f));
-      f = freopen(NULL, "rb+", f);
+#endif
+  }
+}
+
+static void image_truncate(struct Disk *disk, size_t pos) {
+  if (disk->mapped) {
+    if (resize_map(disk, pos)) {
+      return;
+    }
+    map_failed(disk);
+  }
+  // Earlier writes must land before the image is cut.
+  flush_cache(disk);
+  fflush(disk->file);
+  ftruncate(fileno(disk->file), (off_t)pos);
+  disk->file = freopen(NULL, "rb+", disk->file);
+}
+
+static bool overlay_has(struct Disk *disk, uint32_t sector) {
+  return sector < disk->capacity && (disk->bitmap[sector / 8] & (1 << (sector % 8)));
+}
+
+static void write_header(struct Disk *disk) {
+  uint32_t hdr[128] = {
+    OVERLAY_MAGIC, OVERLAY_VERSION, disk->capacity,
+    disk->base_size, disk->base_limit, disk->size
+  };
+  uint8_t scratch[512];
+  image_write(disk, 0, words_to_bytes(hdr, scratch));
+}
+
+// Writes the bitmap sector holding byte i.
+static void write_bitmap(struct Disk *disk, uint32_t i) {
+  i &= ~511u;
+  image_write(disk, 512 + i, disk->bitmap + i);
+}
+
+static void overlay_write(struct Disk *disk, uint32_t sector, const uint8_t bytes[static 512], bool trim) {
+  size_t pos = (size_t)(sector * 512);
+  if (trim) {
+    // Sectors from here on read as zero until written again.
+    if (pos < disk->base_limit) {
+      disk->base_limit = (uint32_t)pos;
+    }
+    disk->size = (uint32_t)pos;
+    uint32_t from = sector / 8;
+    for (uint32_t i = from & ~511u; i < disk->capacity / 8; i += 512) {
+      bool dirty = false;
+      for (uint32_t j = i < from ? from : i; j < i + 512; j++) {
+        uint8_t keep = j == from ? (uint8_t)((1 << (sector % 8)) - 1) : 0;
+        if (disk->bitmap[j] & ~keep) {
+          disk->bitmap[j] &= keep;
+          dirty = true;
+        }
+      }
+      if (dirty) {
+        write_bitmap(disk, i);
+      }
+    }
+    write_header(disk);
+    return;
+  }
+  if (sector >= disk->capacity) {
+    fprintf(stderr, "Sector %u is beyond the overlay's capacity\n", sector);
+    return;
+  }
+  image_write(disk, disk->data_start + pos, bytes);
+  if (!overlay_has(disk, sector)) {
+    disk->bitmap[sector / 8] |= (uint8_t)(1 << (sector % 8));
+    write_bitmap(disk, sector / 8);
+  }
+  if (pos + 512 > disk->size) {
+    disk->size = (uint32_t)(pos + 512);
+    write_header(disk);
+  }
+}
+
+static void read_sector(struct Disk *disk, uint32_t sector, uint32_t buf[static 128]) {
+  size_t pos = (size_t)(sector * 512);
+  if (disk->base) {
+    if (!overlay_has(disk, sector)) {
+      if (pos < disk->base_limit) {
+        read_sector(disk->base, sector, buf);
+      } else {
+        memset(buf, 0, 512);
+      }
+      return;
+    }
+    pos += disk->data_start;
+  }
+  image_read(disk, pos, buf);
+}
+
+static void write_sector(struct Disk *disk, uint32_t sector, const uint32_t buf[static 128]) {
+  if (disk->file) {
+    uint8_t scratch[512];
+    const uint8_t *bytes = words_to_bytes(buf, scratch);
+    bool trim = memcmp(bytes, "!!TRIM!!----", 12) == 0 && memcmp(bytes + 500, "----!!TRIM!!", 12) == 0;
+    if (disk->base) {
+      overlay_write(disk, sector, bytes, trim);
+    } else if (trim) {
+      image_truncate(disk, (size_t)(sector * 512));
     } else {
-      fwrite(bytes, 512, 1, f);
+      image_write(disk, (size_t)(sector * 512), bytes);
+    }
+  }
+}
+
+static uint32_t cache_hash(uint32_t sector) {
+  return (sector * 2654435761u) % CACHE_SLOTS;
+}
+
+static int cache_lookup(struct Disk *disk, uint32_t sector) {
+  for (uint32_t h = cache_hash(sector); disk->cache_slot[h] != 0; h = (h + 1) % CACHE_SLOTS) {
+    int entry = disk->cache_slot[h] - 1;
+    if (disk->cache_sector[entry] == sector) {
+      return entry;
+    }
+  }
+  return -1;
+}
+
+static void cache_insert(struct Disk *disk, uint32_t sector, const uint8_t bytes[static 512]) {
+  int entry = cache_lookup(disk, sector);
+  if (entry < 0) {
+    if (disk->cache_cnt == CACHE_SECTORS) {
+      flush_cache(disk);
+    }
+    entry = (int)disk->cache_cnt++;
+    disk->cache_sector[entry] = sector;
+    uint32_t h = cache_hash(sector);
+    while (disk->cache_slot[h] != 0) {
+      h = (h + 1) % CACHE_SLOTS;
+    }
+    disk->cache_slot[h] = (uint16_t)(entry + 1);
+  }
+  memcpy(disk->cache_data[entry], bytes, 512);
+}
+
+// Writes out the cached sectors in ascending order, one fwrite per
+// run of adjacent sectors.
+static void flush_cache(struct Disk *disk) {
+  uint16_t order[CACHE_SECTORS];
+  uint32_t cnt = disk->cache_cnt;
+  if (cnt == 0) {
+    return;
+  }
+  // Insertion sort, the cache is small.
+  for (uint32_t i = 0; i < cnt; i++) {
+    uint32_t j = i;
+    while (j > 0 && disk->cache_sector[order[j-1]] > disk->cache_sector[i]) {
+      order[j] = order[j-1];
+      j--;
     }
+    order[j] = (uint16_t)i;
+  }
+  for (uint32_t i = 0; i < cnt; ) {
+    uint32_t first = disk->cache_sector[order[i]];
+    uint32_t n = 0;
+    do {
+      memcpy(disk->cache_run + n * 512, disk->cache_data[order[i]], 512);
+      n++;
+      i++;
+    } while (i < cnt && disk->cache_sector[order[i]] == first + n);
+    fseek(disk->file, (long)(first * 512), SEEK_SET);
+    fwrite(disk->cache_run, 512, n, disk->file);
   }
+  disk->cache_cnt = 0;
+  memset(disk->cache_slot, 0, sizeof(disk->cache_slot));
 }
 
+// HostFS files are known to the guest by sector numbers, which are
+// HOSTFS_SECTOR_MAGIC plus a slot in the name table. Slots that are a
+// multiple of 29 look like free sectors to Oberon and are skipped. The
+// table grows as needed, and a hash index goes from names to slots.
+// Slots of deleted and overwritten files keep their marker names, which
+// are not indexed.
+//
+// FileDir.Enumerate walks a listing of the directory, which is read
+// again when the directory has changed since.
+//
+// Files.ReadBuf and WriteBuf go through a small cache of open files,
+// least recently used first out. A file's entry is dropped when the
+// guest looks it up again (so Files.Old sees changes made on the host)
+// and before it is renamed.
 
-#define MAX_HOSTFS_FILES 4096
 #define HOSTFS_SECTOR_MAGIC 290000000
+#define HOSTFS_DELETED "~Del"
+#define HOSTFS_OVERWRITTEN "~OvW"
+#define HOSTFS_OPEN_FILES 16
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+struct HostFSOpenFile {
+  uint32_t slot;  // 0 if unused
+  int fd;
+  bool writable;
+  uint32_t last_use;
+};
 
 struct HostFS {
   struct RISC_HostFS hostfs;
   const char* dirname;
-  DIR *directory;
-  char* allocated_names[MAX_HOSTFS_FILES];
-  char* allocated_full_names[MAX_HOSTFS_FILES];
+  char** allocated_names;
+  char** allocated_full_names;
   uint32_t allocated_names_size;
+  uint32_t allocated_names_cap;
+  uint32_t* name_buckets;  // first slot per hash, 0 for none (slot 0 is never used)
+  uint32_t* name_next;     // next slot per slot
+  uint32_t name_bucket_cnt;
+  char** listing;
+  uint32_t listing_cnt, listing_cap, listing_pos;
+  bool listing_valid;
+  time_t listing_mtime, listing_time;
+  struct HostFSOpenFile open_files[HOSTFS_OPEN_FILES];
+  uint32_t use_count;
   char current_prefix[33];
 };
 
 
-static void hostfs_write(const struct RISC_HostFS *hostfs_hostfs, uint32_t value, uint32_t *ram);
+static void hostfs_write(const struct RISC_HostFS *hostfs_hostfs, uint32_t value, uint32_t *ram, uint32_t ram_size);
 static uint32_t hostfs_search_file(struct HostFS *hostfs, char *filename);
+static bool hostfs_read_listing(struct HostFS *hostfs);
 
 struct RISC_HostFS *host_fs_new(const char *directory) {
   struct HostFS *hostfs = calloc(1, sizeof(*hostfs));
@@ -223,8 +905,7 @@ struct RISC_HostFS *host_fs_new(const char *directory) {
   };
 
   hostfs->dirname = directory;
-  hostfs->directory = opendir(directory);
-  if (hostfs->directory == 0) {
+  if (!hostfs_read_listing(hostfs)) {
     fprintf(stderr, "Can't open directory \"%s\": %s\n", directory, strerror(errno));
     exit(1);
   }
@@ -232,32 +913,241 @@ struct RISC_HostFS *host_fs_new(const char *directory) {
   return &hostfs->hostfs;
 }
 
-static void hostfs_write(const struct RISC_HostFS *hostfs_hostfs, uint32_t value, uint32_t *ram) {
+static void *hostfs_realloc(void *ptr, size_t size) {
+  ptr = realloc(ptr, size);
+  if (ptr == NULL) {
+    fprintf(stderr, "Can't allocate HostFS tables\n");
+    exit(1);
+  }
+  return ptr;
+}
+
+static uint32_t hostfs_hash(const char *name) {
+  uint32_t h = 2166136261u;
+  while (*name) {
+    h = (h ^ (uint8_t)*name++) * 16777619u;
+  }
+  return h;
+}
+
+static bool hostfs_indexed(const char *name) {
+  return name != NULL && strcmp(name, HOSTFS_DELETED) != 0 && strcmp(name, HOSTFS_OVERWRITTEN) != 0;
+}
+
+static void hostfs_index(struct HostFS *hostfs, uint32_t slot) {
+  uint32_t *bucket = &hostfs->name_buckets[hostfs_hash(hostfs->allocated_names[slot]) & (hostfs->name_bucket_cnt - 1)];
+  hostfs->name_next[slot] = *bucket;
+  *bucket = slot;
+}
+
+static void hostfs_unindex(struct HostFS *hostfs, uint32_t slot) {
+  uint32_t *link = &hostfs->name_buckets[hostfs_hash(hostfs->allocated_names[slot]) & (hostfs->name_bucket_cnt - 1)];
+  while (*link != slot) {
+    link = &hostfs->name_next[*link];
+  }
+  *link = hostfs->name_next[slot];
+}
+
+static uint32_t hostfs_find(struct HostFS *hostfs, const char *name) {
+  if (hostfs->name_bucket_cnt == 0) {
+    return 0;
+  }
+  uint32_t slot = hostfs->name_buckets[hostfs_hash(name) & (hostfs->name_bucket_cnt - 1)];
+  while (slot != 0 && strcmp(hostfs->allocated_names[slot], name) != 0) {
+    slot = hostfs->name_next[slot];
+  }
+  return slot;
+}
+
+static void hostfs_set_name(struct HostFS *hostfs, uint32_t slot, const char *name, const char *full_name) {
+  if (hostfs_indexed(hostfs->allocated_names[slot])) {
+    hostfs_unindex(hostfs, slot);
+  }
+  free(hostfs->allocated_names[slot]);
+  free(hostfs->allocated_full_names[slot]);
+  hostfs->allocated_names[slot] = strdup(name);
+  hostfs->allocated_full_names[slot] = strdup(full_name);
+  if (hostfs_indexed(name)) {
+    hostfs_index(hostfs, slot);
+  }
+}
+
+static uint32_t hostfs_add(struct HostFS *hostfs, const char *name, const char *full_name) {
+  if (hostfs->allocated_names_size + 2 > hostfs->allocated_names_cap) {
+    uint32_t cap = hostfs->allocated_names_cap ? 2 * hostfs->allocated_names_cap : 1024;
+    hostfs->allocated_names = hostfs_realloc(hostfs->allocated_names, cap * sizeof(char *));
+    hostfs->allocated_full_names = hostfs_realloc(hostfs->allocated_full_names, cap * sizeof(char *));
+    hostfs->name_next = hostfs_realloc(hostfs->name_next, cap * sizeof(uint32_t));
+    hostfs->allocated_names_cap = cap;
+  }
+  if (hostfs->allocated_names_size % 29 == 0) {
+    hostfs->allocated_names[hostfs->allocated_names_size] = NULL;
+    hostfs->allocated_full_names[hostfs->allocated_names_size] = NULL;
+    hostfs->allocated_names_size++;
+  }
+  uint32_t slot = hostfs->allocated_names_size++;
+  hostfs->allocated_names[slot] = NULL;
+  hostfs->allocated_full_names[slot] = NULL;
+  if (slot >= hostfs->name_bucket_cnt) {
+    // Keep the chains short.
+    uint32_t cnt = hostfs->name_bucket_cnt ? 2 * hostfs->name_bucket_cnt : 1024;
+    hostfs->name_buckets = hostfs_realloc(hostfs->name_buckets, cnt * sizeof(uint32_t));
+    memset(hostfs->name_buckets, 0, cnt * sizeof(uint32_t));
+    hostfs->name_bucket_cnt = cnt;
+    for (uint32_t i = 0; i < slot; i++) {
+      if (hostfs_indexed(hostfs->allocated_names[i])) {
+        hostfs_index(hostfs, i);
+      }
+    }
+  }
+  hostfs_set_name(hostfs, slot, name, full_name);
+  return slot;
+}
+
+static void hostfs_close_file(struct HostFS *hostfs, uint32_t slot) {
+  for (int i = 0; i < HOSTFS_OPEN_FILES; i++) {
+    struct HostFSOpenFile *f = &hostfs->open_files[i];
+    if (f->slot == slot) {
+      close(f->fd);
+      f->slot = 0;
+    }
+  }
+}
+
+// Returns a descriptor for the file in slot, or -1.
+static int hostfs_open_file(struct HostFS *hostfs, uint32_t slot, bool writable) {
+  struct HostFSOpenFile *f = NULL;
+  for (int i = 0; i < HOSTFS_OPEN_FILES; i++) {
+    struct HostFSOpenFile *g = &hostfs->open_files[i];
+    if (g->slot == slot) {
+      f = g;
+      break;
+    }
+    if (f == NULL || (f->slot != 0 && (g->slot == 0 || g->last_use < f->last_use))) {
+      f = g;
+    }
+  }
+  if (f->slot == slot && writable && !f->writable) {
+    close(f->fd);
+    f->slot = 0;
+  }
+  if (f->slot != slot) {
+    if (f->slot != 0) {
+      close(f->fd);
+      f->slot = 0;
+    }
+    const char *path = hostfs->allocated_full_names[slot];
+    int fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_BINARY);
+    bool rw = writable;
+    if (fd == -1 && !writable) {
+      fd = open(path, O_RDWR | O_BINARY);
+      rw = true;
+    }
+    if (fd == -1) {
+      return -1;
+    }
+    *f = (struct HostFSOpenFile){ .slot = slot, .fd = fd, .writable = rw };
+  }
+  f->last_use = ++hostfs->use_count;
+  return f->fd;
+}
+
+static void hostfs_transfer(struct HostFS *hostfs, uint32_t slot, bool to_file,
+                            uint32_t pos, uint8_t *buf, uint32_t len) {
+  int fd = hostfs_open_file(hostfs, slot, to_file);
+  if (fd == -1) {
+    return;
+  }
+  while (len > 0) {
+#ifdef _WIN32
+    lseek(fd, (off_t)pos, SEEK_SET);
+    int n = to_file ? _write(fd, buf, (unsigned)len) : _read(fd, buf, (unsigned)len);
+#else
+    ssize_t n = to_file ? pwrite(fd, buf, len, (off_t)pos) : pread(fd, buf, len, (off_t)pos);
+#endif
+    if (n <= 0) {
+      break;
+    }
+    pos += (uint32_t)n;
+    buf += n;
+    len -= (uint32_t)n;
+  }
+}
+
+static bool hostfs_read_listing(struct HostFS *hostfs) {
+  DIR *directory = opendir(hostfs->dirname);
+  if (directory == NULL) {
+    return false;
+  }
+  for (uint32_t i = 0; i < hostfs->listing_cnt; i++) {
+    free(hostfs->listing[i]);
+  }
+  hostfs->listing_cnt = 0;
+  struct dirent *entry;
+  while ((entry = readdir(directory)) != NULL) {
+    if (entry->d_name[0] == '~' || entry->d_name[0] == '.') {
+      continue;
+    }
+    if (hostfs->listing_cnt == hostfs->listing_cap) {
+      hostfs->listing_cap = hostfs->listing_cap ? 2 * hostfs->listing_cap : 256;
+      hostfs->listing = hostfs_realloc(hostfs->listing, hostfs->listing_cap * sizeof(char *));
+    }
+    hostfs->listing[hostfs->listing_cnt++] = strdup(entry->d_name);
+  }
+  closedir(directory);
+  hostfs->listing_valid = true;
+  hostfs->listing_time = time(NULL);
+  return true;
+}
+
+// The modification time only has a resolution of seconds, so a listing
+// is trusted only if it was read after the second the directory last
+// changed in.
+static void hostfs_refresh_listing(struct HostFS *hostfs) {
+  struct stat buf;
+  if (stat(hostfs->dirname, &buf) != 0) {
+    return;
+  }
+  if (!hostfs->listing_valid || buf.st_mtime != hostfs->listing_mtime || hostfs->listing_mtime >= hostfs->listing_time) {
+    hostfs->listing_mtime = buf.st_mtime;
+    hostfs_read_listing(hostfs);
+  }
+}
+
+static void hostfs_write(const struct RISC_HostFS *hostfs_hostfs, uint32_t value, uint32_t *ram, uint32_t ram_size) {
   struct HostFS *hostfs = (struct HostFS *)hostfs_hostfs;
   uint32_t offset = value / 4;
+  // Request blocks have a name of up to 32 bytes at word 2.
+  if (offset >= ram_size / 4 - 10) {
+    return;
+  }
   switch(ram[offset]) {
     case 0: { // FileDir.Search
       ram[offset+1] = hostfs_search_file(hostfs, (char*) (ram+offset+2));
+      hostfs_close_file(hostfs, ram[offset+1] - HOSTFS_SECTOR_MAGIC);
       break;
     }
     case 1: { // FileDir.Enumerate Start
       strncpy(hostfs->current_prefix,  (char*) (ram+offset+2), sizeof(hostfs->current_prefix)-1);
-      rewinddir(hostfs->directory);
+      hostfs_refresh_listing(hostfs);
+      hostfs->listing_pos = 0;
       // FALL THROUGH
     }
     case 2: { // FileDir.Enumerate Next
-      struct dirent *entry = readdir(hostfs->directory);
-      while(entry != NULL) {
-        if (strncmp(hostfs->current_prefix, entry->d_name, strlen(hostfs->current_prefix)) == 0 && entry->d_name[0] != '~' && entry->d_name[0] != '.') {
+      size_t prefix_len = strlen(hostfs->current_prefix);
+      char *name = NULL;
+      while (hostfs->listing_pos < hostfs->listing_cnt) {
+        char *entry = hostfs->listing[hostfs->listing_pos++];
+        if (strncmp(hostfs->current_prefix, entry, prefix_len) == 0) {
+          name = entry;
           break;
         }
-        entry = readdir(hostfs->directory);
       }
-      if (entry == NULL) {
+      if (name == NULL) {
         ram[offset + 1] = 0;
       } else {
-        ram[offset+1] = hostfs_search_file(hostfs, entry->d_name);
-        strcpy((char*) (ram+offset+2), entry->d_name);
+        ram[offset+1] = hostfs_search_file(hostfs, name);
+        strcpy((char*) (ram+offset+2), name);
       }
       break;
     }
@@ -279,32 +1169,23 @@ static void hostfs_write(const struct RISC_HostFS *hostfs_hostfs, uint32_t value
       char newFullName[256];
       if (sector < hostfs->allocated_names_size && hostfs->allocated_names[sector] != NULL && hostfs->allocated_names[sector][0] == '~' && snprintf(newFullName, sizeof(newFullName), "%s/%s", hostfs->dirname, fileName) < (int) sizeof(newFullName)) {
         if (access(newFullName, F_OK) != -1) {
-          int pos = -1;
-          for (uint32_t i = 0; i < hostfs->allocated_names_size; i++) {
-            if (hostfs->allocated_names[i] != NULL && strcmp(hostfs->allocated_names[i], fileName) == 0) {
-              pos = i;
-              break;
-            }
-          }
-          if (pos == -1) {
+          uint32_t pos = hostfs_find(hostfs, fileName);
+          if (pos == 0) {
             unlink(newFullName);
           } else {
            char template[256];
-           snprintf(template, sizeof(template), "%s/~OvW~XXXXXX", hostfs->dirname);
+           snprintf(template, sizeof(template), "%s/" HOSTFS_OVERWRITTEN "~XXXXXX", hostfs->dirname);
            close(mkstemp(template));
            unlink(template);
+           hostfs_close_file(hostfs, pos);
            rename(newFullName, template);
-           free(hostfs->allocated_names[pos]);
-           free(hostfs->allocated_full_names[pos]);
-           hostfs->allocated_names[pos] = strdup("~OvW");
-           hostfs->allocated_full_names[pos] = strdup(template);
+           hostfs_set_name(hostfs, pos, HOSTFS_OVERWRITTEN, template);
           }
         }
+        hostfs_close_file(hostfs, sector);
         rename(hostfs->allocated_full_names[sector], newFullName);
-        free(hostfs->allocated_names[sector]);
-        free(hostfs->allocated_full_names[sector]);
-        hostfs->allocated_names[sector] = strdup(fileName);
-        hostfs->allocated_full_names[sector] = strdup(newFullName);
+        hostfs_set_name(hostfs, sector, fileName, newFullName);
+        hostfs->listing_valid = false;
       }
       break;
     }
@@ -313,14 +1194,13 @@ static void hostfs_write(const struct RISC_HostFS *hostfs_hostfs, uint32_t value
       ram[offset + 1] = sector;
       if (sector != 0) {
         char template[256];
-        snprintf(template, sizeof(template), "%s/~Del~%s_XXXXXX", hostfs->dirname, (char*) (ram+offset+2));
+        snprintf(template, sizeof(template), "%s/" HOSTFS_DELETED "~%s_XXXXXX", hostfs->dirname, (char*) (ram+offset+2));
         close(mkstemp(template));
         unlink(template);
+        hostfs_close_file(hostfs, sector - HOSTFS_SECTOR_MAGIC);
         rename(hostfs->allocated_full_names[sector - HOSTFS_SECTOR_MAGIC], template);
-        free(hostfs->allocated_names[sector - HOSTFS_SECTOR_MAGIC]);
-        free(hostfs->allocated_full_names[sector - HOSTFS_SECTOR_MAGIC]);
-        hostfs->allocated_names[sector - HOSTFS_SECTOR_MAGIC] = strdup("~Del");
-        hostfs->allocated_full_names[sector - HOSTFS_SECTOR_MAGIC] = strdup(template);
+        hostfs_set_name(hostfs, sector - HOSTFS_SECTOR_MAGIC, HOSTFS_DELETED, template);
+        hostfs->listing_valid = false;
       }
       break;
     }
@@ -331,23 +1211,13 @@ static void hostfs_write(const struct RISC_HostFS *hostfs_hostfs, uint32_t value
       ram[offset + 1] = hostfs_search_file(hostfs, strrchr(template, '/') + 1);
       break;
     }
-    case 7: { // Files.ReadBuf
-      uint32_t sector = ram[offset + 1] - HOSTFS_SECTOR_MAGIC;
-      if (sector < hostfs->allocated_names_size) {
-        FILE *fd = fopen(hostfs->allocated_full_names[sector], "rb");
-        fseek(fd, ram[offset+2], SEEK_SET);
-        fread(&ram[ram[offset + 4]/4], ram[offset + 3], 1, fd);
-        fclose(fd);
-      }
-      break;
-    }
+    case 7:   // Files.ReadBuf
     case 8: { // Files.WriteBuf
       uint32_t sector = ram[offset + 1] - HOSTFS_SECTOR_MAGIC;
-      if (sector < hostfs->allocated_names_size) {
-        FILE *fd = fopen(hostfs->allocated_full_names[sector], "rb+");
-        fseek(fd, ram[offset+2], SEEK_SET);
-        fwrite(&ram[ram[offset + 4]/4], ram[offset + 3], 1, fd);
-        fclose(fd);
+      uint32_t pos = ram[offset + 2], len = ram[offset + 3], buf = ram[offset + 4] / 4 * 4;
+      if (sector < hostfs->allocated_names_size && hostfs->allocated_names[sector] != NULL &&
+          len <= ram_size && buf <= ram_size - len) {
+        hostfs_transfer(hostfs, sector, ram[offset] == 8, pos, (uint8_t *)ram + buf, len);
       }
       break;
     }
@@ -355,19 +1225,13 @@ static void hostfs_write(const struct RISC_HostFS *hostfs_hostfs, uint32_t value
 }
 
 static uint32_t hostfs_search_file(struct HostFS *hostfs, char *filename) {
-  for (uint32_t i = 0; i < hostfs->allocated_names_size; i++) {
-    if (hostfs->allocated_names[i] != NULL && strcmp(hostfs->allocated_names[i], filename) == 0) {
-      return HOSTFS_SECTOR_MAGIC + i;
-    }
+  uint32_t slot = hostfs_find(hostfs, filename);
+  if (slot != 0) {
+    return HOSTFS_SECTOR_MAGIC + slot;
   }
   char fullname[256];
-  if (hostfs->allocated_names_size < MAX_HOSTFS_FILES - 1 && snprintf(fullname, sizeof(fullname), "%s/%s", hostfs->dirname, filename) < (int) sizeof(fullname) && access(fullname, F_OK) != -1) {
-    if (hostfs->allocated_names_size % 29 == 0)
-      hostfs->allocated_names_size++;
-    hostfs->allocated_names[hostfs->allocated_names_size] = strdup(filename);
-    hostfs->allocated_full_names[hostfs->allocated_names_size] = strdup(fullname);
-    hostfs->allocated_names_size++;
-    return HOSTFS_SECTOR_MAGIC + hostfs->allocated_names_size - 1;
+  if (hostfs_indexed(filename) && snprintf(fullname, sizeof(fullname), "%s/%s", hostfs->dirname, filename) < (int) sizeof(fullname) && access(fullname, F_OK) != -1) {
+    return HOSTFS_SECTOR_MAGIC + hostfs_add(hostfs, filename, fullname);
   }
   return 0;
 }
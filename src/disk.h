@@ -1,10 +1,45 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <stdint.h>
 #include "risc-io.h"
 
 struct RISC_SPI *disk_new(const char *filename);
 
+// Leaves the image untouched and keeps all changes in the overlay
+// file, which is created if needed.
+struct RISC_SPI *disk_new_overlay(const char *filename, const char *overlay);
+
+// Starts a new overlay with the contents of an existing one, taking
+// over the controller state. The old one must not be used afterwards.
+struct RISC_SPI *disk_copy_overlay(struct RISC_SPI *disk, const char *filename, const char *overlay);
+
+// Writes the combined image to output, or back into the base image
+// when output is NULL. The overlay is removed in that case.
+void disk_merge_overlay(const char *filename, const char *overlay, const char *output);
+
+// When writes to the disk image are pushed to the host's disk.
+enum DiskSync {
+  DISK_SYNC_NONE,   // whenever the host OS sees fit
+  DISK_SYNC_ASYNC,  // start writing back after every sector
+  DISK_SYNC_FULL,   // wait for every sector to reach the disk
+};
+
+void disk_set_sync(struct RISC_SPI *disk, enum DiskSync sync);
+
+// Writes out sectors that are held back in memory. Front ends call
+// this every now and then, and before exiting.
+void disk_flush(struct RISC_SPI *disk);
+
+// Traffic since the disk was opened. Sectors count both the SPI
+// protocol and block DMA.
+struct DiskStats {
+  uint64_t spi_bytes;  // both ways
+  uint64_t sectors_read, sectors_written;
+};
+
+void disk_get_stats(struct RISC_SPI *disk, struct DiskStats *stats);
+
 struct RISC_HostFS *host_fs_new(const char *directory);
 
 #endif  // DISK_H
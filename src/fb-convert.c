@@ -0,0 +1,183 @@
+#include <stdint.h>
+#include "fb-convert.h"
+
+// Full screen updates happen whenever the palette changes, and the
+// framebuffer can be 2048x2048, so these loops are worth vectorizing.
+// Monochrome pixels are picked by comparing each lane against its own
+// bit; colors are looked up with byte shuffles on the four byte planes
+// of the palette. The instruction set is chosen at compile time: SSE2
+// comes with every x86-64 compiler, build with -mssse3 or -mavx2 for
+// more.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(__SSSE3__) || (defined(__aarch64__) && !defined(__ARM_BIG_ENDIAN))
+#define COLOR_SHUFFLE 1
+#endif
+
+void fb_convert_mono(const uint32_t *in, int words, uint32_t *out, uint32_t off, uint32_t on) {
+#if defined(__AVX2__)
+  const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m256i off_v = _mm256_set1_epi32((int)off);
+  const __m256i on_v = _mm256_set1_epi32((int)on);
+  for (int i = 0; i < words; i++) {
+    __m256i w = _mm256_set1_epi32((int)in[i]);
+    for (int b = 0; b < 32; b += 8) {
+      __m256i sel = _mm256_cmpeq_epi32(_mm256_and_si256(w, bits), bits);
+      _mm256_storeu_si256((__m256i *)(out + b), _mm256_blendv_epi8(off_v, on_v, sel));
+      w = _mm256_srli_epi32(w, 8);
+    }
+    out += 32;
+  }
+#elif defined(__SSE2__)
+  const __m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+  const __m128i off_v = _mm_set1_epi32((int)off);
+  const __m128i on_v = _mm_set1_epi32((int)on);
+  for (int i = 0; i < words; i++) {
+    __m128i w = _mm_set1_epi32((int)in[i]);
+    for (int b = 0; b < 32; b += 4) {
+      __m128i sel = _mm_cmpeq_epi32(_mm_and_si128(w, bits), bits);
+      __m128i px = _mm_or_si128(_mm_and_si128(sel, on_v), _mm_andnot_si128(sel, off_v));
+      _mm_storeu_si128((__m128i *)(out + b), px);
+      w = _mm_srli_epi32(w, 4);
+    }
+    out += 32;
+  }
+#elif defined(__ARM_NEON)
+  static const uint32_t bit_lanes[4] = { 1, 2, 4, 8 };
+  const uint32x4_t bits = vld1q_u32(bit_lanes);
+  const uint32x4_t off_v = vdupq_n_u32(off);
+  const uint32x4_t on_v = vdupq_n_u32(on);
+  for (int i = 0; i < words; i++) {
+    uint32x4_t w = vdupq_n_u32(in[i]);
+    for (int b = 0; b < 32; b += 4) {
+      vst1q_u32(out + b, vbslq_u32(vtstq_u32(w, bits), on_v, off_v));
+      w = vshrq_n_u32(w, 4);
+    }
+    out += 32;
+  }
+#else
+  for (int i = 0; i < words; i++) {
+    uint32_t pixels = in[i];
+    for (int b = 0; b < 32; b++) {
+      *out++ = (pixels & 1) ? on : off;
+      pixels >>= 1;
+    }
+  }
+#endif
+}
+
+void fb_convert_mono16(const uint32_t *in, int words, uint16_t *out, uint16_t off, uint16_t on) {
+#if defined(__AVX2__)
+  const __m256i bits = _mm256_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128,
+                                         256, 512, 1024, 2048, 4096, 8192, 16384,
+                                         (short)0x8000);
+  const __m256i off_v = _mm256_set1_epi16((short)off);
+  const __m256i on_v = _mm256_set1_epi16((short)on);
+  for (int i = 0; i < words; i++) {
+    for (int b = 0; b < 32; b += 16) {
+      __m256i w = _mm256_set1_epi16((short)(uint16_t)(in[i] >> b));
+      __m256i sel = _mm256_cmpeq_epi16(_mm256_and_si256(w, bits), bits);
+      _mm256_storeu_si256((__m256i *)(out + b), _mm256_blendv_epi8(off_v, on_v, sel));
+    }
+    out += 32;
+  }
+#elif defined(__SSE2__)
+  const __m128i bits = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m128i off_v = _mm_set1_epi16((short)off);
+  const __m128i on_v = _mm_set1_epi16((short)on);
+  for (int i = 0; i < words; i++) {
+    for (int b = 0; b < 32; b += 8) {
+      __m128i w = _mm_set1_epi16((short)((in[i] >> b) & 0xFF));
+      __m128i sel = _mm_cmpeq_epi16(_mm_and_si128(w, bits), bits);
+      __m128i px = _mm_or_si128(_mm_and_si128(sel, on_v), _mm_andnot_si128(sel, off_v));
+      _mm_storeu_si128((__m128i *)(out + b), px);
+    }
+    out += 32;
+  }
+#elif defined(__ARM_NEON)
+  static const uint16_t bit_lanes[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+  const uint16x8_t bits = vld1q_u16(bit_lanes);
+  const uint16x8_t off_v = vdupq_n_u16(off);
+  const uint16x8_t on_v = vdupq_n_u16(on);
+  for (int i = 0; i < words; i++) {
+    for (int b = 0; b < 32; b += 8) {
+      uint16x8_t w = vdupq_n_u16((uint16_t)((in[i] >> b) & 0xFF));
+      vst1q_u16(out + b, vbslq_u16(vtstq_u16(w, bits), on_v, off_v));
+    }
+    out += 32;
+  }
+#else
+  for (int i = 0; i < words; i++) {
+    uint32_t pixels = in[i];
+    for (int b = 0; b < 32; b++) {
+      *out++ = (pixels & 1) ? on : off;
+      pixels >>= 1;
+    }
+  }
+#endif
+}
+
+void fb_convert_color(const uint32_t *in, int words, uint32_t *out, const uint32_t *palette) {
+  int i = 0;
+#ifdef COLOR_SHUFFLE
+  // Two words at a time: sixteen nibbles index each byte plane.
+  uint8_t planes[4][16];
+  for (int c = 0; c < 16; c++) {
+    for (int p = 0; p < 4; p++) {
+      planes[p][c] = (uint8_t)(palette[c] >> (8 * p));
+    }
+  }
+#if defined(__SSSE3__)
+  const __m128i p0 = _mm_loadu_si128((const __m128i *)planes[0]);
+  const __m128i p1 = _mm_loadu_si128((const __m128i *)planes[1]);
+  const __m128i p2 = _mm_loadu_si128((const __m128i *)planes[2]);
+  const __m128i p3 = _mm_loadu_si128((const __m128i *)planes[3]);
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  for (; i + 2 <= words; i += 2) {
+    __m128i x = _mm_loadl_epi64((const __m128i *)(in + i));
+    __m128i lo = _mm_and_si128(x, nibble);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), nibble);
+    __m128i idx = _mm_unpacklo_epi8(lo, hi);
+    __m128i b0 = _mm_shuffle_epi8(p0, idx);
+    __m128i b1 = _mm_shuffle_epi8(p1, idx);
+    __m128i b2 = _mm_shuffle_epi8(p2, idx);
+    __m128i b3 = _mm_shuffle_epi8(p3, idx);
+    __m128i b01lo = _mm_unpacklo_epi8(b0, b1), b01hi = _mm_unpackhi_epi8(b0, b1);
+    __m128i b23lo = _mm_unpacklo_epi8(b2, b3), b23hi = _mm_unpackhi_epi8(b2, b3);
+    _mm_storeu_si128((__m128i *)(out + 0), _mm_unpacklo_epi16(b01lo, b23lo));
+    _mm_storeu_si128((__m128i *)(out + 4), _mm_unpackhi_epi16(b01lo, b23lo));
+    _mm_storeu_si128((__m128i *)(out + 8), _mm_unpacklo_epi16(b01hi, b23hi));
+    _mm_storeu_si128((__m128i *)(out + 12), _mm_unpackhi_epi16(b01hi, b23hi));
+    out += 16;
+  }
+#else
+  uint8x16x4_t p = {{ vld1q_u8(planes[0]), vld1q_u8(planes[1]),
+                      vld1q_u8(planes[2]), vld1q_u8(planes[3]) }};
+  for (; i + 2 <= words; i += 2) {
+    uint8x8_t x = vld1_u8((const uint8_t *)(in + i));
+    uint8x8x2_t z = vzip_u8(vand_u8(x, vdup_n_u8(0x0F)), vshr_n_u8(x, 4));
+    uint8x16_t idx = vcombine_u8(z.val[0], z.val[1]);
+    uint8x16x4_t px = {{ vqtbl1q_u8(p.val[0], idx), vqtbl1q_u8(p.val[1], idx),
+                         vqtbl1q_u8(p.val[2], idx), vqtbl1q_u8(p.val[3], idx) }};
+    vst4q_u8((uint8_t *)out, px);
+    out += 16;
+  }
+#endif
+#endif  // COLOR_SHUFFLE
+  for (; i < words; i++) {
+    uint32_t pixels = in[i];
+    for (int b = 0; b < 8; b++) {
+      *out++ = palette[pixels & 0xF];
+      pixels >>= 4;
+    }
+  }
+}
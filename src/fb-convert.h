@@ -0,0 +1,14 @@
+#ifndef FB_CONVERT_H
+#define FB_CONVERT_H
+
+#include <stdint.h>
+
+// Expand framebuffer words to pixels, least significant bits first.
+// Monochrome words hold 32 pixels, which become off or on; 16-color
+// words hold 8 pixels, which are looked up in palette.
+
+void fb_convert_mono(const uint32_t *in, int words, uint32_t *out, uint32_t off, uint32_t on);
+void fb_convert_mono16(const uint32_t *in, int words, uint16_t *out, uint16_t off, uint16_t on);
+void fb_convert_color(const uint32_t *in, int words, uint32_t *out, const uint32_t *palette);
+
+#endif  // FB_CONVERT_H
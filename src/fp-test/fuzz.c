@@ -0,0 +1,67 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ref-fp.h"
+#include "numbers.inc"
+
+// Differential test of risc-fp.c against the step by step reference
+// in ref-fp.c. Operands come from the interesting numbers in
+// numbers.inc, from random bits, and from random numbers with nearby
+// exponents, where addition normalizes the most.
+//
+// Usage: fuzz [ROUNDS [SEED]]
+
+static uint64_t state;
+
+static uint32_t rnd(void) {
+  // xorshift64*
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return (uint32_t)((state * 2685821657736338717ULL) >> 32);
+}
+
+static uint32_t operand(void) {
+  switch (rnd() % 4) {
+    case 0: return numbers[rnd() % numbers_cnt];
+    case 1: return rnd();
+    case 2: return (rnd() & 0x807FFFFF) | ((126 + rnd() % 4) << 23);
+    default: return rnd() % 64 - 32;
+  }
+}
+
+static int errors = 0;
+
+static void check(const char *op, uint32_t x, uint32_t y, uint32_t ref, uint32_t fp) {
+  if (ref != fp && errors < 10) {
+    printf("%s: %08x %08x => ref %08x | fp %08x\n", op, x, y, ref, fp);
+  }
+  errors += ref != fp;
+}
+
+int main(int argc, char **argv) {
+  long rounds = argc > 1 ? atol(argv[1]) : 10000000;
+  state = argc > 2 ? strtoull(argv[2], NULL, 0) : 0x2545F4914F6CDD1DULL;
+  if (state == 0) {
+    state = 1;
+  }
+  for (long i = 0; i < rounds; i++) {
+    uint32_t x = operand();
+    uint32_t y = operand();
+    check("add", x, y, ref_fp_add(x, y, 0, 0), fp_add(x, y, 0, 0));
+    check("flt", x, y, ref_fp_add(x, y, 1, 0), fp_add(x, y, 1, 0));
+    check("flr", x, y, ref_fp_add(x, y, 0, 1), fp_add(x, y, 0, 1));
+    check("add-uv", x, y, ref_fp_add(x, y, 1, 1), fp_add(x, y, 1, 1));
+    check("mul", x, y, ref_fp_mul(x, y), fp_mul(x, y));
+    check("div", x, y, ref_fp_div(x, y), fp_div(x, y));
+    for (int s = 0; s < 2; s++) {
+      struct idiv r = ref_idiv(x, y, s), d = idiv(x, y, s);
+      check(s ? "idiv-quot" : "udiv-quot", x, y, r.quot, d.quot);
+      check(s ? "idiv-rem" : "udiv-rem", x, y, r.rem, d.rem);
+    }
+  }
+  printf("fuzz: errors: %d tests: %ld\n", errors, rounds * 10);
+  return errors != 0;
+}
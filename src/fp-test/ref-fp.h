@@ -0,0 +1,11 @@
+#ifndef REF_FP_H
+#define REF_FP_H
+
+#include "../risc-fp.h"
+
+uint32_t ref_fp_add(uint32_t x, uint32_t y, bool u, bool v);
+uint32_t ref_fp_mul(uint32_t x, uint32_t y);
+uint32_t ref_fp_div(uint32_t x, uint32_t y);
+struct idiv ref_idiv(uint32_t x, uint32_t y, bool signed_div);
+
+#endif  // REF_FP_H
@@ -0,0 +1,585 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#include "risc.h"
+#include "risc-io.h"
+#include "disk.h"
+#include "pclink.h"
+#include "raw-serial.h"
+#include "scheduler.h"
+
+// Runs the emulator without a display, as fast as the host allows.
+// Guest time follows the emulated cycles instead of the wall clock,
+// and slices in which the guest goes idle count as a full
+// millisecond, so waiting for the timer costs nothing.
+//
+// With --fork, the guest boots once and is then forked into several
+// jobs that share its memory until they write to it. Each job gets
+// its own copy of the disk overlay and its own serial files and HostFS
+// directory, named by replacing %d in the paths with the job number.
+//
+// With --machines, that many guests run as threads of this process
+// instead, each booting on its own. Their jobs are numbered from 1.
+//
+// With --replay, the guest gets the input of a --record session
+// instead of the clock, as fast as it can take it. At the end the
+// instruction count and a hash of the machine state are printed, so
+// that builds can be compared on the same workload.
+
+#define CPU_HZ 25000000
+#define MAX_HEIGHT 2048
+#define MAX_WIDTH  2048
+
+static uint32_t exit_led, ready_led;
+static bool exit_led_option, ready_led_option, leds_option;
+static int fb_width = RISC_FRAMEBUFFER_WIDTH, fb_height = RISC_FRAMEBUFFER_HEIGHT;
+static bool size_option, rtc_option, color_option, jit_option;
+static int mem_option;
+static int timeout;
+static const char *disk_image;
+static const char *serial_in, *serial_out, *hostfs, *pclink_dir;
+static bool boot_from_serial;
+static enum DiskSync disk_sync = DISK_SYNC_NONE;
+static const char *overlay;
+static const char *snapshot;
+static const char *profile;
+static const char *record, *replay;
+
+struct Guest {
+  struct RISC_LED leds;
+  struct RISC *risc;
+  struct RISC_SPI *disk;
+  int job;
+  bool exit_requested, ready, resumed;
+  int status;
+  time_t started;
+};
+
+static struct option long_options[] = {
+  { "leds",             no_argument,       NULL, 'L' },
+  { "rtc",              no_argument,       NULL, 'r' },
+  { "mem",              required_argument, NULL, 'm' },
+  { "size",             required_argument, NULL, 's' },
+  { "serial-in",        required_argument, NULL, 'I' },
+  { "serial-out",       required_argument, NULL, 'O' },
+  { "boot-from-serial", no_argument,       NULL, 'S' },
+  { "color",            no_argument,       NULL, 'c' },
+  { "hostfs",           required_argument, NULL, 'H' },
+  { "jit",              no_argument,       NULL, 'j' },
+  { "exit-led",         required_argument, NULL, 'x' },
+  { "timeout",          required_argument, NULL, 't' },
+  { "disk-sync",        required_argument, NULL, 'D' },
+  { "overlay",          required_argument, NULL, 'o' },
+  { "snapshot",         required_argument, NULL, 'N' },
+  { "fork",             required_argument, NULL, 'F' },
+  { "ready-led",        required_argument, NULL, 'R' },
+  { "machines",         required_argument, NULL, 'M' },
+  { "threads",          required_argument, NULL, 'T' },
+  { "pclink",           required_argument, NULL, 'P' },
+  { "profile",          required_argument, NULL, 'p' },
+  { "record",           required_argument, NULL, 'W' },
+  { "replay",           required_argument, NULL, 'Y' },
+  { NULL,               no_argument,       NULL, 0   }
+};
+
+static void usage() {
+  puts("Usage: risc-headless [OPTIONS...] DISK-IMAGE\n"
+       "\n"
+       "Options:\n"
+       "  --leds                Log LED state on stdout\n"
+       "  --mem MEGS            Set memory size\n"
+       "  --color               Use 16 color mode (requires modified Display.Mod)\n"
+       "  --size WIDTHxHEIGHT   Set framebuffer size, up to 2048x2048\n"
+       "  --boot-from-serial    Boot from serial line (disk image not required)\n"
+       "  --serial-in FILE      Read serial input from FILE\n"
+       "  --serial-out FILE     Write serial output to FILE\n"
+       "  --hostfs DIRECTORY    Use DIRECTORY as HostFS directory\n"
+       "  --pclink DIRECTORY    Look for PCLink jobs in DIRECTORY\n"
+       "  --disk-sync MODE      Flush disk writes: none, async or full\n"
+       "  --overlay FILE        Keep disk changes in FILE, not in DISK-IMAGE\n"
+       "  --snapshot FILE       Resume from FILE, or create it at --exit-led\n"
+       "                        (at --ready-led with --fork)\n"
+       "  --fork JOBS           Fork into JOBS copies at --ready-led (needs --overlay)\n"
+       "  --ready-led VALUE     The LED value that signals the guest is ready to fork\n"
+       "  --machines COUNT      Run COUNT guests in this process (needs --overlay)\n"
+       "  --threads COUNT       Run the --machines on COUNT host threads\n"
+       "  --jit                 Translate hot code to native instructions\n"
+       "  --exit-led VALUE      Exit when the guest shows VALUE on the LEDs\n"
+       "  --timeout SECONDS     Give up after SECONDS of wall clock time\n"
+       "  --profile FILE        Write where the guest spent its time to FILE\n"
+       "                        and FILE.folded on exit\n"
+       "  --record FILE         Log all input to FILE\n"
+       "  --replay FILE         Run the input logged in FILE again, then exit\n"
+       "\n"
+       "Exits with 0 after --exit-led or --replay, with 2 on timeout, and with 3\n"
+       "if the guest diverged from the --replay.\n"
+       );
+  exit(1);
+}
+
+static void write_leds(const struct RISC_LED *leds, uint32_t value) {
+  struct Guest *guest = (struct Guest *)leds;
+  if (leds_option) {
+    // One printf, so that lines of different --machines don't mix.
+    char text[9];
+    for (int i = 7; i >= 0; i--) {
+      text[7 - i] = (value & (1 << i)) ? (char)('0' + i) : '-';
+    }
+    text[8] = 0;
+    printf("LEDs: %s\n", text);
+  }
+  if (exit_led_option && value == exit_led) {
+    guest->exit_requested = true;
+  }
+  if (ready_led_option && value == ready_led) {
+    guest->ready = true;
+  }
+}
+
+static int parse_led(const char *arg) {
+  int value;
+  if (sscanf(arg, "%i", &value) != 1) {
+    usage();
+  }
+  return value;
+}
+
+// Replaces %d in path with the job number.
+static const char *job_path(const char *path, int job) {
+  const char *pos = path ? strstr(path, "%d") : NULL;
+  if (pos == NULL) {
+    return path;
+  }
+  size_t len = strlen(path) + 16;
+  char *result = malloc(len);
+  snprintf(result, len, "%.*s%d%s", (int)(pos - path), path, job, pos + 2);
+  return result;
+}
+
+static void set_channels(struct RISC *risc, int job) {
+  if (serial_in || serial_out) {
+    const char *in = serial_in ? job_path(serial_in, job) : "/dev/null";
+    const char *out = serial_out ? job_path(serial_out, job) : "/dev/null";
+    risc_set_serial(risc, raw_serial_new(in, out));
+  } else {
+    risc_set_serial(risc, pclink_new(job_path(pclink_dir, job)));
+  }
+  if (hostfs) {
+    risc_set_host_fs(risc, host_fs_new(job_path(hostfs, job)));
+  }
+}
+
+static void guest_init(struct Guest *guest, int job) {
+  *guest = (struct Guest){
+    .leds = { .write = write_leds },
+    .risc = risc_new(),
+    .job = job
+  };
+  struct RISC *risc = guest->risc;
+  risc_set_leds(risc, &guest->leds);
+  if (boot_from_serial) {
+    risc_set_switches(risc, 1);
+  }
+  if (profile && !risc_set_profile(risc, RISC_PROFILE_PERIOD)) {
+    fprintf(stderr, "Can't allocate the profiler\n");
+    exit(1);
+  }
+  if (jit_option && !risc_set_jit(risc, true) && job <= 1) {
+    fprintf(stderr, "No JIT for this host, using the interpreter.\n");
+  }
+  if (mem_option || size_option || rtc_option || color_option) {
+    risc_configure_memory(risc, mem_option, rtc_option, fb_width, fb_height, color_option);
+  }
+
+  if (disk_image && overlay) {
+    guest->disk = disk_new_overlay(disk_image, job_path(overlay, job));
+  } else {
+    guest->disk = disk_new(disk_image);
+  }
+  disk_set_sync(guest->disk, disk_sync);
+  risc_set_spi(risc, 1, guest->disk);
+
+  set_channels(risc, job);
+
+  if (snapshot) {
+    guest->resumed = risc_load_snapshot(risc, snapshot);
+    if (!guest->resumed && errno != ENOENT) {
+      fprintf(stderr, "Can't load snapshot \"%s\": %s\n", snapshot, strerror(errno));
+      exit(1);
+    }
+    // Snapshots for --fork are taken once the guest is ready.
+    guest->ready = guest->resumed;
+  }
+  if (record && !risc_record(risc, record)) {
+    fprintf(stderr, "Can't record to \"%s\": %s\n", record, strerror(errno));
+    exit(1);
+  }
+  if (replay && !risc_replay(risc, replay)) {
+    fprintf(stderr, "Can't replay \"%s\": %s\n", replay, strerror(errno));
+    exit(1);
+  }
+  guest->started = time(NULL);
+}
+
+// Checking the clock once per emulated second is plenty.
+static bool poll_guest(void *arg, uint32_t tick) {
+  struct Guest *guest = arg;
+  if (guest->exit_requested) {
+    return false;
+  }
+  if (replay && risc_replay_state(guest->risc) != RISC_REPLAY_RUNNING) {
+    return false;
+  }
+  if (tick % 1000 == 0) {
+    disk_flush(guest->disk);
+    if (timeout > 0 && difftime(time(NULL), guest->started) >= timeout) {
+      if (guest->job > 0) {
+        fprintf(stderr, "Timeout after %d seconds in job %d\n", timeout, guest->job);
+      } else {
+        fprintf(stderr, "Timeout after %d seconds\n", timeout);
+      }
+      guest->status = 2;
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool write_profile(struct Guest *guest) {
+  const char *path = job_path(profile, guest->job);
+  if (path && !risc_write_profile(guest->risc, path)) {
+    fprintf(stderr, "Can't write profile \"%s\": %s\n", path, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+// FNV-1a of everything in a snapshot.
+static uint64_t state_hash(struct RISC *risc) {
+  size_t size = risc_save_state(risc, NULL);
+  uint8_t *buf = malloc(size);
+  if (buf == NULL) {
+    fprintf(stderr, "Can't allocate the machine state\n");
+    exit(1);
+  }
+  risc_save_state(risc, buf);
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ buf[i]) * 0x100000001b3;
+  }
+  free(buf);
+  return hash;
+}
+
+static bool end_replay(struct Guest *guest, clock_t started) {
+  struct RISC *risc = guest->risc;
+  if (record && !risc_record(risc, NULL)) {
+    fprintf(stderr, "Can't record to \"%s\": %s\n", record, strerror(errno));
+    return false;
+  }
+  if (replay) {
+    double seconds = (double)(clock() - started) / CLOCKS_PER_SEC;
+    uint64_t instructions = risc_get_instructions(risc);
+    printf("replay: instructions=%llu seconds=%.3f mips=%.1f state=%016llx\n",
+           (unsigned long long)instructions, seconds,
+           seconds > 0 ? (double)instructions / seconds / 1e6 : 0.0,
+           (unsigned long long)state_hash(risc));
+    if (risc_replay_state(risc) == RISC_REPLAY_DIVERGED) {
+      guest->status = 3;
+    }
+  }
+  return true;
+}
+
+static bool save_snapshot(struct Guest *guest) {
+  disk_flush(guest->disk);
+  if (snapshot && !guest->resumed && !risc_save_snapshot(guest->risc, snapshot)) {
+    fprintf(stderr, "Can't save snapshot \"%s\": %s\n", snapshot, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+// Only the first machine creates the snapshot. The exit status is
+// that of the first machine that failed.
+static int run_machines(int machines, int threads) {
+  struct Guest *guests = calloc((size_t)machines, sizeof(*guests));
+  if (guests == NULL) {
+    fprintf(stderr, "Can't allocate machines\n");
+    return 1;
+  }
+  struct Scheduler *sched = scheduler_new(threads);
+  for (int i = 0; i < machines; i++) {
+    guest_init(&guests[i], i + 1);
+    scheduler_add(sched, guests[i].risc, poll_guest, &guests[i]);
+  }
+  scheduler_run(sched);
+
+  int status = 0;
+  for (int i = 0; i < machines; i++) {
+    disk_flush(guests[i].disk);
+    if (!write_profile(&guests[i]) && guests[i].status == 0) {
+      guests[i].status = 1;
+    }
+    if (status == 0) {
+      status = guests[i].status;
+    }
+  }
+  if (status == 0 && !save_snapshot(&guests[0])) {
+    status = 1;
+  }
+  fflush(stdout);
+  return status;
+}
+
+#ifndef _WIN32
+// Returns the job number in the children, and 0 in the parent after
+// all children are done. The exit status is that of the first failed
+// job.
+static int fork_jobs(int jobs, int *status) {
+  fflush(stdout);
+  for (int job = 1; job <= jobs; job++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      return job;
+    } else if (pid < 0) {
+      fprintf(stderr, "Can't fork: %s\n", strerror(errno));
+      jobs = job - 1;
+      *status = 1;
+      break;
+    }
+  }
+  for (int i = 0; i < jobs; i++) {
+    int child_status;
+    if (wait(&child_status) < 0) {
+      break;
+    }
+    int code = WIFEXITED(child_status) ? WEXITSTATUS(child_status) : 1;
+    if (*status == 0) {
+      *status = code;
+    }
+  }
+  return 0;
+}
+#endif
+
+int main (int argc, char *argv[]) {
+  int jobs = 0;
+  int machines = 0, threads = 0;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "Lrm:s:I:O:ScH:jx:t:D:o:N:F:R:M:T:P:p:W:Y:", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'L': {
+        leds_option = true;
+        break;
+      }
+      case 'r': {
+        rtc_option = true;
+        break;
+      }
+      case 'm': {
+        if (sscanf(optarg, "%d", &mem_option) != 1) {
+          usage();
+        }
+        break;
+      }
+      case 's': {
+        int w, h;
+        if (sscanf(optarg, "%dx%d", &w, &h) != 2 || w < 32 || h < 32 ||
+            w > MAX_WIDTH || h > MAX_HEIGHT) {
+          usage();
+        }
+        fb_width = w & ~31;
+        fb_height = h;
+        size_option = true;
+        break;
+      }
+      case 'c': {
+        color_option = true;
+        break;
+      }
+      case 'I': {
+        serial_in = optarg;
+        break;
+      }
+      case 'O': {
+        serial_out = optarg;
+        break;
+      }
+      case 'S': {
+        boot_from_serial = true;
+        break;
+      }
+      case 'H': {
+        hostfs = optarg;
+        break;
+      }
+      case 'P': {
+        pclink_dir = optarg;
+        break;
+      }
+      case 'p': {
+        profile = optarg;
+        break;
+      }
+      case 'W': {
+        record = optarg;
+        break;
+      }
+      case 'Y': {
+        replay = optarg;
+        break;
+      }
+      case 'N': {
+        snapshot = optarg;
+        break;
+      }
+      case 'o': {
+        overlay = optarg;
+        break;
+      }
+      case 'D': {
+        if (strcmp(optarg, "none") == 0) {
+          disk_sync = DISK_SYNC_NONE;
+        } else if (strcmp(optarg, "async") == 0) {
+          disk_sync = DISK_SYNC_ASYNC;
+        } else if (strcmp(optarg, "full") == 0) {
+          disk_sync = DISK_SYNC_FULL;
+        } else {
+          usage();
+        }
+        break;
+      }
+      case 'j': {
+        jit_option = true;
+        break;
+      }
+      case 'x': {
+        exit_led = (uint32_t)parse_led(optarg);
+        exit_led_option = true;
+        break;
+      }
+      case 'R': {
+        ready_led = (uint32_t)parse_led(optarg);
+        ready_led_option = true;
+        break;
+      }
+      case 'F': {
+        if (sscanf(optarg, "%d", &jobs) != 1 || jobs < 1) {
+          usage();
+        }
+        break;
+      }
+      case 'M': {
+        if (sscanf(optarg, "%d", &machines) != 1 || machines < 1) {
+          usage();
+        }
+        break;
+      }
+      case 'T': {
+        if (sscanf(optarg, "%d", &threads) != 1 || threads < 1) {
+          usage();
+        }
+        break;
+      }
+      case 't': {
+        if (sscanf(optarg, "%d", &timeout) != 1) {
+          usage();
+        }
+        break;
+      }
+      default: {
+        usage();
+      }
+    }
+  }
+
+  if (optind == argc - 1) {
+    disk_image = argv[optind];
+  } else if (optind != argc || !boot_from_serial) {
+    /* Only allow diskless boot from serial */
+    usage();
+  }
+
+  if (jobs > 0 && (!overlay || !ready_led_option)) {
+    fprintf(stderr, "--fork needs --overlay and --ready-led\n");
+    return 1;
+  }
+  if ((record || replay) && (jobs > 0 || machines > 0)) {
+    fprintf(stderr, "--record and --replay don't mix with --fork or --machines\n");
+    return 1;
+  }
+#ifdef _WIN32
+  if (jobs > 0) {
+    fprintf(stderr, "--fork is not supported on this host\n");
+    return 1;
+  }
+#endif
+  if (machines > 0) {
+    if (jobs > 0) {
+      fprintf(stderr, "--machines and --fork don't mix\n");
+      return 1;
+    }
+    if (machines > 1 && disk_image && (!overlay || !strstr(overlay, "%d"))) {
+      fprintf(stderr, "--machines needs an --overlay with %%d in its name\n");
+      return 1;
+    }
+    return run_machines(machines, threads > 0 ? threads : machines);
+  }
+
+  struct Guest guest;
+  guest_init(&guest, 0);
+  struct RISC *risc = guest.risc;
+  clock_t started = clock();
+
+  for (uint32_t tick = risc_get_time(risc); poll_guest(&guest, tick); tick++) {
+    risc_set_time(risc, tick);
+    risc_run(risc, CPU_HZ / 1000);
+    risc_trigger_interrupt(risc);
+
+#ifndef _WIN32
+    if (guest.ready && jobs > 0) {
+      if (!save_snapshot(&guest)) {
+        return 1;
+      }
+      int status = 0;
+      int job = fork_jobs(jobs, &status);
+      if (job == 0) {
+        return status;
+      }
+      jobs = 0;
+      snapshot = NULL;
+      guest.job = job;
+      guest.disk = disk_copy_overlay(guest.disk, disk_image, job_path(overlay, job));
+      risc_set_spi(risc, 1, guest.disk);
+      set_channels(risc, job);
+      guest.started = time(NULL);
+    }
+#endif
+  }
+  if (!end_replay(&guest, started) && guest.status == 0) {
+    guest.status = 1;
+  }
+  if (!write_profile(&guest) && guest.status == 0) {
+    guest.status = 1;
+  }
+  if (guest.status != 0) {
+    return guest.status;
+  }
+  if (!save_snapshot(&guest)) {
+    return 1;
+  }
+  fflush(stdout);
+  return 0;
+}
@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "disk.h"
+
+// Folds an overlay created with --overlay into a disk image.
+
+static void usage() {
+  puts("Usage: risc-overlay merge DISK-IMAGE OVERLAY OUTPUT\n"
+       "       risc-overlay commit DISK-IMAGE OVERLAY\n"
+       "\n"
+       "merge writes the image as seen through the overlay to OUTPUT.\n"
+       "commit writes the changes back into DISK-IMAGE and removes OVERLAY.\n"
+       );
+  exit(1);
+}
+
+int main (int argc, char *argv[]) {
+  if (argc == 5 && strcmp(argv[1], "merge") == 0) {
+    disk_merge_overlay(argv[2], argv[3], argv[4]);
+  } else if (argc == 4 && strcmp(argv[1], "commit") == 0) {
+    disk_merge_overlay(argv[2], argv[3], NULL);
+  } else {
+    usage();
+  }
+  return 0;
+}
@@ -1,12 +1,17 @@
 // pclink.c for Peter De Wachter's RISC emulator PDR 20.3.14
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include "pclink.h"
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
 #define ACK 0x10
 #define REC 0x21
 #define SND 0x22
@@ -34,134 +39,341 @@
 
 static const char * RecName = "PCLink.REC";  // e.g. echo Test.Mod > PCLink.REC
 static const char * SndName = "PCLink.SND";
-static uint8_t mode = 0;
-static int fd = -1;
-static int txcount, rxcount, fnlen, flen;
-static char szFilename[32], szPath[261];
-static char buf[257];
-
-static bool GetJob(const char *JobName) {
-  bool res = false;
+
+// Jobs wait in a queue, the one at the front is in progress while mode
+// is set. Each line of a job file is a job: the Oberon file name and,
+// optionally, the host path. A job file is removed once all its jobs
+// are done.
+//
+// The job files are looked for once per risc_run slice, not on every
+// status poll. On Linux, inotify tells when one was written, elsewhere
+// they are stat()ed. Files are read whole when their transfer starts,
+// and written whole when it ends.
+
+#define MaxJobFile 65536
+#define MaxFileSize 0x1000000
+
+struct Job {
+  struct Job *next;
+  uint8_t mode;
+  bool from_file;
+  char filename[32];
+  char *path;
+};
+
+struct PCLink {
+  struct RISC_Serial serial;
+  const char *directory;  // NULL for the current directory
+  char *RecPath, *SndPath;
+  int notify_fd;  // -1 if job files are polled
+  bool scanned;
+  struct Job *jobs, **jobs_tail;
+  int file_jobs[2];  // pending jobs from RecPath and SndPath
+  uint8_t mode;
+  int txcount, rxcount, fnlen, flen;
+  uint8_t *data;  // the file being transferred
+  int data_pos, data_len, data_cap;
+  char buf[257];
+};
+
+// Relative names are looked up in the PCLink directory.
+static char *InDirectory(const struct PCLink *link, const char *name) {
+  size_t len = strlen(name) + 1;
+  bool relative = link->directory && name[0] != '/' && name[0] != '\\';
+  if (relative) {
+    len += strlen(link->directory) + 1;
+  }
+  char *path = malloc(len);
+  if (path == NULL) {
+    return NULL;
+  }
+  if (relative) {
+    snprintf(path, len, "%s/%s", link->directory, name);
+  } else {
+    strcpy(path, name);
+  }
+  return path;
+}
+
+static const char *JobPath(const struct PCLink *link, uint8_t mode) {
+  return mode == SND ? link->SndPath : link->RecPath;
+}
+
+static bool AddJob(struct PCLink *link, uint8_t mode, bool from_file,
+                   const char *filename, const char *path) {
+  struct Job *job = calloc(1, sizeof(*job));
+  if (job == NULL) {
+    return false;
+  }
+  job->path = InDirectory(link, path[0] ? path : filename);
+  if (job->path == NULL) {
+    free(job);
+    return false;
+  }
+  job->mode = mode;
+  job->from_file = from_file;
+  snprintf(job->filename, sizeof(job->filename), "%s", filename);
+  *link->jobs_tail = job;
+  link->jobs_tail = &job->next;
+  if (from_file) {
+    link->file_jobs[mode == SND]++;
+  }
+  return true;
+}
+
+// Queues the jobs of a job file, unless there are still some from it.
+static void GetJobs(struct PCLink *link, uint8_t mode) {
+  const char *JobName = JobPath(link, mode);
   struct stat st;
   FILE * f;
 
-  if (stat(JobName, &st) == 0) {
-    if (st.st_size > 0 && st.st_size <= 300) {
-      f = fopen(JobName, "r");
-      if (f) {
-        szPath[0] = '\0';
-        fscanf(f, "%31s %260s", szFilename, szPath);
-        if (szPath[0] == '\0') {
-          strcpy(szPath, szFilename);
+  if (link->file_jobs[mode == SND] > 0 || stat(JobName, &st) != 0) {
+    return;
+  }
+  if (st.st_size > 0 && st.st_size <= MaxJobFile) {
+    f = fopen(JobName, "r");
+    if (f) {
+      char line[400];
+      while (fgets(line, sizeof(line), f)) {
+        char filename[32], path[261] = "";
+        if (sscanf(line, "%31s %260s", filename, path) >= 1) {
+          AddJob(link, mode, true, filename, path);
         }
-        fclose(f);
-        res = true; txcount = 0; rxcount = 0; fnlen = (int)strlen(szFilename)+1;
       }
-    }
-    if (!res) {
-      unlink(JobName);  // clean up
+      fclose(f);
     }
   }
-  return res;
+  if (link->file_jobs[mode == SND] == 0) {
+    unlink(JobName);  // clean up
+  }
 }
 
-static uint32_t PCLink_RStat(const struct RISC_Serial *serial) {
+static void FinishJob(struct PCLink *link) {
+  struct Job *job = link->jobs;
+  link->jobs = job->next;
+  if (link->jobs == NULL) {
+    link->jobs_tail = &link->jobs;
+  }
+  if (job->from_file && --link->file_jobs[job->mode == SND] == 0) {
+    unlink(JobPath(link, job->mode));  // clean up
+  }
+  free(job->path);
+  free(job);
+  free(link->data);
+  link->data = NULL;
+  link->data_pos = link->data_len = link->data_cap = 0;
+  link->mode = 0;
+}
+
+static bool ReadAll(struct PCLink *link, const char *path) {
   struct stat st;
+  int fd = open(path, O_RDONLY|O_BINARY);
+  if (fd == -1) {
+    return false;
+  }
+  bool ok = fstat(fd, &st) == 0 && st.st_size >= 0 && st.st_size < MaxFileSize;
+  if (ok) {
+    link->data_len = (int)st.st_size;
+    link->data = malloc((size_t)link->data_len + 1);
+    ok = link->data != NULL;
+  }
+  for (int pos = 0; ok && pos < link->data_len; ) {
+    ssize_t n = read(fd, link->data + pos, (size_t)(link->data_len - pos));
+    if (n <= 0) {
+      ok = false;
+    } else {
+      pos += (int)n;
+    }
+  }
+  close(fd);
+  return ok;
+}
 
-  if (!mode) {
-    if (GetJob(RecName)) {
-      if (stat(szPath, &st) == 0 && st.st_size >= 0 && st.st_size < 0x1000000) {
-        fd = open(szPath, O_RDONLY|O_BINARY);
-        if (fd != -1) {
-          flen = (int)st.st_size; mode = REC;
-          printf("PCLink REC Filename: %s size %d\n", szFilename, flen);
-        }
-      }
-      if (!mode) {
-        unlink(RecName);  // clean up
-      }
-    } else if (GetJob(SndName)) {
-      fd = open(szPath, O_CREAT|O_TRUNC|O_RDWR|O_BINARY, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
-      if (fd != -1) {
-        flen = -1; mode = SND;
-        printf("PCLink SND Filename: %s\n", szFilename);
+static void WriteAll(struct PCLink *link, const char *path) {
+  int fd = open(path, O_CREAT|O_TRUNC|O_WRONLY|O_BINARY, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+  if (fd == -1) {
+    fprintf(stderr, "PCLink can't create %s\n", path);
+    return;
+  }
+  for (int pos = 0; pos < link->data_len; ) {
+    ssize_t n = write(fd, link->data + pos, (size_t)(link->data_len - pos));
+    if (n <= 0) {
+      fprintf(stderr, "PCLink can't write %s\n", path);
+      break;
+    }
+    pos += (int)n;
+  }
+  close(fd);
+}
+
+static void StartJob(struct PCLink *link) {
+  while (link->jobs && !link->mode) {
+    struct Job *job = link->jobs;
+    link->txcount = 0; link->rxcount = 0;
+    link->fnlen = (int)strlen(job->filename)+1;
+    if (job->mode == REC) {
+      if (ReadAll(link, job->path)) {
+        link->flen = link->data_len; link->mode = REC;
+        printf("PCLink REC Filename: %s size %d\n", job->filename, link->flen);
       }
-      if (!mode) {
-        unlink(SndName);  // clean up
+    } else {
+      link->flen = -1; link->mode = SND;
+      printf("PCLink SND Filename: %s\n", job->filename);
+    }
+    if (!link->mode) {
+      FinishJob(link);
+    }
+  }
+}
+
+static void PCLink_Poll(const struct RISC_Serial *serial) {
+  struct PCLink *link = (struct PCLink *)serial;
+  bool rec = !link->scanned, snd = !link->scanned;
+  link->scanned = true;
+#ifdef __linux__
+  if (link->notify_fd != -1) {
+    union {
+      struct inotify_event event;
+      char bytes[4096];
+    } buf;
+    ssize_t n;
+    while ((n = read(link->notify_fd, &buf, sizeof(buf))) > 0) {
+      for (char *p = buf.bytes; p < buf.bytes + n; ) {
+        struct inotify_event *event = (struct inotify_event *)p;
+        if (event->len > 0) {
+          rec |= strcmp(event->name, RecName) == 0;
+          snd |= strcmp(event->name, SndName) == 0;
+        }
+        p += sizeof(*event) + event->len;
       }
     }
+  } else
+#endif
+  {
+    rec = snd = true;
+  }
+  if (rec) {
+    GetJobs(link, REC);
   }
-  return 2 + (mode != 0);  // xmit always ready
+  if (snd) {
+    GetJobs(link, SND);
+  }
+}
+
+static uint32_t PCLink_RStat(const struct RISC_Serial *serial) {
+  struct PCLink *link = (struct PCLink *)serial;
+  if (!link->mode && link->jobs) {
+    StartJob(link);
+  }
+  return 2 + (link->mode != 0);  // xmit always ready
 }
 
 static uint32_t PCLink_RData(const struct RISC_Serial *serial) {
+  struct PCLink *link = (struct PCLink *)serial;
   uint8_t ch = 0;
 
-  if (mode) {
-    if (rxcount == 0) {
-      ch = mode;
-    } else if (rxcount < fnlen+1) {
-      ch = szFilename[rxcount-1];
-    } else if (mode == SND) {
+  if (link->mode) {
+    if (link->rxcount == 0) {
+      ch = link->mode;
+    } else if (link->rxcount < link->fnlen+1) {
+      ch = (uint8_t)link->jobs->filename[link->rxcount-1];
+    } else if (link->mode == SND) {
       ch = ACK;
-      if (flen == 0) {
-        mode = 0; unlink(SndName);
+      if (link->flen == 0) {
+        FinishJob(link);
       }
     } else {
-      int pos = (rxcount - fnlen - 1) % 256;
-      if (pos == 0 || flen == 0) {
-        if (flen > 255) {
+      int pos = (link->rxcount - link->fnlen - 1) % 256;
+      if (pos == 0 || link->flen == 0) {
+        if (link->flen > 255) {
           ch = 255;
         } else {
-          ch = (uint8_t)flen;
-          if (flen == 0) {
-            mode = 0; unlink(RecName);
+          ch = (uint8_t)link->flen;
+          if (link->flen == 0) {
+            FinishJob(link);
           }
         }
       } else {
-        read(fd, &ch, 1);
-        flen--;
+        ch = link->data[link->data_pos++];
+        link->flen--;
       }
     }
   }
 
-  rxcount++;
+  link->rxcount++;
   return ch;
 }
 
 static void PCLink_TData(const struct RISC_Serial *serial, uint32_t value) {
-  if (mode) {
-    if (txcount == 0) {
+  struct PCLink *link = (struct PCLink *)serial;
+
+  if (link->mode) {
+    if (link->txcount == 0) {
       if (value != ACK) {
-        close(fd); fd = -1;
-        if (mode == SND) {
-          unlink(szPath);  // file not found, delete file created
-          unlink(SndName);  // clean up
-        } else {
-          unlink(RecName);  // clean up
-        }
-        mode = 0;
+        FinishJob(link);  // file not found
       }
-    } else if (mode == SND) {
+    } else if (link->mode == SND && link->flen != 0) {
       int lim;
 
-      int pos = (txcount-1) % 256;
-      buf[pos] = (uint8_t)value;
-      lim = (unsigned char)buf[0];
+      int pos = (link->txcount-1) % 256;
+      link->buf[pos] = (char)value;
+      lim = (unsigned char)link->buf[0];
       if (pos == lim) {
-        write(fd, buf+1, lim);
+        if (link->data_len + lim > link->data_cap) {
+          int cap = link->data_cap ? 2 * link->data_cap : 4096;
+          uint8_t *data = realloc(link->data, (size_t)cap);
+          if (data == NULL) {
+            fprintf(stderr, "PCLink out of memory\n");
+            exit(1);
+          }
+          link->data = data;
+          link->data_cap = cap;
+        }
+        memcpy(link->data + link->data_len, link->buf+1, (size_t)lim);
+        link->data_len += lim;
         if (lim < 255) {
-          flen = 0; close(fd);
+          link->flen = 0;
+          WriteAll(link, link->jobs->path);
         }
       }
     }
   }
-  txcount++;
+  link->txcount++;
 }
 
+bool pclink_queue_rec(struct RISC_Serial *serial, const char *filename, const char *path) {
+  return AddJob((struct PCLink *)serial, REC, false, filename, path);
+}
 
-const struct RISC_Serial pclink = {
-  .read_status = PCLink_RStat,
-  .read_data = PCLink_RData,
-  .write_data = PCLink_TData
-};
+struct RISC_Serial *pclink_new(const char *directory) {
+  struct PCLink *link = calloc(1, sizeof(*link));
+  if (link == NULL) {
+    return NULL;
+  }
+  link->serial = (struct RISC_Serial){
+    .read_status = PCLink_RStat,
+    .read_data = PCLink_RData,
+    .write_data = PCLink_TData,
+    .poll = PCLink_Poll
+  };
+  link->directory = directory;
+  link->jobs_tail = &link->jobs;
+  link->RecPath = InDirectory(link, RecName);
+  link->SndPath = InDirectory(link, SndName);
+  if (link->RecPath == NULL || link->SndPath == NULL) {
+    free(link->RecPath);
+    free(link->SndPath);
+    free(link);
+    return NULL;
+  }
+  link->notify_fd = -1;
+#ifdef __linux__
+  link->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (link->notify_fd != -1 &&
+      inotify_add_watch(link->notify_fd, directory ? directory : ".", IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+    close(link->notify_fd);
+    link->notify_fd = -1;
+  }
+#endif
+  return &link->serial;
+}
@@ -1,8 +1,16 @@
 #ifndef PCLINK_H
 #define PCLINK_H
 
+#include <stdbool.h>
 #include "risc-io.h"
 
-extern const struct RISC_Serial pclink;
+// Each machine needs its own link. The PCLink.REC and PCLink.SND job
+// files, and relative file names inside them, are looked up in
+// directory, or in the current directory if it is NULL.
+struct RISC_Serial *pclink_new(const char *directory);
+
+// Queues a transfer of the host file at path into the guest, where it
+// is called filename, without going through a job file.
+bool pclink_queue_rec(struct RISC_Serial *serial, const char *filename, const char *path);
 
 #endif  // PCLINK_H
@@ -1,44 +1,151 @@
 #ifdef _WIN32
-
 #include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "raw-serial.h"
 
+// The guest polls the status register in a tight loop, so bytes go
+// through host-side buffers instead of one system call each. They are
+// moved in bulk after every risc_run slice, when the output buffer is
+// full, and when the guest has found the input buffer empty for
+// RefillPolls status reads in a row. Status reads are a memory check
+// otherwise.
+
+#define BufSize 65536
+#define RefillPolls 64
+
 struct RawSerial {
   struct RISC_Serial serial;
+#ifdef _WIN32
   HANDLE handle;
+#else
+  int fd_in;
+  int fd_out;
+#endif
+  uint32_t empty_polls;
+  int rx_pos, rx_len;
+  int tx_len;
+  uint8_t rx_buf[BufSize];
+  uint8_t tx_buf[BufSize];
 };
 
+// Both return the number of bytes transferred, without waiting for
+// input.
+#ifdef _WIN32
+
+static int host_read(struct RawSerial *s, uint8_t *buf, int len) {
+  DWORD available_bytes, bytes_read;
+  if (!PeekNamedPipe(s->handle, 0, 0, 0, &available_bytes, 0) || available_bytes == 0)
+    return 0;
+  if (available_bytes < (DWORD)len)
+    len = (int)available_bytes;
+  if (!ReadFile(s->handle, buf, (DWORD)len, &bytes_read, NULL))
+    return 0;
+  return (int)bytes_read;
+}
+
+static int host_write(struct RawSerial *s, const uint8_t *buf, int len) {
+  DWORD bytes_written;
+  if (!WriteFile(s->handle, buf, (DWORD)len, &bytes_written, NULL))
+    return 0;
+  return (int)bytes_written;
+}
+
+#else  // _WIN32
+
+static int host_read(struct RawSerial *s, uint8_t *buf, int len) {
+  ssize_t n = read(s->fd_in, buf, (size_t)len);
+  return n > 0 ? (int)n : 0;
+}
+
+static int host_write(struct RawSerial *s, const uint8_t *buf, int len) {
+  ssize_t n = write(s->fd_out, buf, (size_t)len);
+  return n > 0 ? (int)n : 0;
+}
+
+#endif  // _WIN32
+
+static void fill(struct RawSerial *s) {
+  s->rx_len -= s->rx_pos;
+  memmove(s->rx_buf, s->rx_buf + s->rx_pos, (size_t)s->rx_len);
+  s->rx_pos = 0;
+  s->rx_len += host_read(s, s->rx_buf + s->rx_len, BufSize - s->rx_len);
+}
+
+static void drain(struct RawSerial *s) {
+  int n = host_write(s, s->tx_buf, s->tx_len);
+  s->tx_len -= n;
+  memmove(s->tx_buf, s->tx_buf + n, (size_t)s->tx_len);
+}
+
 static uint32_t read_status(const struct RISC_Serial *serial) {
   struct RawSerial *s = (struct RawSerial *)serial;
-  DWORD available_bytes;
-  if (!PeekNamedPipe(s->handle, 0, 0, 0, &available_bytes, 0))
-    available_bytes = 0;
-  return 2 + (available_bytes > 0);
+  if (s->rx_pos == s->rx_len && ++s->empty_polls >= RefillPolls) {
+    s->empty_polls = 0;
+    fill(s);
+  }
+  uint32_t status = 0;
+  if (s->rx_pos < s->rx_len) {
+    status |= 1;
+  }
+  if (s->tx_len < BufSize) {
+    status |= 2;
+  }
+  return status;
 }
 
 static uint32_t read_data(const struct RISC_Serial *serial) {
-  if (read_status(serial) != 3) return 0;
   struct RawSerial *s = (struct RawSerial *)serial;
-  uint8_t byte = 0;
-  DWORD numBytesRead = 0;
-  while (numBytesRead == 0) {
-    if (!ReadFile(s->handle, &byte, 1, &numBytesRead, NULL))
+  if (s->rx_pos == s->rx_len) {
+    fill(s);
+    if (s->rx_pos == s->rx_len) {
       return 0;
+    }
   }
-  return byte;
+  return s->rx_buf[s->rx_pos++];
 }
 
 static void write_data(const struct RISC_Serial *serial, uint32_t data) {
   struct RawSerial *s = (struct RawSerial *)serial;
-  uint8_t byte = (uint8_t)data;
-  DWORD numBytesWritten = 0;
-  while (numBytesWritten == 0) {
-    if (!WriteFile(s->handle, &byte, 1, &numBytesWritten, NULL))
+  if (s->tx_len == BufSize) {
+    drain(s);
+    if (s->tx_len == BufSize) {
+      // Like a write to a full non-blocking pipe.
       return;
+    }
+  }
+  s->tx_buf[s->tx_len++] = (uint8_t)data;
+}
+
+static void poll_host(const struct RISC_Serial *serial) {
+  struct RawSerial *s = (struct RawSerial *)serial;
+  if (s->tx_len > 0) {
+    drain(s);
   }
+  fill(s);
 }
 
+static struct RawSerial *alloc_serial(void) {
+  struct RawSerial *s = calloc(1, sizeof(*s));
+  if (s) {
+    s->serial = (struct RISC_Serial){
+      .read_status = &read_status,
+      .read_data = &read_data,
+      .write_data = &write_data,
+      .poll = &poll_host
+    };
+  }
+  return s;
+}
+
+#ifdef _WIN32
+
 struct RISC_Serial *raw_serial_new(const char *filename_in, const char *filename_out) {
   char pipe_name[257];
   HANDLE file_handle;
@@ -85,81 +192,18 @@ struct RISC_Serial *raw_serial_new(const char *filename_in, const char *filename
     return NULL;
   }
 
-  struct RawSerial *s = malloc(sizeof(*s));
+  struct RawSerial *s = alloc_serial();
   if (!s) {
     fprintf(stderr, "Allocate structure failed.\n");
     CloseHandle(file_handle);
     return NULL;
   }
-
-  *s = (struct RawSerial) {
-    .serial = {
-      .read_status = &read_status,
-      .read_data = &read_data,
-      .write_data = &write_data
-    },
-    .handle = file_handle
-  };
-
+  s->handle = file_handle;
   return &s->serial;
 }
 
 #else  // _WIN32
 
-#include <stdlib.h>
-#include <stdbool.h>
-#include <stdio.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/select.h>
-#include "raw-serial.h"
-
-struct RawSerial {
-  struct RISC_Serial serial;
-  int fd_in;
-  int fd_out;
-};
-
-static int max(int a, int b) {
-  return a > b ? a : b;
-}
-
-static uint32_t read_status(const struct RISC_Serial *serial) {
-  struct RawSerial *s = (struct RawSerial *)serial;
-  struct timeval tv = { 0, 0 };
-  fd_set read_fds;
-  fd_set write_fds;
-  FD_ZERO(&read_fds);
-  FD_SET(s->fd_in, &read_fds);
-  FD_ZERO(&write_fds);
-  FD_SET(s->fd_out, &write_fds);
-  int nfds = max(s->fd_in, s->fd_out) + 1;
-  int r = select(nfds, &read_fds, &write_fds, NULL, &tv);
-  int status = 0;
-  if (r > 0) {
-    if (FD_ISSET(s->fd_in, &read_fds)) {
-      status |= 1;
-    }
-    if (FD_ISSET(s->fd_out, &write_fds)) {
-      status |= 2;
-    }
-  }
-  return status;
-}
-
-static uint32_t read_data(const struct RISC_Serial *serial) {
-  struct RawSerial *s = (struct RawSerial *)serial;
-  uint8_t byte = 0;
-  read(s->fd_in, &byte, 1);
-  return byte;
-}
-
-static void write_data(const struct RISC_Serial *serial, uint32_t data) {
-  struct RawSerial *s = (struct RawSerial *)serial;
-  uint8_t byte = (uint8_t)data;
-  write(s->fd_out, &byte, 1);
-}
-
 struct RISC_Serial *raw_serial_new(const char *filename_in, const char *filename_out) {
   int fd_in, fd_out;
 
@@ -175,20 +219,12 @@ struct RISC_Serial *raw_serial_new(const char *filename_in, const char *filename
     goto fail2;
   }
 
-  struct RawSerial *s = malloc(sizeof(*s));
+  struct RawSerial *s = alloc_serial();
   if (!s) {
     goto fail3;
   }
-
-  *s = (struct RawSerial){
-    .serial = {
-      .read_status = &read_status,
-      .read_data = &read_data,
-      .write_data = &write_data
-    },
-    .fd_in = fd_in,
-    .fd_out = fd_out
-  };
+  s->fd_in = fd_in;
+  s->fd_out = fd_out;
   return &s->serial;
 
  fail3:
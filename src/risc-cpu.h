@@ -0,0 +1,230 @@
+#ifndef RISC_CPU_H
+#define RISC_CPU_H
+
+// Internal CPU state, shared by the interpreter in risc.c and the
+// translator in risc-jit.c. Front ends should only use risc.h.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "risc.h"
+
+struct RISC_JIT;
+struct RISC_Profile;
+
+// Our memory layout is slightly different from the FPGA implementation:
+// The FPGA uses a 20-bit address bus and thus ignores the top 12 bits,
+// while we use all 32 bits. This allows us to have more than 1 megabyte
+// of RAM and/or a 16 color framebuffer.
+//
+// In the default configuration, the emulator is compatible with the
+// FPGA system. But If the user requests more memory, we move the
+// framebuffer to make room for a larger Oberon heap. This requires a
+// custom Display.Mod.
+
+
+#define DefaultMemSize      0x00100000
+#define DefaultDisplayStart 0x000E7F00
+
+// RAM plus the largest framebuffer stay below 2 GB, where addresses
+// are still positive integers for the guest.
+#define RISC_MAX_MEGABYTES 2040
+
+#define ROMStart     0xFFFFF800
+#define ROMWords     512
+#define IOStart      0xFFFFFFC0
+#define PaletteStart 0xFFFFFF80
+
+// Polls of the timer or an empty keyboard after which the guest is
+// considered idle.
+#define IdlePolls 20
+
+// Size of the keyboard ring buffer, a power of two.
+#define KeyBufSize 4096
+
+
+// Every word of RAM and ROM has a slot in a parallel array of
+// pre-decoded instructions. A slot is decoded the first time it is
+// executed and reset to I_DECODE whenever the underlying word is
+// written. I_JIT marks the first word of a translated block; imm is
+// the block number.
+#define RISC_DECODED_OPS(X) \
+  X(DECODE) X(VOID) \
+  X(MOV) X(MOVI) X(MOVH) X(MOVF) \
+  X(LSL) X(LSLI) X(ASR) X(ASRI) X(ROR) X(RORI) \
+  X(AND) X(ANDI) X(ANN) X(ANNI) X(IOR) X(IORI) X(XOR) X(XORI) \
+  X(ADD) X(ADDI) X(ADC) X(ADCI) X(SUB) X(SUBI) X(SBC) X(SBCI) \
+  X(MUL) X(MULI) X(MULU) X(MULUI) X(DIV) X(DIVI) X(DIVU) X(DIVUI) \
+  X(FPU) \
+  X(LDW) X(LDB) X(STW) X(STB) \
+  X(BR) X(BRI) X(BL) X(BLI) \
+  X(JMP) X(JMPI) X(CALL) X(CALLI) \
+  X(NOP) X(IRET) X(STICLI) \
+  X(JIT)
+
+#define RISC_DECODED_ENUM(name) I_##name,
+enum { RISC_DECODED_OPS(RISC_DECODED_ENUM) };
+
+struct Decoded {
+  uint8_t op;
+  uint8_t a, b, c;  // Branches keep the condition in b. IRET keeps the
+                    // handler to use outside interrupt mode in a.
+  uint32_t imm;
+};
+
+struct RISC {
+  uint32_t PC;
+  uint32_t R[16];
+  uint32_t H;
+  uint32_t SPC;                 // SPC: Saved PC
+  bool     SZ, SN, SC, SV;      //    : Saved Condition Codes
+  bool     C, V, I, E, P;       //   I: Interrupt mode
+                                //   E: Interrupts enabled
+                                //   P: Interrupt pending
+  uint32_t flag_res;            // Z and N, see risc_flag_z()
+  uint32_t flag_b, flag_c;
+  uint8_t  flag_op;
+
+  uint32_t mem_size;
+  uint32_t display_start;
+
+  uint32_t progress;
+  uint32_t current_tick;
+  uint32_t mouse;
+  uint8_t  key_buf[KeyBufSize];
+  uint32_t key_head, key_tail;  // free running, see risc_keyboard_input()
+  uint32_t switches;
+
+  const struct RISC_LED *leds;
+  const struct RISC_Serial *serial;
+  uint32_t spi_selected;
+  const struct RISC_SPI *spi[4];
+  const struct RISC_Clipboard *clipboard;
+  const struct RISC_HostFS *hostfs;
+
+  bool fb_color;
+  int fb_width;   // words
+  int fb_height;  // lines
+  uint64_t *damage_rows;  // see risc_init_damage()
+  uint64_t damage_recip;
+  int damage_shift;
+  int damage_row_shift;   // log2 of fb_width, or -1
+
+  uint32_t *RAM;
+  struct Decoded *RAM_decoded;
+  uint32_t ROM[ROMWords];
+  struct Decoded ROM_decoded[ROMWords];
+  uint32_t Palette[16];
+
+  // The interpreter built for this memory layout.
+  int (*interpret)(struct RISC *risc, int cycles);
+  struct RISC_JIT *jit;
+  uint8_t *jit_covered;  // one byte per RAM word
+
+  struct RISC_Profile *profile;
+  struct RISC_Replay *replay;  // recording or replaying
+  struct RISC_Stats stats;
+};
+
+// jit_covered has JIT_COVERED set for words that may belong to a
+// translated block. The low bits count how often a word was written
+// after being translated; code that keeps changing is left to the
+// interpreter.
+#define JIT_COVERED 0x80
+
+enum {
+  MOV, LSL, ASR, ROR,
+  AND, ANN, IOR, XOR,
+  ADD, SUB, MUL, DIV,
+  FAD, FSB, FML, FDV,
+};
+
+// The condition flags are evaluated lazily. Z and N follow from the
+// last value written to a register. C and V either hold their value
+// (FLAGS_CV) or follow from the operands of the last ADD or SUB; the
+// carry-in of ADC and SBC is part of flag_op.
+enum { FLAGS_CV, FLAGS_ADD, FLAGS_ADC, FLAGS_SUB, FLAGS_SBC };
+
+static inline bool risc_flag_z(const struct RISC *risc) {
+  return risc->flag_res == 0;
+}
+
+static inline bool risc_flag_n(const struct RISC *risc) {
+  return (int32_t)risc->flag_res < 0;
+}
+
+static inline bool risc_flag_c(const struct RISC *risc) {
+  uint32_t b_val = risc->flag_b, c_val = risc->flag_c;
+  switch (risc->flag_op) {
+    case FLAGS_ADD: case FLAGS_ADC:
+      return b_val + c_val + (risc->flag_op - FLAGS_ADD) < b_val;
+    case FLAGS_SUB: case FLAGS_SBC:
+      return b_val - c_val - (risc->flag_op - FLAGS_SUB) > b_val;
+    default:
+      return risc->C;
+  }
+}
+
+static inline bool risc_flag_v(const struct RISC *risc) {
+  uint32_t b_val = risc->flag_b, c_val = risc->flag_c, a_val;
+  switch (risc->flag_op) {
+    case FLAGS_ADD: case FLAGS_ADC:
+      a_val = b_val + c_val + (risc->flag_op - FLAGS_ADD);
+      return ((a_val ^ c_val) & (a_val ^ b_val)) >> 31;
+    case FLAGS_SUB: case FLAGS_SBC:
+      a_val = b_val - c_val - (risc->flag_op - FLAGS_SUB);
+      return ((b_val ^ c_val) & (a_val ^ b_val)) >> 31;
+    default:
+      return risc->V;
+  }
+}
+
+// Zeroed memory that is only committed as it is touched.
+void *risc_alloc_pages(size_t size);
+void risc_free_pages(void *p, size_t size);
+void risc_clear_pages(void *p, size_t size);
+// Maps RAM for the current layout if that hasn't happened yet. The
+// public functions that need RAM do this themselves.
+void risc_map_memory(struct RISC *risc);
+void risc_set_flags(struct RISC *risc, bool z, bool n, bool c, bool v);
+void risc_decode(uint32_t ir, struct Decoded *d);
+int risc_interpret(struct RISC *risc, int cycles);
+bool risc_interrupt_ready(struct RISC *risc);
+uint32_t risc_enter_interrupt(struct RISC *risc, uint32_t pc);
+uint32_t risc_load_word(struct RISC *risc, uint32_t address);
+uint8_t risc_load_byte(struct RISC *risc, uint32_t address);
+void risc_store_word(struct RISC *risc, uint32_t address, uint32_t value);
+void risc_store_byte(struct RISC *risc, uint32_t address, uint8_t value);
+uint32_t risc_div(struct RISC *risc, uint32_t b_val, uint32_t c_val, bool u);
+uint32_t risc_fpu(uint32_t ir, uint32_t b_val, uint32_t c_val);
+
+// risc-jit.c
+struct RISC_JIT *risc_jit_new(struct RISC *risc);
+void risc_jit_free(struct RISC *risc);
+int risc_jit_run(struct RISC *risc, int cycles);
+void risc_jit_flush(struct RISC *risc);
+void risc_jit_invalidate(struct RISC *risc, uint32_t w);
+struct Decoded *risc_jit_first(struct RISC *risc, uint32_t block);
+
+// risc-profile.c
+// How many of the cycles to run before the next sample is due, and
+// how many were run, which may take the sample.
+int risc_profile_slice(struct RISC *risc, int cycles);
+void risc_profile_count(struct RISC *risc, int executed);
+
+// risc-replay.c
+// Called by the inputs from the host. Returns false if the input is
+// to be dropped, because a replay supplies it.
+bool risc_replay_input(struct RISC *risc, char kind, uint32_t a, uint32_t b);
+bool risc_replay_keys(struct RISC *risc, const uint8_t *scancodes, uint32_t len);
+// Returns the value of an IO register that comes from the host, and
+// ends the slice after this instruction. risc_replay_settle is called
+// after every slice and returns true if the slice was ended that way.
+uint32_t risc_replay_read(struct RISC *risc, uint32_t reg);
+bool risc_replay_settle(struct RISC *risc);
+// How many of the cycles to run before the next recorded input is
+// due, after applying those that are. 0 when the replay is over.
+int risc_replay_slice(struct RISC *risc, int cycles);
+uint32_t risc_read_host(struct RISC *risc, uint32_t reg);
+
+#endif  // RISC_CPU_H
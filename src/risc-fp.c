@@ -1,5 +1,28 @@
 #include "risc-fp.h"
 
+// These follow the Verilog datapaths of the FPGA bit for bit, but not
+// step by step. fp-test/ref-fp.c has the step by step versions, and
+// "make test-fuzz" in fp-test compares the two.
+//
+// There's no fast path through the host's floating point: RISC5
+// rounds half up on a single guard bit, has no infinities, NaNs or
+// denormals, and treats exponent 0 as zero, so IEEE results don't
+// match even for normal operands.
+
+static inline int clz32(uint32_t x) {  // x != 0
+#if defined(__GNUC__)
+  return __builtin_clz(x);
+#else
+  int n = 0;
+  if ((x & 0xFFFF0000) == 0) { n += 16; x <<= 16; }
+  if ((x & 0xFF000000) == 0) { n += 8; x <<= 8; }
+  if ((x & 0xF0000000) == 0) { n += 4; x <<= 4; }
+  if ((x & 0xC0000000) == 0) { n += 2; x <<= 2; }
+  if ((x & 0x80000000) == 0) { n += 1; }
+  return n;
+#endif
+}
+
 uint32_t fp_add(uint32_t x, uint32_t y, bool u, bool v) {
   bool xs = (x & 0x80000000) != 0;
   uint32_t xe;
@@ -41,10 +64,10 @@ uint32_t fp_add(uint32_t x, uint32_t y, bool u, bool v) {
   uint32_t e1 = e0 + 1;
   uint32_t t3 = s >> 1;
   if ((s & 0x3FFFFFC) != 0) {
-    while ((t3 & (1<<24)) == 0) {
-      t3 <<= 1;
-      e1--;
-    }
+    // Move the highest one of the low 25 bits up to bit 24.
+    uint32_t shift = (uint32_t)clz32(t3 & 0x1FFFFFF) - 7;
+    t3 <<= shift;
+    e1 -= shift;
   } else {
     t3 <<= 24;
     e1 -= 24;
@@ -127,10 +150,11 @@ uint32_t fp_div(uint32_t x, uint32_t y) {
   }
 }
 
-struct idiv idiv(uint32_t x, uint32_t y, bool signed_div) {
-  bool sign = ((int32_t)x < 0) & signed_div;
-  uint32_t x0 = sign ? -x : x;
-
+// The divider shifts and subtracts, comparing with a signed
+// subtraction. When 0 < y < 2^31 that subtraction can't overflow, so
+// the loop is an ordinary unsigned division. Other divisors give
+// results of their own.
+static struct idiv idiv_loop(uint32_t x0, uint32_t y) {
   uint64_t RQ = x0;
   for (int S = 0; S < 32; ++S) {
     uint32_t w0 = (uint32_t)(RQ >> 31);
@@ -141,8 +165,19 @@ struct idiv idiv(uint32_t x, uint32_t y, bool signed_div) {
       RQ = ((uint64_t)w1 << 32) | ((RQ & 0x7FFFFFFFU) << 1) | 1;
     }
   }
+  return (struct idiv){ (uint32_t)RQ, (uint32_t)(RQ >> 32) };
+}
 
-  struct idiv d = { (uint32_t)RQ, (uint32_t)(RQ >> 32) };
+struct idiv idiv(uint32_t x, uint32_t y, bool signed_div) {
+  bool sign = ((int32_t)x < 0) & signed_div;
+  uint32_t x0 = sign ? -x : x;
+
+  struct idiv d;
+  if ((int32_t)y > 0) {
+    d = (struct idiv){ x0 / y, x0 % y };
+  } else {
+    d = idiv_loop(x0, y);
+  }
   if (sign) {
     d.quot = -d.quot;
     if (d.rem) {
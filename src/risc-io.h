@@ -1,17 +1,30 @@
 #ifndef RISC_IO_H
 #define RISC_IO_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 struct RISC_Serial {
   uint32_t (*read_status)(const struct RISC_Serial *);
   uint32_t (*read_data)(const struct RISC_Serial *);
   void (*write_data)(const struct RISC_Serial *, uint32_t);
+  // Optional: called after every risc_run, to move buffered data to
+  // and from the host.
+  void (*poll)(const struct RISC_Serial *);
 };
 
 struct RISC_SPI {
   uint32_t (*read_data)(const struct RISC_SPI *);
   void (*write_data)(const struct RISC_SPI *, uint32_t);
+  // Optional: transfer a 512-byte block without the SPI protocol.
+  void (*read_block)(const struct RISC_SPI *, uint32_t block, uint32_t *buf);
+  void (*write_block)(const struct RISC_SPI *, uint32_t block, const uint32_t *buf);
+  // Optional: make all writes so far durable.
+  void (*sync)(const struct RISC_SPI *);
+  // Optional: snapshot support. save_state returns the size of the
+  // state and leaves buf alone if it is NULL.
+  size_t (*save_state)(const struct RISC_SPI *, void *buf);
+  void (*load_state)(const struct RISC_SPI *, const void *buf);
 };
 
 struct RISC_Clipboard {
@@ -26,7 +39,9 @@ struct RISC_LED {
 };
 
 struct RISC_HostFS {
-  void (*write)(const struct RISC_HostFS *, uint32_t, uint32_t *);
+  // Handles the request block at address in ram, which holds ram_size
+  // bytes.
+  void (*write)(const struct RISC_HostFS *, uint32_t address, uint32_t *ram, uint32_t ram_size);
 };
 
 #endif  // RISC_IO_H
@@ -0,0 +1,954 @@
+// Translates straight runs of RISC5 code to native x86-64 code.
+//
+// A block starts wherever execution first reaches a word and ends at
+// the next branch. Rare instructions are handed to the interpreter
+// from within the block.
+// The most used guest registers of a block live in callee-saved host
+// registers while it runs. The result Z and N follow from is only
+// written back when a branch or an exit needs it; C and V are stored
+// right away, so translated code always sees FLAGS_CV. Blocks
+// jump straight to the next translated block until the cycle budget
+// in r15 runs out.
+//
+// Blocks are thrown away as soon as one of their words is written.
+// Words that keep changing are interpreted each time they run, and
+// the whole cache is flushed when it fills up.
+
+#define _DEFAULT_SOURCE  // MAP_ANONYMOUS
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "risc-cpu.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <sys/mman.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define CodeSize      (16 << 20)
+#define MaxBlocks     65536
+#define MaxBlockLen   64
+#define MaxCachedRegs 4
+#define MaxRewrites   4
+// Upper bound for the code of one instruction, including its exits.
+#define MaxInsnBytes  256
+
+struct Block {
+  uint32_t pc;   // word address of the first instruction
+  uint32_t len;  // instructions, 0 once the block is thrown away
+  uint8_t *code;
+  struct Decoded first;
+};
+
+struct RISC_JIT {
+  uint8_t *code;
+  uint32_t code_base;  // the shared entry and exit code
+  uint32_t code_used;
+  uint8_t *start;
+  uint8_t *epilogue;
+  uint8_t *chain;
+
+  struct Block *blocks;
+  uint32_t block_cnt;
+  uint32_t generation;  // bumped whenever blocks are thrown away
+
+  // Translator state
+  uint8_t *p;
+  int host[16];      // host register caching each guest register, or -1
+  uint32_t written;  // guest registers written by the block
+  int flag_reg;      // guest register flag_res still has to be set from
+};
+
+enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+static const int cache_regs[MaxCachedRegs] = { RBP, R12, R13, R14 };
+
+// Group 1 arithmetic, shift and group 3 opcode extensions
+enum { X_ADD = 0, X_OR = 1, X_AND = 4, X_SUB = 5, X_XOR = 6, X_CMP = 7 };
+enum { X_ROR = 1, X_SHL = 4, X_SHR = 5, X_SAR = 7 };
+enum { X_NOT = 2, X_MUL = 4, X_IMUL = 5 };
+
+// Condition codes
+enum { CC_O = 0x0, CC_C = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_S = 0x8 };
+
+// An instruction operand, either a host register or [base + disp].
+struct Opnd {
+  int reg;
+  int base;
+  int32_t disp;
+};
+
+static struct Opnd reg_op(int reg) {
+  return (struct Opnd){ .reg = reg };
+}
+
+static struct Opnd base_op(int base, size_t offset) {
+  return (struct Opnd){ .reg = -1, .base = base, .disp = (int32_t)offset };
+}
+
+static struct Opnd mem_op(size_t offset) {
+  return base_op(RBX, offset);
+}
+
+#define FIELD(name) mem_op(offsetof(struct RISC, name))
+
+static struct Opnd guest(struct RISC_JIT *j, int g) {
+  if (j->host[g] >= 0) {
+    return reg_op(j->host[g]);
+  }
+  return mem_op(offsetof(struct RISC, R) + 4 * (size_t)g);
+}
+
+static void emit8(struct RISC_JIT *j, uint32_t b) {
+  *j->p++ = (uint8_t)b;
+}
+
+static void emit32(struct RISC_JIT *j, uint32_t v) {
+  memcpy(j->p, &v, 4);
+  j->p += 4;
+}
+
+static void emit64(struct RISC_JIT *j, uint64_t v) {
+  memcpy(j->p, &v, 8);
+  j->p += 8;
+}
+
+// Emits an instruction with a ModRM byte. Opcodes above 0xFF are
+// two-byte 0F xx opcodes. Bases rsp and r12 are not supported.
+static void emit_op(struct RISC_JIT *j, bool w, uint32_t opcode, int r, struct Opnd rm) {
+  int b = rm.reg >= 0 ? rm.reg : rm.base;
+  uint32_t rex = 0x40 | (w ? 8 : 0) | ((r & 8) ? 4 : 0) | ((b & 8) ? 1 : 0);
+  if (rex != 0x40) {
+    emit8(j, rex);
+  }
+  if (opcode > 0xFF) {
+    emit8(j, opcode >> 8);
+  }
+  emit8(j, opcode & 0xFF);
+  if (rm.reg >= 0) {
+    emit8(j, 0xC0 | (r & 7) << 3 | (b & 7));
+  } else if (rm.disp >= -128 && rm.disp < 128) {
+    emit8(j, 0x40 | (r & 7) << 3 | (b & 7));
+    emit8(j, (uint32_t)rm.disp);
+  } else {
+    emit8(j, 0x80 | (r & 7) << 3 | (b & 7));
+    emit32(j, (uint32_t)rm.disp);
+  }
+}
+
+// Same for a [base + index << scale + disp8] operand.
+static void emit_op_index(struct RISC_JIT *j, uint32_t opcode, int r, int base, int index, int scale, int disp) {
+  uint32_t rex = 0x40 | ((r & 8) ? 4 : 0) | ((index & 8) ? 2 : 0) | ((base & 8) ? 1 : 0);
+  if (rex != 0x40) {
+    emit8(j, rex);
+  }
+  if (opcode > 0xFF) {
+    emit8(j, opcode >> 8);
+  }
+  emit8(j, opcode & 0xFF);
+  emit8(j, (disp != 0 ? 0x44 : 0x04) | (r & 7) << 3);
+  emit8(j, (uint32_t)scale << 6 | (index & 7) << 3 | (base & 7));
+  if (disp != 0) {
+    emit8(j, (uint32_t)disp);
+  }
+}
+
+static void emit_mov_r_rm(struct RISC_JIT *j, int r, struct Opnd rm) {
+  if (rm.reg != r) {
+    emit_op(j, false, 0x8B, r, rm);
+  }
+}
+
+static void emit_mov_rm_r(struct RISC_JIT *j, struct Opnd rm, int r) {
+  if (rm.reg != r) {
+    emit_op(j, false, 0x89, r, rm);
+  }
+}
+
+static void emit_mov_rm_imm(struct RISC_JIT *j, struct Opnd rm, uint32_t imm) {
+  emit_op(j, false, 0xC7, 0, rm);
+  emit32(j, imm);
+}
+
+static void emit_alu_r_rm(struct RISC_JIT *j, int x, int r, struct Opnd rm) {
+  emit_op(j, false, (uint32_t)x * 8 + 3, r, rm);
+}
+
+static void emit_alu_rm_imm(struct RISC_JIT *j, int x, struct Opnd rm, uint32_t imm) {
+  if ((int32_t)imm >= -128 && (int32_t)imm < 128) {
+    emit_op(j, false, 0x83, x, rm);
+    emit8(j, imm);
+  } else {
+    emit_op(j, false, 0x81, x, rm);
+    emit32(j, imm);
+  }
+}
+
+static void emit_setcc(struct RISC_JIT *j, int cc, struct Opnd rm) {
+  emit_op(j, false, 0x0F90 + (uint32_t)cc, 0, rm);
+}
+
+static void emit_call(struct RISC_JIT *j, uint64_t fn) {
+  emit8(j, 0x48);  // mov rax, fn
+  emit8(j, 0xB8);
+  emit64(j, fn);
+  emit8(j, 0xFF);  // call rax
+  emit8(j, 0xD0);
+}
+
+// Forward jumps return the place of their offset for jit_patch.
+static uint8_t *emit_jcc(struct RISC_JIT *j, int cc) {
+  emit8(j, 0x0F);
+  emit8(j, 0x80 + (uint32_t)cc);
+  emit32(j, 0);
+  return j->p - 4;
+}
+
+static uint8_t *emit_jmp(struct RISC_JIT *j) {
+  emit8(j, 0xE9);
+  emit32(j, 0);
+  return j->p - 4;
+}
+
+static void emit_jcc_to(struct RISC_JIT *j, int cc, const uint8_t *target) {
+  emit8(j, 0x0F);
+  emit8(j, 0x80 + (uint32_t)cc);
+  emit32(j, (uint32_t)(target - (j->p + 4)));
+}
+
+static void emit_jmp_to(struct RISC_JIT *j, const uint8_t *target) {
+  emit8(j, 0xE9);
+  emit32(j, (uint32_t)(target - (j->p + 4)));
+}
+
+static void jit_patch(struct RISC_JIT *j, uint8_t *rel) {
+  uint32_t offset = (uint32_t)(j->p - (rel + 4));
+  memcpy(rel, &offset, 4);
+}
+
+static void emit_flags(struct RISC_JIT *j) {
+  if (j->flag_reg >= 0) {
+    struct Opnd v = guest(j, j->flag_reg);
+    if (v.reg < 0) {
+      emit_mov_r_rm(j, RAX, v);
+      v = reg_op(RAX);
+    }
+    emit_mov_rm_r(j, FIELD(flag_res), v.reg);
+  }
+}
+
+// Sets reg to Z or N, from flag_res.
+static void emit_flag_z(struct RISC_JIT *j, int reg) {
+  emit_alu_r_rm(j, X_XOR, reg, reg_op(reg));
+  emit_alu_rm_imm(j, X_CMP, FIELD(flag_res), 0);
+  emit_setcc(j, CC_E, reg_op(reg));
+}
+
+static void emit_flag_n(struct RISC_JIT *j, int reg) {
+  emit_mov_r_rm(j, reg, FIELD(flag_res));
+  emit_op(j, false, 0xC1, X_SHR, reg_op(reg));
+  emit8(j, 31);
+}
+
+// Leaves the block. The next PC is either a constant or taken from
+// guest register target_reg. Unless chain is false, execution goes on
+// with the next block if it has been translated.
+static void emit_exit(struct RISC_JIT *j, int target_reg, uint32_t pc, uint32_t count, bool chain) {
+  emit_flags(j);
+  for (int g = 0; g < 16; g++) {
+    if (j->host[g] >= 0 && (j->written & (1u << g))) {
+      emit_mov_rm_r(j, mem_op(offsetof(struct RISC, R) + 4 * (size_t)g), j->host[g]);
+    }
+  }
+  if (target_reg >= 0) {
+    emit_mov_r_rm(j, RAX, mem_op(offsetof(struct RISC, R) + 4 * (size_t)target_reg));
+    emit_op(j, false, 0xC1, X_SHR, reg_op(RAX));
+    emit8(j, 2);
+  } else {
+    emit_mov_rm_imm(j, reg_op(RAX), pc);
+  }
+  emit_alu_rm_imm(j, X_SUB, reg_op(R15), count);
+  emit_jmp_to(j, chain ? j->chain : j->epilogue);
+}
+
+static void emit_result(struct RISC_JIT *j, int a) {
+  emit_mov_rm_r(j, guest(j, a), RAX);
+  j->flag_reg = a;
+}
+
+static void emit_mov_rdi_risc(struct RISC_JIT *j) {
+  emit_op(j, true, 0x89, RBX, reg_op(RDI));
+}
+
+// Translated code only deals with C and V in FLAGS_CV form.
+static void jit_fix_flags(struct RISC *risc) {
+  if (risc->flag_op != FLAGS_CV) {
+    risc_set_flags(risc, risc_flag_z(risc), risc_flag_n(risc),
+                   risc_flag_c(risc), risc_flag_v(risc));
+  }
+}
+
+// Runs the instruction at pc in the interpreter. Returns whether the
+// block has to be left.
+static uint32_t jit_step(struct RISC *risc, uint32_t pc) {
+  uint32_t generation = risc->jit->generation;
+  risc->PC = pc;
+  risc_interpret(risc, 1);
+  jit_fix_flags(risc);
+  return risc->PC != pc + 1 || risc->jit->generation != generation ||
+         !risc->progress || risc_interrupt_ready(risc);
+}
+
+static uint32_t jit_store_word(struct RISC *risc, uint32_t address, uint32_t value) {
+  uint32_t generation = risc->jit->generation;
+  risc_store_word(risc, address, value);
+  return risc->jit->generation != generation;
+}
+
+static uint32_t jit_store_byte(struct RISC *risc, uint32_t address, uint32_t value) {
+  uint32_t generation = risc->jit->generation;
+  risc_store_byte(risc, address, (uint8_t)value);
+  return risc->jit->generation != generation;
+}
+
+static void emit_address(struct RISC_JIT *j, const struct Decoded *d) {
+  emit_mov_r_rm(j, RAX, guest(j, d->b));
+  if (d->imm != 0) {
+    emit_alu_rm_imm(j, X_ADD, reg_op(RAX), d->imm);
+  }
+}
+
+static void emit_load(struct RISC_JIT *j, const struct Decoded *d, uint32_t next, uint32_t count) {
+  bool byte = d->op == I_LDB;
+  emit_address(j, d);
+  emit_alu_r_rm(j, X_CMP, RAX, FIELD(mem_size));
+  uint8_t *slow = emit_jcc(j, CC_AE);
+  emit_op(j, true, 0x8B, RDX, FIELD(RAM));
+  if (byte) {
+    emit_op_index(j, 0x0FB6, RAX, RDX, RAX, 0, 0);
+  } else {
+    emit_alu_rm_imm(j, X_AND, reg_op(RAX), ~3u);
+    emit_op_index(j, 0x8B, RAX, RDX, RAX, 0, 0);
+  }
+  emit_result(j, d->a);
+  uint8_t *done = emit_jmp(j);
+
+  // I/O, which may tell us to stop early.
+  jit_patch(j, slow);
+  emit_mov_rm_r(j, reg_op(RSI), RAX);
+  emit_mov_rdi_risc(j);
+  if (byte) {
+    emit_call(j, (uint64_t)(uintptr_t)risc_load_byte);
+    emit_op(j, false, 0x0FB6, RAX, reg_op(RAX));
+  } else {
+    emit_call(j, (uint64_t)(uintptr_t)risc_load_word);
+  }
+  emit_result(j, d->a);
+  emit_alu_rm_imm(j, X_CMP, FIELD(progress), 0);
+  uint8_t *cont = emit_jcc(j, CC_NE);
+  emit_exit(j, -1, next, count, false);
+  jit_patch(j, cont);
+  jit_patch(j, done);
+}
+
+static void emit_store(struct RISC_JIT *j, const struct Decoded *d, uint32_t next, uint32_t count) {
+  bool byte = d->op == I_STB;
+  emit_address(j, d);
+  emit_alu_r_rm(j, X_CMP, RAX, FIELD(display_start));
+  uint8_t *slow1 = emit_jcc(j, CC_AE);
+  emit_mov_r_rm(j, RCX, reg_op(RAX));
+  emit_op(j, false, 0xC1, X_SHR, reg_op(RCX));
+  emit8(j, 2);
+  emit_op(j, true, 0x8B, RDX, FIELD(jit_covered));
+  emit_op_index(j, 0xF6, 0, RDX, RCX, 0, 0);  // test byte
+  emit8(j, JIT_COVERED);
+  uint8_t *slow2 = emit_jcc(j, CC_NE);
+  emit_op(j, true, 0x8B, RDX, FIELD(RAM));
+  if (byte) {
+    emit_mov_r_rm(j, R8, guest(j, d->a));
+    emit_op_index(j, 0x88, R8, RDX, RAX, 0, 0);
+  } else {
+    emit_mov_r_rm(j, RSI, guest(j, d->a));
+    emit_op_index(j, 0x89, RSI, RDX, RCX, 2, 0);
+  }
+  emit_op(j, true, 0x8B, RDX, FIELD(RAM_decoded));
+  emit_op_index(j, 0xC6, 0, RDX, RCX, 3, 0);
+  emit8(j, I_DECODE);
+  uint8_t *done = emit_jmp(j);
+
+  // Framebuffer, I/O or translated code. Leave if blocks were
+  // thrown away, this one might be among them.
+  jit_patch(j, slow1);
+  jit_patch(j, slow2);
+  emit_mov_rm_r(j, reg_op(RSI), RAX);
+  emit_mov_r_rm(j, RDX, guest(j, d->a));
+  emit_mov_rdi_risc(j);
+  emit_call(j, (uint64_t)(uintptr_t)(byte ? jit_store_byte : jit_store_word));
+  emit_op(j, false, 0x85, RAX, reg_op(RAX));
+  uint8_t *cont = emit_jcc(j, CC_E);
+  emit_exit(j, -1, next, count, false);
+  jit_patch(j, cont);
+  jit_patch(j, done);
+}
+
+static void emit_condition(struct RISC_JIT *j, uint32_t cond) {
+  switch (cond & 7) {
+    case 0:  // N
+      emit_flag_n(j, RAX);
+      break;
+    case 1:  // Z
+      emit_flag_z(j, RAX);
+      break;
+    case 2:  // C
+      emit_op(j, false, 0x0FB6, RAX, FIELD(C));
+      break;
+    case 3:  // V
+      emit_op(j, false, 0x0FB6, RAX, FIELD(V));
+      break;
+    case 4:  // C | Z
+      emit_flag_z(j, RAX);
+      emit_op(j, false, 0x0FB6, RCX, FIELD(C));
+      emit_alu_r_rm(j, X_OR, RAX, reg_op(RCX));
+      break;
+    default:  // N ^ V, (N ^ V) | Z
+      emit_flag_n(j, RAX);
+      emit_op(j, false, 0x0FB6, RCX, FIELD(V));
+      emit_alu_r_rm(j, X_XOR, RAX, reg_op(RCX));
+      if ((cond & 7) == 6) {
+        emit_flag_z(j, RCX);
+        emit_alu_r_rm(j, X_OR, RAX, reg_op(RCX));
+      }
+      break;
+  }
+  emit_op(j, false, 0x85, RAX, reg_op(RAX));
+}
+
+static void emit_branch(struct RISC_JIT *j, const struct Decoded *d, uint32_t next, uint32_t count) {
+  bool cond = d->op == I_BR || d->op == I_BRI || d->op == I_BL || d->op == I_BLI;
+  bool link = d->op == I_BL || d->op == I_BLI || d->op == I_CALL || d->op == I_CALLI;
+  bool reg = d->op == I_BR || d->op == I_BL || d->op == I_JMP || d->op == I_CALL;
+  if (cond) {
+    emit_flags(j);
+    j->flag_reg = -1;
+    emit_condition(j, d->b);
+    uint8_t *taken = emit_jcc(j, (d->b & 8) ? CC_E : CC_NE);
+    emit_exit(j, -1, next, count, true);
+    jit_patch(j, taken);
+  }
+  emit_op(j, true, 0x83, X_ADD, FIELD(stats.branches_taken));
+  emit8(j, 1);
+  // The link register is written before the target register is read.
+  if (link) {
+    emit_mov_rm_imm(j, guest(j, 15), next * 4);
+    j->flag_reg = 15;
+  }
+  if (reg) {
+    emit_exit(j, d->c, 0, count, true);
+  } else {
+    emit_exit(j, -1, next + d->imm, count, true);
+  }
+}
+
+static void emit_step(struct RISC_JIT *j, uint32_t pc, uint32_t count) {
+  emit_flags(j);
+  j->flag_reg = -1;
+  for (int g = 0; g < 16; g++) {
+    if (j->host[g] >= 0 && (j->written & (1u << g))) {
+      emit_mov_rm_r(j, mem_op(offsetof(struct RISC, R) + 4 * (size_t)g), j->host[g]);
+    }
+  }
+  emit_mov_rm_imm(j, reg_op(RSI), pc);
+  emit_mov_rdi_risc(j);
+  emit_call(j, (uint64_t)(uintptr_t)jit_step);
+  emit_op(j, false, 0x85, RAX, reg_op(RAX));
+  uint8_t *cont = emit_jcc(j, CC_E);
+  // The interpreter left everything in memory.
+  emit_mov_r_rm(j, RAX, FIELD(PC));
+  emit_alu_rm_imm(j, X_SUB, reg_op(R15), count);
+  emit_jmp_to(j, j->epilogue);
+  jit_patch(j, cont);
+  for (int g = 0; g < 16; g++) {
+    if (j->host[g] >= 0) {
+      emit_mov_r_rm(j, j->host[g], mem_op(offsetof(struct RISC, R) + 4 * (size_t)g));
+    }
+  }
+}
+
+static void emit_insn(struct RISC_JIT *j, const struct Decoded *d, uint32_t pc, uint32_t count) {
+  uint32_t next = pc + 1;
+  switch (d->op) {
+    case I_MOV:
+      emit_mov_r_rm(j, RAX, guest(j, d->c));
+      emit_result(j, d->a);
+      break;
+    case I_MOVI:
+      emit_mov_rm_imm(j, guest(j, d->a), d->imm);
+      j->flag_reg = d->a;
+      break;
+    case I_MOVH:
+      emit_mov_r_rm(j, RAX, FIELD(H));
+      emit_result(j, d->a);
+      break;
+    case I_MOVF:
+      emit_flags(j);
+      emit_mov_rm_imm(j, reg_op(RDX), 0xD0);
+      for (int i = 0; i < 4; i++) {
+        switch (i) {
+          case 0:  emit_flag_n(j, RCX); break;
+          case 1:  emit_flag_z(j, RCX); break;
+          case 2:  emit_op(j, false, 0x0FB6, RCX, FIELD(C)); break;
+          default: emit_op(j, false, 0x0FB6, RCX, FIELD(V)); break;
+        }
+        emit_op(j, false, 0xC1, X_SHL, reg_op(RCX));
+        emit8(j, (uint32_t)(31 - i));
+        emit_alu_r_rm(j, X_OR, RDX, reg_op(RCX));
+      }
+      emit_mov_r_rm(j, RAX, reg_op(RDX));
+      emit_result(j, d->a);
+      break;
+
+    case I_LSL: case I_ASR: case I_ROR: {
+      int x = d->op == I_LSL ? X_SHL : d->op == I_ASR ? X_SAR : X_ROR;
+      emit_mov_r_rm(j, RCX, guest(j, d->c));
+      emit_mov_r_rm(j, RAX, guest(j, d->b));
+      emit_op(j, false, 0xD3, x, reg_op(RAX));
+      emit_result(j, d->a);
+      break;
+    }
+    case I_LSLI: case I_ASRI: case I_RORI: {
+      int x = d->op == I_LSLI ? X_SHL : d->op == I_ASRI ? X_SAR : X_ROR;
+      emit_mov_r_rm(j, RAX, guest(j, d->b));
+      if ((d->imm & 31) != 0) {
+        emit_op(j, false, 0xC1, x, reg_op(RAX));
+        emit8(j, d->imm & 31);
+      }
+      emit_result(j, d->a);
+      break;
+    }
+
+    case I_AND: case I_IOR: case I_XOR: case I_ADD: case I_SUB: {
+      int x = d->op == I_AND ? X_AND : d->op == I_IOR ? X_OR : d->op == I_XOR ? X_XOR :
+              d->op == I_ADD ? X_ADD : X_SUB;
+      emit_mov_r_rm(j, RAX, guest(j, d->b));
+      emit_alu_r_rm(j, x, RAX, guest(j, d->c));
+      if (d->op == I_ADD || d->op == I_SUB) {
+        emit_setcc(j, CC_C, FIELD(C));
+        emit_setcc(j, CC_O, FIELD(V));
+      }
+      emit_result(j, d->a);
+      break;
+    }
+    case I_ANDI: case I_IORI: case I_XORI: case I_ADDI: case I_SUBI: {
+      int x = d->op == I_ANDI ? X_AND : d->op == I_IORI ? X_OR : d->op == I_XORI ? X_XOR :
+              d->op == I_ADDI ? X_ADD : X_SUB;
+      emit_mov_r_rm(j, RAX, guest(j, d->b));
+      emit_alu_rm_imm(j, x, reg_op(RAX), d->imm);
+      if (d->op == I_ADDI || d->op == I_SUBI) {
+        emit_setcc(j, CC_C, FIELD(C));
+        emit_setcc(j, CC_O, FIELD(V));
+      }
+      emit_result(j, d->a);
+      break;
+    }
+    case I_ANN:
+      emit_mov_r_rm(j, RAX, guest(j, d->c));
+      emit_op(j, false, 0xF7, X_NOT, reg_op(RAX));
+      emit_alu_r_rm(j, X_AND, RAX, guest(j, d->b));
+      emit_result(j, d->a);
+      break;
+    case I_ANNI:
+      emit_mov_r_rm(j, RAX, guest(j, d->b));
+      emit_alu_rm_imm(j, X_AND, reg_op(RAX), ~d->imm);
+      emit_result(j, d->a);
+      break;
+
+    case I_MUL: case I_MULU: case I_MULI: case I_MULUI: {
+      int x = (d->op == I_MUL || d->op == I_MULI) ? X_IMUL : X_MUL;
+      emit_mov_r_rm(j, RAX, guest(j, d->b));
+      if (d->op == I_MULI || d->op == I_MULUI) {
+        emit_mov_rm_imm(j, reg_op(RCX), d->imm);
+        emit_op(j, false, 0xF7, x, reg_op(RCX));
+      } else {
+        emit_op(j, false, 0xF7, x, guest(j, d->c));
+      }
+      emit_mov_rm_r(j, FIELD(H), RDX);
+      emit_result(j, d->a);
+      break;
+    }
+    case I_DIV: case I_DIVU: case I_DIVI: case I_DIVUI:
+      emit_mov_r_rm(j, RSI, guest(j, d->b));
+      if (d->op == I_DIVI || d->op == I_DIVUI) {
+        emit_mov_rm_imm(j, reg_op(RDX), d->imm);
+      } else {
+        emit_mov_r_rm(j, RDX, guest(j, d->c));
+      }
+      emit_mov_rm_imm(j, reg_op(RCX), d->op == I_DIVU || d->op == I_DIVUI);
+      emit_mov_rdi_risc(j);
+      emit_call(j, (uint64_t)(uintptr_t)risc_div);
+      emit_result(j, d->a);
+      break;
+    case I_FPU:
+      emit_mov_rm_imm(j, reg_op(RDI), d->imm);
+      emit_mov_r_rm(j, RSI, guest(j, d->b));
+      emit_mov_r_rm(j, RDX, guest(j, d->c));
+      emit_call(j, (uint64_t)(uintptr_t)risc_fpu);
+      emit_result(j, d->a);
+      break;
+
+    case I_LDW: case I_LDB:
+      emit_load(j, d, next, count);
+      break;
+    case I_STW: case I_STB:
+      emit_store(j, d, next, count);
+      break;
+
+    case I_BR: case I_BRI: case I_BL: case I_BLI:
+    case I_JMP: case I_JMPI: case I_CALL: case I_CALLI:
+      emit_branch(j, d, next, count);
+      break;
+    case I_NOP:
+      break;
+    default:
+      // I_DECODE for words that keep changing, and the instructions
+      // that are rare enough to not bother: ADC, SBC, IRET, STI, CLI
+      emit_step(j, pc, count);
+      break;
+  }
+}
+
+static bool jit_ends_block(uint8_t op) {
+  switch (op) {
+    case I_BR: case I_BRI: case I_BL: case I_BLI:
+    case I_JMP: case I_JMPI: case I_CALL: case I_CALLI:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void jit_count_uses(const struct Decoded *d, int *uses, uint32_t *written) {
+  switch (d->op) {
+    case I_MOVI: case I_MOVH:
+      break;
+    case I_MOV:
+      uses[d->c]++;
+      break;
+    case I_LSLI: case I_ASRI: case I_RORI: case I_ANDI: case I_ANNI:
+    case I_IORI: case I_XORI: case I_ADDI: case I_SUBI: case I_MULI:
+    case I_MULUI: case I_DIVI: case I_DIVUI: case I_LDW: case I_LDB:
+      uses[d->b]++;
+      break;
+    case I_STW: case I_STB:
+      uses[d->a]++;
+      uses[d->b]++;
+      return;
+    case I_BR: case I_JMP:
+      uses[d->c]++;
+      return;
+    case I_BL: case I_CALL:
+      uses[d->c]++;
+      // fall through
+    case I_BLI: case I_CALLI:
+      uses[15]++;
+      *written |= 1u << 15;
+      return;
+    case I_BRI: case I_JMPI: case I_NOP:
+      return;
+    case I_DECODE: case I_ADC: case I_ADCI: case I_SBC: case I_SBCI:
+    case I_IRET: case I_STICLI:
+      return;  // stepped, see emit_step
+    default:
+      uses[d->b]++;
+      uses[d->c]++;
+      break;
+  }
+  uses[d->a]++;
+  *written |= 1u << d->a;
+}
+
+static struct Decoded *jit_slot(struct RISC *risc, uint32_t pc) {
+  if (pc < risc->mem_size / 4) {
+    return &risc->RAM_decoded[pc];
+  } else if (pc - ROMStart/4 < ROMWords) {
+    return &risc->ROM_decoded[pc - ROMStart/4];
+  } else {
+    return NULL;
+  }
+}
+
+// Fetches the instruction at pc, returns false past the end of memory.
+// Words that keep changing are fetched as I_DECODE.
+static bool jit_fetch(struct RISC *risc, uint32_t pc, struct Decoded *ins) {
+  struct Decoded *d = jit_slot(risc, pc);
+  if (!d) {
+    return false;
+  }
+  bool ram = pc < risc->mem_size / 4;
+  if (ram && (risc->jit_covered[pc] & ~JIT_COVERED) >= MaxRewrites) {
+    *ins = (struct Decoded){ .op = I_DECODE };
+    return true;
+  }
+  if (d->op == I_DECODE) {
+    risc_decode(ram ? risc->RAM[pc] : risc->ROM[pc - ROMStart/4], d);
+  }
+  if (d->op == I_JIT) {
+    d = &risc->jit->blocks[d->imm].first;
+  }
+  *ins = *d;
+  return true;
+}
+
+static struct Block *jit_translate(struct RISC *risc, uint32_t pc) {
+  struct RISC_JIT *j = risc->jit;
+  struct Decoded ins[MaxBlockLen];
+  uint32_t n = 0;
+  while (n < MaxBlockLen && jit_fetch(risc, pc + n, &ins[n])) {
+    if (jit_ends_block(ins[n++].op)) {
+      break;
+    }
+  }
+  // The first word has to stay put, it holds the I_JIT marker.
+  if (n == 0 || ins[0].op == I_DECODE) {
+    return NULL;
+  }
+  if (j->block_cnt == MaxBlocks || j->code_used + (n + 1) * MaxInsnBytes > CodeSize) {
+    risc_jit_flush(risc);
+  }
+
+  // Keep the most used registers in host registers.
+  int uses[16] = { 0 };
+  j->written = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    jit_count_uses(&ins[i], uses, &j->written);
+  }
+  for (int g = 0; g < 16; g++) {
+    j->host[g] = -1;
+  }
+  for (int k = 0; k < MaxCachedRegs; k++) {
+    int best = -1;
+    for (int g = 0; g < 16; g++) {
+      if (j->host[g] < 0 && uses[g] >= 2 && (best < 0 || uses[g] > uses[best])) {
+        best = g;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    j->host[best] = cache_regs[k];
+  }
+
+  struct Block *b = &j->blocks[j->block_cnt];
+  j->p = j->code + j->code_used;
+  b->pc = pc;
+  b->len = n;
+  b->code = j->p;
+  for (int g = 0; g < 16; g++) {
+    if (j->host[g] >= 0) {
+      emit_mov_r_rm(j, j->host[g], mem_op(offsetof(struct RISC, R) + 4 * (size_t)g));
+    }
+  }
+  j->flag_reg = -1;
+  for (uint32_t i = 0; i < n; i++) {
+    emit_insn(j, &ins[i], pc + i, i + 1);
+  }
+  if (!jit_ends_block(ins[n - 1].op)) {
+    emit_exit(j, -1, pc + n, n, true);
+  }
+  j->code_used = (uint32_t)(j->p - j->code);
+
+  struct Decoded *slot = jit_slot(risc, pc);
+  b->first = *slot;
+  slot->op = I_JIT;
+  slot->imm = j->block_cnt++;
+  if (pc < risc->mem_size / 4) {
+    for (uint32_t i = 0; i < n; i++) {
+      if (ins[i].op != I_DECODE) {
+        risc->jit_covered[pc + i] |= JIT_COVERED;
+      }
+    }
+  }
+  return b;
+}
+
+struct RISC_JIT *risc_jit_new(struct RISC *risc) {
+  if (sizeof(struct Decoded) != 8 || offsetof(struct Decoded, op) != 0) {
+    return NULL;  // the store fast path relies on this layout
+  }
+  struct RISC_JIT *j = calloc(1, sizeof(*j));
+  j->code = mmap(NULL, CodeSize, PROT_READ | PROT_WRITE | PROT_EXEC,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (j->code == MAP_FAILED) {
+    free(j);
+    return NULL;
+  }
+  j->blocks = calloc(MaxBlocks, sizeof(struct Block));
+  risc->jit_covered = risc_alloc_pages(risc->mem_size / 4);
+
+  // uint64_t start(struct RISC *risc, const uint8_t *code, uint32_t cycles)
+  // saves the callee-saved registers, keeps risc in rbx and the cycle
+  // budget in r15, and jumps to the block. The epilogue returns the
+  // next PC from eax and the remaining budget in the upper half.
+  static const uint8_t start[] = {
+    0x53, 0x55, 0x41, 0x54, 0x41, 0x55,  // push rbx, rbp, r12, r13,
+    0x41, 0x56, 0x41, 0x57,              //      r14, r15
+    0x48, 0x83, 0xEC, 0x08,              // sub rsp, 8
+    0x48, 0x89, 0xFB,                    // mov rbx, rdi
+    0x41, 0x89, 0xD7,                    // mov r15d, edx
+    0xFF, 0xE6,                          // jmp rsi
+  };
+  static const uint8_t epilogue[] = {
+    0x44, 0x89, 0xF9,                    // mov ecx, r15d
+    0x48, 0xC1, 0xE1, 0x20,              // shl rcx, 32
+    0x48, 0x09, 0xC8,                    // or rax, rcx
+    0x48, 0x83, 0xC4, 0x08,              // add rsp, 8
+    0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D,  // pop r15, r14, r13,
+    0x41, 0x5C, 0x5D, 0x5B,              //     r12, rbp, rbx
+    0xC3,                                // ret
+  };
+  j->start = j->code;
+  memcpy(j->start, start, sizeof(start));
+  j->epilogue = j->start + sizeof(start);
+  memcpy(j->epilogue, epilogue, sizeof(epilogue));
+
+  // Chaining: with the next PC in eax, enter its block if there is
+  // one and the budget allows it, otherwise go back to risc_jit_run.
+  j->chain = j->epilogue + sizeof(epilogue);
+  j->p = j->chain;
+  emit_mov_r_rm(j, RDX, FIELD(mem_size));
+  emit_op(j, false, 0xC1, X_SHR, reg_op(RDX));
+  emit8(j, 2);
+  emit_alu_r_rm(j, X_CMP, RAX, reg_op(RDX));
+  emit_jcc_to(j, CC_AE, j->epilogue);
+  emit_op(j, true, 0x8B, RDX, FIELD(RAM_decoded));
+  emit_op_index(j, 0x80, X_CMP, RDX, RAX, 3, 0);
+  emit8(j, I_JIT);
+  emit_jcc_to(j, CC_NE, j->epilogue);
+  emit_op_index(j, 0x8B, RCX, RDX, RAX, 3, (int)offsetof(struct Decoded, imm));
+  emit_op(j, false, 0x6B, RCX, reg_op(RCX));  // imul ecx, ecx, imm8
+  emit8(j, sizeof(struct Block));
+  emit8(j, 0x48);                             // mov rdx, blocks
+  emit8(j, 0xBA);
+  emit64(j, (uint64_t)(uintptr_t)j->blocks);
+  emit_op(j, true, 0x03, RDX, reg_op(RCX));
+  emit_alu_r_rm(j, X_CMP, R15, base_op(RDX, offsetof(struct Block, len)));
+  emit_jcc_to(j, CC_C, j->epilogue);
+  emit_op(j, false, 0xFF, 4, base_op(RDX, offsetof(struct Block, code)));  // jmp
+  j->code_base = (uint32_t)(j->p - j->code);
+  j->code_used = j->code_base;
+  return j;
+}
+
+void risc_jit_free(struct RISC *risc) {
+  struct RISC_JIT *j = risc->jit;
+  if (j) {
+    munmap(j->code, CodeSize);
+    free(j->blocks);
+    free(j);
+    risc_free_pages(risc->jit_covered, risc->mem_size / 4);
+    risc->jit = NULL;
+    risc->jit_covered = NULL;
+  }
+}
+
+void risc_jit_flush(struct RISC *risc) {
+  struct RISC_JIT *j = risc->jit;
+  for (uint32_t i = 0; i < j->block_cnt; i++) {
+    if (j->blocks[i].len != 0) {
+      jit_slot(risc, j->blocks[i].pc)->op = I_DECODE;
+    }
+  }
+  j->block_cnt = 0;
+  j->code_used = j->code_base;
+  j->generation++;
+  risc_clear_pages(risc->jit_covered, risc->mem_size / 4);
+}
+
+void risc_jit_invalidate(struct RISC *risc, uint32_t w) {
+  struct RISC_JIT *j = risc->jit;
+  uint32_t pc = w >= MaxBlockLen - 1 ? w - (MaxBlockLen - 1) : 0;
+  for (; pc <= w; pc++) {
+    struct Decoded *slot = &risc->RAM_decoded[pc];
+    if (slot->op == I_JIT) {
+      struct Block *b = &j->blocks[slot->imm];
+      if (w < b->pc + b->len) {
+        slot->op = I_DECODE;
+        b->len = 0;
+      }
+    }
+  }
+  // No block covers w anymore. Other words of the blocks keep their
+  // mark, a later write just finds nothing to throw away.
+  uint8_t rewrites = risc->jit_covered[w] & ~JIT_COVERED;
+  risc->jit_covered[w] = rewrites < 0x7F ? rewrites + 1 : rewrites;
+  j->generation++;
+}
+
+struct Decoded *risc_jit_first(struct RISC *risc, uint32_t block) {
+  return &risc->jit->blocks[block].first;
+}
+
+int risc_jit_run(struct RISC *risc, int cycles) {
+  struct RISC_JIT *j = risc->jit;
+  uint64_t (*start)(struct RISC *, const uint8_t *, uint32_t) =
+    (uint64_t (*)(struct RISC *, const uint8_t *, uint32_t))(uintptr_t)j->start;
+  while (cycles > 0) {
+    if (risc_interrupt_ready(risc)) {
+      risc->PC = risc_enter_interrupt(risc, risc->PC);
+    }
+    struct Decoded *slot = jit_slot(risc, risc->PC);
+    struct Block *b = NULL;
+    if (slot && slot->op == I_JIT) {
+      b = &j->blocks[slot->imm];
+    } else if (slot) {
+      b = jit_translate(risc, risc->PC);
+    }
+    if (b && b->len <= (uint32_t)cycles) {
+      jit_fix_flags(risc);
+      uint64_t r = start(risc, b->code, (uint32_t)cycles);
+      risc->PC = (uint32_t)r;
+      cycles = (int)(r >> 32);
+    } else {
+      risc_interpret(risc, 1);
+      cycles--;
+    }
+    if (!risc->progress) {
+      break;
+    }
+  }
+  return cycles;
+}
+
+#else
+
+// No translator for this host, risc_set_jit reports that.
+
+struct RISC_JIT *risc_jit_new(struct RISC *risc) {
+  return NULL;
+}
+
+void risc_jit_free(struct RISC *risc) {
+}
+
+void risc_jit_flush(struct RISC *risc) {
+}
+
+void risc_jit_invalidate(struct RISC *risc, uint32_t w) {
+}
+
+struct Decoded *risc_jit_first(struct RISC *risc, uint32_t block) {
+  return NULL;
+}
+
+int risc_jit_run(struct RISC *risc, int cycles) {
+  return risc_interpret(risc, cycles);
+}
+
+#endif
@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "risc-cpu.h"
+
+// A sampling profiler for the guest. Every period instructions
+// risc_run stops to look at the PC and walk the call stack, and the
+// stacks are counted by name.
+//
+// Names come from the module list in guest memory. The boot file
+// leaves the inner core's list at address 20; Modules.root, the full
+// list, is the variable of Modules that leads there through the
+// longest chain. A procedure starts with the prologue ORG generates:
+//
+//   SUB SP, SP, size
+//   STW LNK, SP, 0
+//
+// which also tells where the return address is. Procedures are named
+// after their command, if they are one, and by their offset in the
+// module's code otherwise, since the guest has no other names.
+
+#define MaxDepth 64
+#define MaxModules 1024
+#define FrameLen 72
+#define CountBuckets 4096
+#define ProcCacheSize 4096
+
+#define PROLOGUE_SUB  0x4EE90000  // SUB SP, SP, imm
+#define PROLOGUE_STW  0xAFE00000  // STW LNK, SP, 0
+#define EPILOGUE_ADD  0x4EE80000  // ADD SP, SP, imm
+#define EPILOGUE_BR   0xC700000F  // B LNK
+
+// Module descriptor, as in Modules.Mod.
+enum {
+  ModName = 0, ModNext = 32, ModData = 52, ModCode = 56, ModImp = 60,
+  ModCmd = 64, ModEnt = 68, ModPtr = 72, ModDescSize = 80
+};
+
+struct Module {
+  uint32_t addr;
+  uint32_t data, code, imp, cmd, ent, ptr;
+  char name[32];
+};
+
+struct Procedure {
+  uint32_t pc, insn, mod;
+  uint32_t start;  // word address of the prologue
+  char name[FrameLen];
+};
+
+struct Count {
+  struct Count *next;
+  uint64_t n;
+  char name[];
+};
+
+struct Counts {
+  struct Count *buckets[CountBuckets];
+  size_t len;
+};
+
+struct RISC_Profile {
+  uint32_t period;
+  uint32_t countdown;
+  uint64_t samples;
+  uint32_t root_var;  // address of Modules.root, 0 until found
+  int mod_cnt;
+  struct Module mods[MaxModules];
+  struct Procedure cache[ProcCacheSize];
+  struct Counts stacks, procs, modules;
+};
+
+static uint32_t word(const struct RISC *risc, uint32_t address) {
+  return risc->RAM[address / 4];
+}
+
+static bool read_module(const struct RISC *risc, uint32_t addr, struct Module *m) {
+  uint32_t limit = risc->display_start;
+  if (addr % 4 != 0 || addr >= limit - ModDescSize) {
+    return false;
+  }
+  for (int i = 0; i < 32; i++) {
+    char ch = (char)(word(risc, addr + (uint32_t)i) >> (i % 4 * 8));
+    m->name[i] = ch;
+    if (ch == 0) {
+      break;
+    }
+    bool letter = (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z');
+    if (i == 31 || !(letter || (i > 0 && ch >= '0' && ch <= '9'))) {
+      return false;
+    }
+  }
+  m->addr = addr;
+  m->data = word(risc, addr + ModData);
+  m->code = word(risc, addr + ModCode);
+  m->imp = word(risc, addr + ModImp);
+  m->cmd = word(risc, addr + ModCmd);
+  m->ent = word(risc, addr + ModEnt);
+  m->ptr = word(risc, addr + ModPtr);
+  return m->name[0] != 0 && addr < m->data && m->data <= m->code && m->code <= m->imp &&
+    m->imp <= m->cmd && m->cmd <= m->ent && m->ent <= m->ptr && m->ptr < limit &&
+    m->code % 4 == 0 && m->imp % 4 == 0 && m->cmd % 4 == 0;
+}
+
+// The length of the list starting at mod, if it leads to core.
+static int chain_length(const struct RISC *risc, uint32_t mod, uint32_t core) {
+  struct Module m;
+  for (int n = 1; n <= MaxModules && read_module(risc, mod, &m); n++) {
+    if (mod == core) {
+      return n;
+    }
+    mod = word(risc, mod + ModNext);
+  }
+  return 0;
+}
+
+static uint32_t find_root_var(const struct RISC *risc, uint32_t core) {
+  struct Module m;
+  uint32_t mod = core, root_var = 0;
+  for (int n = 0; n < MaxModules && read_module(risc, mod, &m); n++) {
+    if (strcmp(m.name, "Modules") == 0) {
+      int best = 0;
+      for (uint32_t a = m.data; a < m.code; a += 4) {
+        int len = chain_length(risc, word(risc, a), core);
+        if (len > best) {
+          best = len;
+          root_var = a;
+        }
+      }
+      break;
+    }
+    mod = word(risc, mod + ModNext);
+  }
+  return root_var;
+}
+
+// Fills in the list starting at mod, returns false unless it goes
+// through core, the top of the inner core.
+static bool read_list(struct RISC_Profile *p, const struct RISC *risc, uint32_t mod, uint32_t core) {
+  bool through_core = false;
+  p->mod_cnt = 0;
+  while (p->mod_cnt < MaxModules && read_module(risc, mod, &p->mods[p->mod_cnt])) {
+    p->mod_cnt++;
+    through_core |= mod == core;
+    mod = word(risc, mod + ModNext);
+  }
+  if (!through_core) {
+    p->mod_cnt = 0;
+  }
+  return through_core;
+}
+
+// Reads the module list, once per sample.
+static void load_modules(struct RISC_Profile *p, const struct RISC *risc) {
+  uint32_t core = word(risc, 20);
+  if (p->root_var == 0 || !read_list(p, risc, word(risc, p->root_var), core)) {
+    p->root_var = find_root_var(risc, core);
+    read_list(p, risc, p->root_var ? word(risc, p->root_var) : core, core);
+  }
+}
+
+static const struct Module *find_module(const struct RISC_Profile *p, uint32_t address) {
+  for (int i = 0; i < p->mod_cnt; i++) {
+    if (address >= p->mods[i].code && address < p->mods[i].imp) {
+      return &p->mods[i];
+    }
+  }
+  return NULL;
+}
+
+// The word address of the prologue at or before pc, or 0.
+static uint32_t find_procedure(const struct RISC *risc, const struct Module *m, uint32_t pc) {
+  for (uint32_t w = pc; w >= m->code / 4 && w + 1 < m->imp / 4; w--) {
+    if ((risc->RAM[w] & 0xFFFF0000) == PROLOGUE_SUB && risc->RAM[w + 1] == PROLOGUE_STW) {
+      return w;
+    }
+  }
+  return 0;
+}
+
+static void procedure_name(const struct RISC *risc, const struct Module *m, uint32_t offset,
+                           char name[static FrameLen]) {
+  // Commands are listed as name, padding to a word, offset.
+  uint32_t p = m->cmd;
+  while (p < m->ent && (uint8_t)word(risc, p) != 0) {
+    char cmd[32];
+    int len = 0;
+    for (; p < m->ent; p++) {
+      char ch = (char)(word(risc, p) >> (p % 4 * 8));
+      if (ch == 0) {
+        break;
+      }
+      if (len < 31) {
+        cmd[len++] = ch;
+      }
+    }
+    cmd[len] = 0;
+    p = (p + 4) & ~3U;
+    if (p < m->ent && word(risc, p) == offset) {
+      snprintf(name, FrameLen, "%s.%s", m->name, cmd);
+      return;
+    }
+    p += 4;
+  }
+  if (m->ent < m->ptr && word(risc, m->ent) == offset) {
+    snprintf(name, FrameLen, "%s.BEGIN", m->name);
+  } else {
+    snprintf(name, FrameLen, "%s+%X", m->name, offset);
+  }
+}
+
+// Finding the procedure takes a search, so the result is kept for
+// the PC. The entry is used again as long as the PC's instruction and
+// the prologue are still in place.
+static const struct Procedure *find_cached(struct RISC_Profile *p, const struct RISC *risc,
+                                           const struct Module *m, uint32_t pc) {
+  struct Procedure *e = &p->cache[pc % ProcCacheSize];
+  if (e->pc == pc && e->insn == risc->RAM[pc] && e->mod == m->addr &&
+      (risc->RAM[e->start] & 0xFFFF0000) == PROLOGUE_SUB) {
+    return e;
+  }
+  uint32_t start = find_procedure(risc, m, pc);
+  if (start == 0) {
+    return NULL;
+  }
+  e->pc = pc;
+  e->insn = risc->RAM[pc];
+  e->mod = m->addr;
+  e->start = start;
+  char name[FrameLen];
+  procedure_name(risc, m, start * 4 - m->code, name);
+  memcpy(e->name, name, sizeof(name));
+  return e;
+}
+
+// Fills frames from the innermost out and returns how many there are.
+// module is set to the innermost frame's module.
+static int walk_stack(struct RISC_Profile *p, const struct RISC *risc,
+                      char frames[static MaxDepth][FrameLen], char module[static 32]) {
+  const uint32_t mem_words = risc->display_start / 4;
+  load_modules(p, risc);
+  uint32_t pc = risc->PC, sp = risc->R[14];
+  int depth = 0;
+  strcpy(module, "?");
+  while (depth < MaxDepth) {
+    const struct Module *m;
+    if (pc - ROMStart/4 < ROMWords) {
+      strcpy(frames[depth++], "ROM");
+      if (depth == 1) {
+        strcpy(module, "ROM");
+      }
+      break;
+    }
+    if (pc >= mem_words || (m = find_module(p, pc * 4)) == NULL) {
+      snprintf(frames[depth++], FrameLen, "@%X", pc * 4);
+      break;
+    }
+    if (depth == 0) {
+      strcpy(module, m->name);
+    }
+    // The return address of outer frames points past the call.
+    const struct Procedure *proc = find_cached(p, risc, m, depth == 0 ? pc : pc - 1);
+    if (proc == NULL) {
+      snprintf(frames[depth++], FrameLen, "%s+%X", m->name, pc * 4 - m->code);
+      break;
+    }
+    strcpy(frames[depth], proc->name);
+    uint32_t start = proc->start;
+    uint32_t size = risc->RAM[start] & 0xFFFF;
+    uint32_t ret;
+    if (depth == 0 && (pc == start || pc == start + 1)) {
+      ret = risc->R[15];
+      sp += pc == start ? 0 : size;
+    } else if (depth == 0 && risc->RAM[pc] == EPILOGUE_BR && risc->RAM[pc - 1] == (EPILOGUE_ADD | size)) {
+      ret = risc->R[15];
+    } else if (sp % 4 == 0 && sp / 4 < mem_words) {
+      ret = word(risc, sp);
+      sp += size;
+    } else {
+      depth++;
+      break;
+    }
+    depth++;
+    if (ret == 0 || ret % 4 != 0) {
+      break;
+    }
+    pc = ret / 4;
+  }
+  return depth;
+}
+
+static void count(struct Counts *counts, const char *name) {
+  uint32_t h = 2166136261u;
+  for (const char *c = name; *c; c++) {
+    h = (h ^ (uint8_t)*c) * 16777619u;
+  }
+  struct Count **slot = &counts->buckets[h % CountBuckets];
+  for (struct Count *e = *slot; e; e = e->next) {
+    if (strcmp(e->name, name) == 0) {
+      e->n++;
+      return;
+    }
+  }
+  size_t len = strlen(name) + 1;
+  struct Count *e = malloc(sizeof(*e) + len);
+  if (e == NULL) {
+    return;  // the sample is lost
+  }
+  e->n = 1;
+  memcpy(e->name, name, len);
+  e->next = *slot;
+  *slot = e;
+  counts->len++;
+}
+
+static void free_counts(struct Counts *counts) {
+  for (int i = 0; i < CountBuckets; i++) {
+    while (counts->buckets[i]) {
+      struct Count *e = counts->buckets[i];
+      counts->buckets[i] = e->next;
+      free(e);
+    }
+  }
+  counts->len = 0;
+}
+
+static void sample(struct RISC *risc) {
+  struct RISC_Profile *p = risc->profile;
+  char frames[MaxDepth][FrameLen], module[32];
+  int depth = walk_stack(p, risc, frames, module);
+
+  // Collapsed stacks go from the outermost frame in.
+  char text[MaxDepth * FrameLen];
+  size_t len = 0;
+  for (int i = depth - 1; i >= 0; i--) {
+    size_t n = strlen(frames[i]);
+    memcpy(text + len, frames[i], n);
+    len += n;
+    text[len++] = i > 0 ? ';' : 0;
+  }
+  count(&p->stacks, text);
+  count(&p->procs, frames[0]);
+  count(&p->modules, module);
+  p->samples++;
+}
+
+int risc_profile_slice(struct RISC *risc, int cycles) {
+  uint32_t countdown = risc->profile->countdown;
+  return (uint32_t)cycles > countdown ? (int)countdown : cycles;
+}
+
+void risc_profile_count(struct RISC *risc, int executed) {
+  struct RISC_Profile *p = risc->profile;
+  p->countdown -= (uint32_t)executed;
+  if (p->countdown == 0) {
+    sample(risc);
+    p->countdown = p->period;
+  }
+}
+
+bool risc_set_profile(struct RISC *risc, uint32_t period) {
+  if (risc->profile) {
+    free_counts(&risc->profile->stacks);
+    free_counts(&risc->profile->procs);
+    free_counts(&risc->profile->modules);
+    free(risc->profile);
+    risc->profile = NULL;
+  }
+  if (period == 0) {
+    return true;
+  }
+  risc->profile = calloc(1, sizeof(*risc->profile));
+  if (risc->profile == NULL) {
+    return false;
+  }
+  risc->profile->period = period;
+  risc->profile->countdown = period;
+  return true;
+}
+
+static int by_count(const void *a, const void *b) {
+  const struct Count *x = *(const struct Count *const *)a, *y = *(const struct Count *const *)b;
+  if (x->n != y->n) {
+    return x->n < y->n ? 1 : -1;
+  }
+  return strcmp(x->name, y->name);
+}
+
+// Returns the entries sorted by count, or NULL.
+static struct Count **sorted(const struct Counts *counts) {
+  struct Count **list = malloc((counts->len + 1) * sizeof(*list));
+  if (list == NULL) {
+    return NULL;
+  }
+  size_t n = 0;
+  for (int i = 0; i < CountBuckets; i++) {
+    for (struct Count *e = counts->buckets[i]; e; e = e->next) {
+      list[n++] = e;
+    }
+  }
+  qsort(list, n, sizeof(*list), by_count);
+  return list;
+}
+
+static bool write_histogram(const struct RISC_Profile *p, FILE *f) {
+  struct Count **procs = sorted(&p->procs), **modules = sorted(&p->modules);
+  bool ok = procs && modules;
+  if (ok) {
+    double total = p->samples ? (double)p->samples : 1;
+    fprintf(f, "# %llu samples, one every %u instructions\n",
+            (unsigned long long)p->samples, p->period);
+    fprintf(f, "\n# samples  percent  module\n");
+    for (size_t i = 0; i < p->modules.len; i++) {
+      fprintf(f, "%9llu %7.2f%%  %s\n", (unsigned long long)modules[i]->n,
+              100.0 * (double)modules[i]->n / total, modules[i]->name);
+    }
+    fprintf(f, "\n# samples  percent  procedure\n");
+    for (size_t i = 0; i < p->procs.len; i++) {
+      fprintf(f, "%9llu %7.2f%%  %s\n", (unsigned long long)procs[i]->n,
+              100.0 * (double)procs[i]->n / total, procs[i]->name);
+    }
+  }
+  free(procs);
+  free(modules);
+  return ok;
+}
+
+static bool write_stacks(const struct RISC_Profile *p, FILE *f) {
+  struct Count **stacks = sorted(&p->stacks);
+  if (stacks == NULL) {
+    return false;
+  }
+  for (size_t i = 0; i < p->stacks.len; i++) {
+    fprintf(f, "%s %llu\n", stacks[i]->name, (unsigned long long)stacks[i]->n);
+  }
+  free(stacks);
+  return true;
+}
+
+bool risc_write_profile(struct RISC *risc, const char *filename) {
+  const struct RISC_Profile *p = risc->profile;
+  if (p == NULL) {
+    return true;
+  }
+  size_t len = strlen(filename) + sizeof(".folded");
+  char *stacks_file = malloc(len);
+  if (stacks_file == NULL) {
+    return false;
+  }
+  snprintf(stacks_file, len, "%s.folded", filename);
+  bool ok = false;
+  FILE *f = fopen(filename, "w");
+  if (f) {
+    ok = write_histogram(p, f);
+    ok = fclose(f) == 0 && ok;
+  }
+  if (ok) {
+    f = fopen(stacks_file, "w");
+    ok = f != NULL && write_stacks(p, f);
+    ok = f != NULL && fclose(f) == 0 && ok;
+  }
+  free(stacks_file);
+  return ok;
+}
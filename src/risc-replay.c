@@ -0,0 +1,347 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "risc-cpu.h"
+
+// Records what the host tells the guest, so that the session can be
+// run again instruction for instruction. The log is text, one input
+// per line, keyed by the instructions retired since the recording
+// started:
+//
+//   RISC-LOG 1 TICK MOUSE   header, with the clock and mouse register
+//   AT T TICK               risc_set_time
+//   AT I                    risc_trigger_interrupt
+//   AT M X Y                risc_mouse_moved
+//   AT B BUTTON DOWN        risc_mouse_button
+//   AT K LEN HEX...         risc_keyboard_input
+//   AT R                    risc_reset
+//   AT r REG VALUE          the guest read VALUE from the serial or
+//                           clipboard register at IOStart + REG
+//   AT E                    end of the recording
+//
+// The guest is deterministic otherwise, so a replay from the same
+// starting point runs the same instructions. Meanwhile the host's own
+// inputs are dropped and the guest reads the recorded values instead
+// of asking the devices. Reads end the slice, so that they are keyed
+// exactly as well. A read that doesn't match the log means the replay
+// diverged, and it stops there.
+
+#define LogMagic "RISC-LOG"
+#define LogVersion 1
+
+struct Event {
+  uint64_t at;
+  char kind;
+  uint32_t a, b;  // K: offset into bytes and length
+};
+
+struct RISC_Replay {
+  FILE *log;       // while recording
+  uint64_t start;  // risc->stats.instructions when it started
+
+  struct Event *events;
+  size_t event_cnt, next;
+  uint8_t *bytes;
+  size_t byte_cnt;
+  bool applying;  // set while an input from the log is applied
+  enum RISC_ReplayState state;
+
+  // The read that ended the current slice.
+  bool read_pending;
+  uint32_t read_reg, read_value;
+  size_t read_event;
+  uint32_t progress;
+};
+
+static uint64_t retired(const struct RISC *risc) {
+  return risc->stats.instructions - risc->replay->start;
+}
+
+static void stop_replay(struct RISC *risc) {
+  struct RISC_Replay *r = risc->replay;
+  if (r) {
+    free(r->events);
+    free(r->bytes);
+    free(r);
+    risc->replay = NULL;
+  }
+}
+
+static void diverged(struct RISC *risc, const char *what) {
+  struct RISC_Replay *r = risc->replay;
+  fprintf(stderr, "Replay diverged after %llu instructions: %s\n",
+          (unsigned long long)retired(risc), what);
+  r->state = RISC_REPLAY_DIVERGED;
+}
+
+bool risc_replay_input(struct RISC *risc, char kind, uint32_t a, uint32_t b) {
+  struct RISC_Replay *r = risc->replay;
+  if (r->applying) {
+    return true;
+  }
+  if (r->log == NULL) {
+    return false;  // replaying, the host has no say
+  }
+  fprintf(r->log, "%llu %c", (unsigned long long)retired(risc), kind);
+  switch (kind) {
+    case 'T': fprintf(r->log, " %u", a); break;
+    case 'M': fprintf(r->log, " %d %d", (int)a, (int)b); break;
+    case 'B': fprintf(r->log, " %u %u", a, b); break;
+  }
+  fputc('\n', r->log);
+  return true;
+}
+
+bool risc_replay_keys(struct RISC *risc, const uint8_t *scancodes, uint32_t len) {
+  struct RISC_Replay *r = risc->replay;
+  if (r->applying) {
+    return true;
+  }
+  if (r->log == NULL) {
+    return false;
+  }
+  fprintf(r->log, "%llu K %u", (unsigned long long)retired(risc), len);
+  for (uint32_t i = 0; i < len; i++) {
+    fprintf(r->log, " %02x", scancodes[i]);
+  }
+  fputc('\n', r->log);
+  return true;
+}
+
+uint32_t risc_replay_read(struct RISC *risc, uint32_t reg) {
+  struct RISC_Replay *r = risc->replay;
+  uint32_t value;
+  if (r->log) {
+    value = risc_read_host(risc, reg);
+  } else if (r->state != RISC_REPLAY_RUNNING) {
+    return risc_read_host(risc, reg);
+  } else if (r->next < r->event_cnt && r->events[r->next].kind == 'r' &&
+             r->events[r->next].a == reg) {
+    r->read_event = r->next++;
+    value = r->events[r->read_event].b;
+  } else {
+    diverged(risc, "the guest read an IO register that the log doesn't have");
+    return risc_read_host(risc, reg);
+  }
+  r->read_pending = true;
+  r->read_reg = reg;
+  r->read_value = value;
+  r->progress = risc->progress;
+  risc->progress = 0;
+  return value;
+}
+
+bool risc_replay_settle(struct RISC *risc) {
+  struct RISC_Replay *r = risc->replay;
+  if (!r->read_pending) {
+    return false;
+  }
+  r->read_pending = false;
+  risc->progress = r->progress;
+  if (r->log) {
+    fprintf(r->log, "%llu r %u %u\n", (unsigned long long)retired(risc), r->read_reg, r->read_value);
+  } else if (r->events[r->read_event].at != retired(risc)) {
+    diverged(risc, "an IO register was read at the wrong time");
+  }
+  return true;
+}
+
+static void apply(struct RISC *risc, const struct Event *e) {
+  struct RISC_Replay *r = risc->replay;
+  r->applying = true;
+  switch (e->kind) {
+    case 'T': risc_set_time(risc, e->a); break;
+    case 'I': risc_trigger_interrupt(risc); break;
+    case 'M': risc_mouse_moved(risc, (int)e->a, (int)e->b); break;
+    case 'B': risc_mouse_button(risc, (int)e->a, e->b != 0); break;
+    case 'K': risc_keyboard_input(risc, r->bytes + e->a, e->b); break;
+    case 'R': risc_reset(risc); break;
+  }
+  r->applying = false;
+}
+
+int risc_replay_slice(struct RISC *risc, int cycles) {
+  struct RISC_Replay *r = risc->replay;
+  if (r->log) {
+    return cycles;
+  }
+  uint64_t now = retired(risc);
+  while (r->state == RISC_REPLAY_RUNNING && r->next < r->event_cnt &&
+         r->events[r->next].at <= now) {
+    const struct Event *e = &r->events[r->next];
+    if (e->at < now || e->kind == 'r') {
+      diverged(risc, "the guest didn't read an IO register the log has");
+    } else if (e->kind == 'E') {
+      r->state = RISC_REPLAY_DONE;
+    } else {
+      apply(risc, e);
+      r->next++;
+    }
+  }
+  if (r->state == RISC_REPLAY_RUNNING && r->next == r->event_cnt) {
+    r->state = RISC_REPLAY_DONE;  // the recording was cut short
+  }
+  if (r->state != RISC_REPLAY_RUNNING) {
+    return 0;
+  }
+  uint64_t until = r->events[r->next].at - now;
+  return until < (uint64_t)cycles ? (int)until : cycles;
+}
+
+enum RISC_ReplayState risc_replay_state(struct RISC *risc) {
+  if (risc->replay == NULL || risc->replay->log) {
+    return RISC_REPLAY_OFF;
+  }
+  return risc->replay->state;
+}
+
+static bool end_recording(struct RISC *risc) {
+  struct RISC_Replay *r = risc->replay;
+  if (r == NULL || r->log == NULL) {
+    stop_replay(risc);
+    return true;
+  }
+  fprintf(r->log, "%llu E\n", (unsigned long long)retired(risc));
+  bool ok = !ferror(r->log);
+  ok = fclose(r->log) == 0 && ok;
+  stop_replay(risc);
+  return ok;
+}
+
+bool risc_record(struct RISC *risc, const char *filename) {
+  if (!end_recording(risc)) {
+    return false;
+  }
+  if (filename == NULL) {
+    return true;
+  }
+  struct RISC_Replay *r = calloc(1, sizeof(*r));
+  if (r == NULL) {
+    return false;
+  }
+  r->log = fopen(filename, "w");
+  if (r->log == NULL) {
+    free(r);
+    return false;
+  }
+  r->start = risc->stats.instructions;
+  fprintf(r->log, "%s %d %u %u\n", LogMagic, LogVersion, risc->current_tick, risc->mouse);
+  risc->replay = r;
+  return true;
+}
+
+static bool add_event(struct RISC_Replay *r, const struct Event *e, size_t *capacity) {
+  if (r->event_cnt == *capacity) {
+    size_t n = *capacity ? *capacity * 2 : 1024;
+    struct Event *events = realloc(r->events, n * sizeof(*events));
+    if (events == NULL) {
+      return false;
+    }
+    r->events = events;
+    *capacity = n;
+  }
+  r->events[r->event_cnt++] = *e;
+  return true;
+}
+
+static bool add_byte(struct RISC_Replay *r, uint8_t b, size_t *capacity) {
+  if (r->byte_cnt == *capacity) {
+    size_t n = *capacity ? *capacity * 2 : 1024;
+    uint8_t *bytes = realloc(r->bytes, n);
+    if (bytes == NULL) {
+      return false;
+    }
+    r->bytes = bytes;
+    *capacity = n;
+  }
+  r->bytes[r->byte_cnt++] = b;
+  return true;
+}
+
+// Sets errno to EINVAL if the log doesn't make sense, malloc and stdio
+// set it otherwise.
+static bool read_log(struct RISC_Replay *r, FILE *f, uint32_t *tick, uint32_t *mouse) {
+  char magic[16];
+  int version;
+  if (fscanf(f, "%15s %d %u %u", magic, &version, tick, mouse) != 4 ||
+      strcmp(magic, LogMagic) != 0 || version != LogVersion) {
+    errno = EINVAL;
+    return false;
+  }
+  size_t event_cap = 0, byte_cap = 0;
+  unsigned long long at;
+  char kind;
+  while (fscanf(f, "%llu %c", &at, &kind) == 2) {
+    struct Event e = { .at = at, .kind = kind };
+    bool ok = r->event_cnt == 0 || at >= r->events[r->event_cnt - 1].at;
+    int a, b;
+    unsigned byte;
+    switch (kind) {
+      case 'T': ok = ok && fscanf(f, "%u", &e.a) == 1; break;
+      case 'M': ok = ok && fscanf(f, "%d %d", &a, &b) == 2; e.a = (uint32_t)a; e.b = (uint32_t)b; break;
+      case 'B': case 'r': ok = ok && fscanf(f, "%u %u", &e.a, &e.b) == 2; break;
+      case 'K': {
+        ok = ok && fscanf(f, "%u", &e.b) == 1;
+        e.a = (uint32_t)r->byte_cnt;
+        for (uint32_t i = 0; ok && i < e.b; i++) {
+          ok = fscanf(f, "%x", &byte) == 1 && byte < 256;
+          if (ok && !add_byte(r, (uint8_t)byte, &byte_cap)) {
+            return false;
+          }
+        }
+        break;
+      }
+      case 'I': case 'R': case 'E': break;
+      default: ok = false;
+    }
+    if (!ok) {
+      errno = EINVAL;
+      return false;
+    }
+    if (!add_event(r, &e, &event_cap)) {
+      return false;
+    }
+  }
+  if (ferror(f)) {
+    return false;
+  }
+  if (!feof(f)) {
+    errno = EINVAL;
+    return false;
+  }
+  return true;
+}
+
+bool risc_replay(struct RISC *risc, const char *filename) {
+  if (!end_recording(risc)) {
+    return false;
+  }
+  if (filename == NULL) {
+    return true;
+  }
+  struct RISC_Replay *r = calloc(1, sizeof(*r));
+  if (r == NULL) {
+    return false;
+  }
+  FILE *f = fopen(filename, "r");
+  if (f == NULL) {
+    free(r);
+    return false;
+  }
+  uint32_t tick, mouse;
+  bool ok = read_log(r, f, &tick, &mouse);
+  fclose(f);
+  risc->replay = r;
+  if (!ok) {
+    int saved = errno;
+    stop_replay(risc);
+    errno = saved;
+    return false;
+  }
+  r->start = risc->stats.instructions;
+  r->state = RISC_REPLAY_RUNNING;
+  risc->current_tick = tick;
+  risc->mouse = mouse;
+  return true;
+}
@@ -1,85 +1,59 @@
+#define _DEFAULT_SOURCE  // MAP_ANONYMOUS
+
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 #include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#define RISC_MMAP 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#endif
 #include "risc.h"
+#include "risc-cpu.h"
 #include "risc-fp.h"
 
+// Byte stores go straight to RAM if its words are in host order.
+#if defined(_WIN32) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define RISC_LITTLE_ENDIAN 1
+#endif
 
-// Our memory layout is slightly different from the FPGA implementation:
-// The FPGA uses a 20-bit address bus and thus ignores the top 12 bits,
-// while we use all 32 bits. This allows us to have more than 1 megabyte
-// of RAM and/or a 16 color framebuffer.
-//
-// In the default configuration, the emulator is compatible with the
-// FPGA system. But If the user requests more memory, we move the
-// framebuffer to make room for a larger Oberon heap. This requires a
-// custom Display.Mod.
-
-
-#define DefaultMemSize      0x00100000
-#define DefaultDisplayStart 0x000E7F00
-
-#define ROMStart     0xFFFFF800
-#define ROMWords     512
-#define IOStart      0xFFFFFFC0
-#define PaletteStart 0xFFFFFF80
-
-
-struct RISC {
-  uint32_t PC;
-  uint32_t R[16];
-  uint32_t H;
-  uint32_t SPC;                 // SPC: Saved PC
-  bool     SZ, SN, SC, SV;      //    : Saved Condition Codes
-  bool     Z, N, C, V, I, E, P; //   I: Interrupt mode
-                                //   E: Interrupts enabled
-                                //   P: Interrupt pending
-
-  uint32_t mem_size;
-  uint32_t display_start;
-
-  uint32_t progress;
-  uint32_t current_tick;
-  uint32_t mouse;
-  uint8_t  key_buf[16];
-  uint32_t key_cnt;
-  uint32_t switches;
-
-  const struct RISC_LED *leds;
-  const struct RISC_Serial *serial;
-  uint32_t spi_selected;
-  const struct RISC_SPI *spi[4];
-  const struct RISC_Clipboard *clipboard;
-  const struct RISC_HostFS *hostfs;
-
-  bool fb_color;
-  int fb_width;   // words
-  int fb_height;  // lines
-  struct Damage damage;
-
-  uint32_t *RAM;
-  uint32_t ROM[ROMWords];
-  uint32_t Palette[16];
-};
-
-enum {
-  MOV, LSL, ASR, ROR,
-  AND, ANN, IOR, XOR,
-  ADD, SUB, MUL, DIV,
-  FAD, FSB, FML, FDV,
-};
-
-static void risc_single_step(struct RISC *risc);
 static void risc_set_register(struct RISC *risc, int reg, uint32_t value);
-static uint32_t risc_load_word(struct RISC *risc, uint32_t address);
-static uint8_t risc_load_byte(struct RISC *risc, uint32_t address);
-static void risc_store_word(struct RISC *risc, uint32_t address, uint32_t value);
-static void risc_store_byte(struct RISC *risc, uint32_t address, uint8_t value);
+static uint32_t risc_add(struct RISC *risc, uint32_t b_val, uint32_t c_val, uint32_t carry);
+static uint32_t risc_sub(struct RISC *risc, uint32_t b_val, uint32_t c_val, uint32_t carry);
+static uint32_t risc_mul(struct RISC *risc, uint32_t b_val, uint32_t c_val, bool u);
 static uint32_t risc_load_io(struct RISC *risc, uint32_t address);
+static uint32_t risc_host_read(struct RISC *risc, uint32_t reg);
 static void risc_store_io(struct RISC *risc, uint32_t address, uint32_t value);
+static void risc_hostfs_invalidate(struct RISC *risc, uint32_t address);
+static void risc_block_dma(struct RISC *risc, uint32_t address);
+static void risc_init_damage(struct RISC *risc);
+static void risc_damage_all(struct RISC *risc);
+static void risc_unmap_memory(struct RISC *risc);
+static int risc_interpret_fpga(struct RISC *risc, int cycles);
+static int risc_interpret_any(struct RISC *risc, int cycles);
+
+// risc_keyboard_input may be called from another thread than the one
+// running the guest.
+#if defined(__GNUC__)
+#define KEY_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define KEY_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else
+#define KEY_LOAD(p) (*(volatile uint32_t *)(p))
+#define KEY_STORE(p, v) (*(volatile uint32_t *)(p) = (v))
+#endif
 
 static const uint32_t bootloader[ROMWords] = {
 #include "risc-boot.inc"
@@ -91,20 +65,86 @@ static const uint32_t default_palette[16] = {
 };
 
 
+// Guest memory comes straight from the OS as zero pages, which only
+// take up host memory once the guest touches them. An idle guest
+// with a large heap costs little more than a small one.
+void *risc_alloc_pages(size_t size) {
+#if defined(_WIN32)
+  return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#elif defined(RISC_MMAP)
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+#else
+  return calloc(1, size);
+#endif
+}
+
+void risc_free_pages(void *p, size_t size) {
+  if (p == NULL) {
+    return;
+  }
+#if defined(_WIN32)
+  VirtualFree(p, 0, MEM_RELEASE);
+#elif defined(RISC_MMAP)
+  munmap(p, size);
+#else
+  free(p);
+#endif
+}
+
+// Drops the contents of memory from risc_alloc_pages. It reads as
+// zero again and takes up no host memory until it is touched.
+void risc_clear_pages(void *p, size_t size) {
+  if (p == NULL) {
+    return;
+  }
+#if defined(_WIN32)
+  VirtualFree(p, size, MEM_DECOMMIT);
+  if (VirtualAlloc(p, size, MEM_COMMIT, PAGE_READWRITE) == NULL) {
+    fprintf(stderr, "Can't recommit guest memory\n");
+    exit(1);
+  }
+#elif defined(RISC_MMAP)
+  if (mmap(p, size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+    memset(p, 0, size);
+  }
+#else
+  memset(p, 0, size);
+#endif
+}
+
+// RAM is mapped when it is first needed, so that the default layout
+// isn't set up in vain when the front end configures its own.
+void risc_map_memory(struct RISC *risc) {
+  if (risc->RAM != NULL) {
+    return;
+  }
+  risc->RAM = risc_alloc_pages(risc->mem_size);
+  risc->RAM_decoded = risc_alloc_pages(risc->mem_size / 4 * sizeof(struct Decoded));
+  if (risc->RAM == NULL || risc->RAM_decoded == NULL) {
+    fprintf(stderr, "Can't allocate %u bytes of guest memory\n", risc->mem_size);
+    exit(1);
+  }
+}
+
+static void risc_unmap_memory(struct RISC *risc) {
+  risc_free_pages(risc->RAM, risc->mem_size);
+  risc_free_pages(risc->RAM_decoded, risc->mem_size / 4 * sizeof(struct Decoded));
+  risc->RAM = NULL;
+  risc->RAM_decoded = NULL;
+}
+
 struct RISC *risc_new() {
   struct RISC *risc = calloc(1, sizeof(*risc));
   risc->mem_size = DefaultMemSize;
   risc->display_start = DefaultDisplayStart;
   risc->fb_width = RISC_FRAMEBUFFER_WIDTH / 32;
   risc->fb_height = RISC_FRAMEBUFFER_HEIGHT;
-  risc->damage = (struct Damage){
-    .x1 = 0,
-    .y1 = 0,
-    .x2 = risc->fb_width - 1,
-    .y2 = risc->fb_height - 1
-  };
-  risc->RAM = calloc(1, risc->mem_size);
+  risc->interpret = risc_interpret_fpga;
+  risc_init_damage(risc);
   memcpy(risc->ROM, bootloader, sizeof(risc->ROM));
+  risc_set_flags(risc, false, false, false, false);
   risc_reset(risc);
   return risc;
 }
@@ -113,10 +153,14 @@ void risc_configure_memory(struct RISC *risc, int megabytes_ram, bool rtc_option
   if (megabytes_ram < 1) {
     megabytes_ram = 1;
   }
-  if (megabytes_ram > 32) {
-    megabytes_ram = 32;
+  if (megabytes_ram > RISC_MAX_MEGABYTES) {
+    megabytes_ram = RISC_MAX_MEGABYTES;
   }
 
+  bool jit = risc->jit != NULL;
+  risc_jit_free(risc);
+  risc_unmap_memory(risc);
+
   risc->display_start = megabytes_ram << 20;
   risc->mem_size = risc->display_start + (screen_width * screen_height) / 8;
   risc->fb_color = screen_color;
@@ -127,15 +171,9 @@ void risc_configure_memory(struct RISC *risc, int megabytes_ram, bool rtc_option
     risc->mem_size = risc->display_start + (screen_width * screen_height) / 2;
     memcpy(risc->Palette, default_palette, sizeof(risc->Palette));
   }
-  risc->damage = (struct Damage){
-    .x1 = 0,
-    .y1 = 0,
-    .x2 = risc->fb_width - 1,
-    .y2 = risc->fb_height - 1
-  };
-
-  free(risc->RAM);
-  risc->RAM = calloc(1, risc->mem_size);
+  risc->interpret = risc_interpret_any;
+  risc_init_damage(risc);
+  risc_map_memory(risc);
 
   // Patch the new constants in the bootloader.
   uint32_t mem_lim = risc->display_start - 16;
@@ -143,6 +181,10 @@ void risc_configure_memory(struct RISC *risc, int megabytes_ram, bool rtc_option
   risc->ROM[373] = 0x41160000 + (mem_lim & 0x0000FFFF);
   uint32_t stack_org = risc->display_start / 2;
   risc->ROM[376] = 0x61000000 + (stack_org >> 16);
+  memset(risc->ROM_decoded, 0, sizeof(risc->ROM_decoded));
+  if (jit) {
+    risc->jit = risc_jit_new(risc);
+  }
 
   // patch the time for RTC option
   if (rtc_option) {
@@ -193,263 +235,366 @@ void risc_set_host_fs(struct RISC *risc, const struct RISC_HostFS *hostfs) {
   risc->hostfs = hostfs;
 }
 
+bool risc_set_jit(struct RISC *risc, bool enable) {
+  if (enable && !risc->jit) {
+    risc->jit = risc_jit_new(risc);
+  } else if (!enable && risc->jit) {
+    risc_jit_flush(risc);
+    risc_jit_free(risc);
+  }
+  return risc->jit != NULL;
+}
+
 void risc_reset(struct RISC *risc) {
+  if (risc->replay && !risc_replay_input(risc, 'R', 0, 0)) {
+    return;
+  }
+  const struct RISC_SPI *disk = risc->spi[1];
+  if (disk != NULL && disk->sync != NULL) {
+    disk->sync(disk);
+  }
   risc->PC = ROMStart/4;
 }
 
 void risc_trigger_interrupt(struct RISC *risc) {
-  risc->P = true;
-}
-
-void risc_run(struct RISC *risc, int cycles) {
-  risc->progress = 20;
-  // The progress value is used to detect that the RISC cpu is busy
-  // waiting on the millisecond counter or on the keyboard ready
-  // bit. In that case it's better to just pause emulation until the
-  // next frame.
-  for (int i = 0; i < cycles && risc->progress; i++) {
-    risc_single_step(risc);
-  }
-}
-
-static void risc_single_step(struct RISC *risc) {
-  uint32_t ir;
-  if (risc->P && risc->E && ! risc->I ) {
-    risc->SPC = risc->PC;
-    risc->SZ = risc->Z;
-    risc->SN = risc->N;
-    risc->SC = risc->C;
-    risc->SV = risc->V;
-    risc->I = true;
-    risc->PC = 1;
-  }
-  if (risc->PC < risc->mem_size / 4) {
-    ir = risc->RAM[risc->PC];
-  } else if (risc->PC >= ROMStart/4 && risc->PC < ROMStart/4 + ROMWords) {
-    ir = risc->ROM[risc->PC - ROMStart/4];
-  } else {
-    fprintf(stderr, "Branched into the void (PC=0x%08X), resetting...\n", risc->PC);
-    risc_reset(risc);
+  if (risc->replay && !risc_replay_input(risc, 'I', 0, 0)) {
     return;
   }
-  risc->PC++;
+  risc->P = true;
+}
 
+void risc_decode(uint32_t ir, struct Decoded *d) {
   const uint32_t pbit = 0x80000000;
   const uint32_t qbit = 0x40000000;
   const uint32_t ubit = 0x20000000;
   const uint32_t vbit = 0x10000000;
 
+  d->a = (ir & 0x0F000000) >> 24;
+  d->b = (ir & 0x00F00000) >> 20;
+  d->c =  ir & 0x0000000F;
+  int kind;
+
   if ((ir & pbit) == 0) {
     // Register instructions
-    uint32_t a  = (ir & 0x0F000000) >> 24;
-    uint32_t b  = (ir & 0x00F00000) >> 20;
+    // The immediate forms directly follow the register forms in the
+    // enum, so adding imm selects the right handler.
     uint32_t op = (ir & 0x000F0000) >> 16;
     uint32_t im =  ir & 0x0000FFFF;
-    uint32_t c  =  ir & 0x0000000F;
-
-    uint32_t a_val, b_val, c_val;
-    b_val = risc->R[b];
-    if ((ir & qbit) == 0) {
-      c_val = risc->R[c];
-    } else if ((ir & vbit) == 0) {
-      c_val = im;
+    int imm = (ir & qbit) != 0;
+    bool u = (ir & ubit) != 0;
+    if ((ir & vbit) == 0) {
+      d->imm = im;
     } else {
-      c_val = 0xFFFF0000 | im;
+      d->imm = 0xFFFF0000 | im;
     }
 
     switch (op) {
       case MOV: {
-        if ((ir & ubit) == 0) {
-          a_val = c_val;
-        } else if ((ir & qbit) != 0) {
-          a_val = c_val << 16;
+        if (!u) {
+          kind = I_MOV + imm;
+        } else if (imm) {
+          kind = I_MOVI;
+          d->imm <<= 16;
         } else if ((ir & vbit) != 0) {
-          a_val = 0xD0 |   // ???
-            (risc->N * 0x80000000U) |
-            (risc->Z * 0x40000000U) |
-            (risc->C * 0x20000000U) |
-            (risc->V * 0x10000000U);
-        } else {
-          a_val = risc->H;
-        }
-        break;
-      }
-      case LSL: {
-        a_val = b_val << (c_val & 31);
-        break;
-      }
-      case ASR: {
-        a_val = ((int32_t)b_val) >> (c_val & 31);
-        break;
-      }
-      case ROR: {
-        a_val = (b_val >> (c_val & 31)) | (b_val << (-c_val & 31));
-        break;
-      }
-      case AND: {
-        a_val = b_val & c_val;
-        break;
-      }
-      case ANN: {
-        a_val = b_val & ~c_val;
-        break;
-      }
-      case IOR: {
-        a_val = b_val | c_val;
-        break;
-      }
-      case XOR: {
-        a_val = b_val ^ c_val;
-        break;
-      }
-      case ADD: {
-        a_val = b_val + c_val;
-        if ((ir & ubit) != 0) {
-          a_val += risc->C;
-        }
-        risc->C = a_val < b_val;
-        risc->V = ((a_val ^ c_val) & (a_val ^ b_val)) >> 31;
-        break;
-      }
-      case SUB: {
-        a_val = b_val - c_val;
-        if ((ir & ubit) != 0) {
-          a_val -= risc->C;
-        }
-        risc->C = a_val > b_val;
-        risc->V = ((b_val ^ c_val) & (a_val ^ b_val)) >> 31;
-        break;
-      }
-      case MUL: {
-        uint64_t tmp;
-        if ((ir & ubit) == 0) {
-          tmp = (int64_t)(int32_t)b_val * (int64_t)(int32_t)c_val;
+          kind = I_MOVF;
         } else {
-          tmp = (uint64_t)b_val * (uint64_t)c_val;
+          kind = I_MOVH;
         }
-        a_val = (uint32_t)tmp;
-        risc->H = (uint32_t)(tmp >> 32);
-        break;
-      }
-      case DIV: {
-        if ((int32_t)c_val > 0) {
-          if ((ir & ubit) == 0) {
-            a_val = (int32_t)b_val / (int32_t)c_val;
-            risc->H = (int32_t)b_val % (int32_t)c_val;
-            if ((int32_t)risc->H < 0) {
-              a_val--;
-              risc->H += c_val;
-            }
-          } else {
-            a_val = b_val / c_val;
-            risc->H = b_val % c_val;
-          }
-        } else {
-          struct idiv q = idiv(b_val, c_val, ir & ubit);
-          a_val = q.quot;
-          risc->H = q.rem;
-        }
-        break;
-      }
-      case FAD: {
-        a_val = fp_add(b_val, c_val, ir & ubit, ir & vbit);
-        break;
-      }
-      case FSB: {
-        a_val = fp_add(b_val, c_val ^ 0x80000000, ir & ubit, ir & vbit);
-        break;
-      }
-      case FML: {
-        a_val = fp_mul(b_val, c_val);
-        break;
-      }
-      case FDV: {
-        a_val = fp_div(b_val, c_val);
         break;
       }
+      case LSL: kind = I_LSL + imm; break;
+      case ASR: kind = I_ASR + imm; break;
+      case ROR: kind = I_ROR + imm; break;
+      case AND: kind = I_AND + imm; break;
+      case ANN: kind = I_ANN + imm; break;
+      case IOR: kind = I_IOR + imm; break;
+      case XOR: kind = I_XOR + imm; break;
+      case ADD: kind = (u ? I_ADC : I_ADD) + imm; break;
+      case SUB: kind = (u ? I_SBC : I_SUB) + imm; break;
+      case MUL: kind = (u ? I_MULU : I_MUL) + imm; break;
+      case DIV: kind = (u ? I_DIVU : I_DIV) + imm; break;
       default: {
-        abort();  // unreachable
+        // Floating point is slow anyway, keep the raw instruction.
+        kind = I_FPU;
+        d->imm = ir;
+        break;
       }
     }
-    risc_set_register(risc, a, a_val);
   }
   else if ((ir & qbit) == 0) {
     // Memory instructions
-    uint32_t a = (ir & 0x0F000000) >> 24;
-    uint32_t b = (ir & 0x00F00000) >> 20;
     int32_t off = ir & 0x000FFFFF;
     off = (off ^ 0x00080000) - 0x00080000;  // sign-extend
-
-    uint32_t address = risc->R[b] + off;
-    if ((ir & ubit) == 0) {
-      uint32_t a_val;
-      if ((ir & vbit) == 0) {
-        a_val = risc_load_word(risc, address);
-      } else {
-        a_val = risc_load_byte(risc, address);
-      }
-      risc_set_register(risc, a, a_val);
-    } else {
-      if ((ir & vbit) == 0) {
-        risc_store_word(risc, address, risc->R[a]);
-      } else {
-        risc_store_byte(risc, address, (uint8_t)risc->R[a]);
-      }
-    }
+    d->imm = (uint32_t)off;
+    kind = (ir & ubit) == 0
+      ? ((ir & vbit) == 0 ? I_LDW : I_LDB)
+      : ((ir & vbit) == 0 ? I_STW : I_STB);
   }
   else {
     // Branch instructions
-    bool t = (ir >> 27) & 1;
-    switch ((ir >> 24) & 7) {
-      case 0: t ^= risc->N; break;
-      case 1: t ^= risc->Z; break;
-      case 2: t ^= risc->C; break;
-      case 3: t ^= risc->V; break;
-      case 4: t ^= risc->C | risc->Z; break;
-      case 5: t ^= risc->N ^ risc->V; break;
-      case 6: t ^= (risc->N ^ risc->V) | risc->Z; break;
-      case 7: t ^= true; 
-              if (((ir & ubit) == 0) && ((ir & 0x00000010) == 0x10) && risc->I) { // IRET
-                 risc->PC = risc->SPC;
-                 risc->Z = risc->SZ;
-                 risc->N = risc->SN;
-                 risc->C = risc->SC;
-                 risc->V = risc->SV;
-                 risc->I = false;
-                 risc->P = false;
-                 return;
-              }else{
-                if (((ir & ubit) == 0) && ((ir & 0x00000020) == 0x20)) { // STI and CLI
-                   risc->E = (ir & 1) == 1 ? true: false;
-                   return;
-                }
-              }
-              break;
-      default: abort();  // unreachable
-    }
-    if (t) {
-      if ((ir & vbit) != 0) {
-        risc_set_register(risc, 15, risc->PC * 4);
+    int32_t off = ir & 0x00FFFFFF;
+    off = (off ^ 0x00800000) - 0x00800000;  // sign-extend
+    d->imm = (uint32_t)off;
+    d->b = (ir >> 24) & 15;
+    bool link = (ir & vbit) != 0;
+    int imm = (ir & ubit) != 0;
+    if (d->b == 7) {
+      kind = (link ? I_CALL : I_JMP) + imm;
+    } else if (d->b == 15) {
+      kind = I_NOP;
+    } else {
+      kind = (link ? I_BL : I_BR) + imm;
+    }
+    if ((d->b & 7) == 7 && !imm) {
+      int fallback = kind;
+      if ((ir & 0x00000020) == 0x20) { // STI and CLI
+        kind = fallback = I_STICLI;
       }
-      if ((ir & ubit) == 0) {
-        uint32_t c = ir & 0x0000000F;
-        risc->PC = risc->R[c] / 4;
-      } else {
-        int32_t off = ir & 0x00FFFFFF;
-        off = (off ^ 0x00800000) - 0x00800000;  // sign-extend
-        risc->PC = risc->PC + off;
+      if ((ir & 0x00000010) == 0x10) { // IRET, only in interrupt mode
+        kind = I_IRET;
+        d->a = (uint8_t)fallback;
       }
     }
   }
+  d->op = (uint8_t)kind;
+}
+
+// w is the word offset in the framebuffer. The row is a shift away
+// for the usual power of two widths, otherwise it is found by
+// multiplying with a reciprocal, which is exact for framebuffers of
+// this size.
+static inline void risc_update_damage(struct RISC *risc, uint32_t w) {
+  uint32_t row = risc->damage_row_shift >= 0
+    ? w >> risc->damage_row_shift
+    : (uint32_t)((w * risc->damage_recip) >> 32);
+  if (row < (uint32_t)risc->fb_height) {
+    uint32_t col = w - row * (uint32_t)risc->fb_width;
+    risc->damage_rows[row] |= (uint64_t)1 << (col >> risc->damage_shift);
+  }
+  risc->stats.damaged_words++;
+}
+
+static inline void risc_invalidate_word(struct RISC *risc, uint32_t w) {
+  if (risc->jit_covered && (risc->jit_covered[w] & JIT_COVERED)) {
+    risc_jit_invalidate(risc, w);
+  }
+  risc->RAM_decoded[w].op = I_DECODE;
+}
+
+static inline void risc_poke_byte(struct RISC *risc, uint32_t address, uint8_t value) {
+#ifdef RISC_LITTLE_ENDIAN
+  ((uint8_t *)risc->RAM)[address] = value;
+#else
+  uint32_t shift = (address & 3) * 8;
+  risc->RAM[address/4] = (risc->RAM[address/4] & ~(0xFFu << shift)) | (uint32_t)value << shift;
+#endif
+}
+
+static inline bool risc_condition(struct RISC *risc, uint32_t cond) {
+  bool t = (cond >> 3) & 1;
+  switch (cond & 7) {
+    case 0: t ^= risc_flag_n(risc); break;
+    case 1: t ^= risc_flag_z(risc); break;
+    case 2: t ^= risc_flag_c(risc); break;
+    case 3: t ^= risc_flag_v(risc); break;
+    case 4: t ^= risc_flag_c(risc) | risc_flag_z(risc); break;
+    case 5: t ^= risc_flag_n(risc) ^ risc_flag_v(risc); break;
+    case 6: t ^= (risc_flag_n(risc) ^ risc_flag_v(risc)) | risc_flag_z(risc); break;
+    default: t ^= true; break;
+  }
+  return t;
+}
+
+bool risc_interrupt_ready(struct RISC *risc) {
+  return risc->P && risc->E && !risc->I;
+}
+
+uint32_t risc_enter_interrupt(struct RISC *risc, uint32_t pc) {
+  risc->SPC = pc;
+  risc->SZ = risc_flag_z(risc);
+  risc->SN = risc_flag_n(risc);
+  risc->SC = risc_flag_c(risc);
+  risc->SV = risc_flag_v(risc);
+  risc->I = true;
+  return 1;
+}
+
+// With GCC and clang, every handler fetches the next instruction and
+// jumps straight to its handler through a table of label addresses.
+// Other compilers get a switch.
+#if defined(__GNUC__)
+#define RISC_DECODED_LABEL(name) &&L_##name,
+#define DISPATCH(op) goto *dispatch_table[op];
+#define HANDLER(name) L_##name:
+#define NEXT if (--cycles > 0) { FETCH DISPATCH(op) } goto done
+#else
+#define DISPATCH(op) switch (op)
+#define HANDLER(name) case I_##name:
+#define NEXT continue
+#endif
+
+#define FETCH                                                   \
+  if (pc < mem_words) {                                         \
+    d = &risc->RAM_decoded[pc];                                 \
+  } else if (pc - ROMStart/4 < ROMWords) {                      \
+    d = &risc->ROM_decoded[pc - ROMStart/4];                    \
+  } else {                                                      \
+    d = &void_decoded;                                          \
+  }                                                             \
+  pc++;                                                         \
+  op = d->op;
+
+bool risc_run(struct RISC *risc, int cycles) {
+  risc_map_memory(risc);
+  risc->progress = IdlePolls;
+  // The progress value is used to detect that the RISC cpu is busy
+  // waiting on the millisecond counter or on the keyboard ready
+  // bit. In that case it's better to just pause emulation until the
+  // next frame. Any other I/O means the guest is doing something and
+  // starts the count again.
+  int left = cycles;
+  while (left > 0) {
+    // A replay stops the CPU at the next recorded input, the profiler
+    // whenever a sample is due.
+    int slice = risc->replay ? risc_replay_slice(risc, left) : left;
+    if (slice == 0) {
+      break;
+    }
+    if (risc->profile) {
+      slice = risc_profile_slice(risc, slice);
+    }
+    int rest = risc->jit ? risc_jit_run(risc, slice) : risc_interpret(risc, slice);
+    if (risc->profile) {
+      risc_profile_count(risc, slice - rest);
+    }
+    left -= slice - rest;
+    risc->stats.instructions += (uint64_t)(slice - rest);
+    // Reads from the host also end the slice while recording or
+    // replaying, which is no reason to stop.
+    bool settled = risc->replay && risc_replay_settle(risc);
+    if (rest > 0 && !settled) {
+      break;
+    }
+  }
+  risc->stats.runs++;
+  risc->stats.idle_runs += left > 0;
+  if (risc->serial && risc->serial->poll) {
+    risc->serial->poll(risc->serial);
+  }
+  return risc->progress != 0;
+}
+
+// The usual layout of the FPGA board gets an interpreter of its own,
+// other configurations share one that reads the layout at run time.
+// Its framebuffer rows are 32 words, with a damage bit each.
+static inline void risc_update_damage_fpga(struct RISC *risc, uint32_t w) {
+  if (w / 32 < RISC_FRAMEBUFFER_HEIGHT) {
+    risc->damage_rows[w / 32] |= (uint64_t)1 << (w % 32);
+  }
+  risc->stats.damaged_words++;
+}
+
+#define RISC_INTERPRET risc_interpret_fpga
+#define RISC_MEM_SIZE DefaultMemSize
+#define RISC_DISPLAY_START DefaultDisplayStart
+#define RISC_UPDATE_DAMAGE risc_update_damage_fpga
+#include "risc-interpret.inc"
+
+#define RISC_INTERPRET risc_interpret_any
+#define RISC_MEM_SIZE risc->mem_size
+#define RISC_DISPLAY_START risc->display_start
+#define RISC_UPDATE_DAMAGE risc_update_damage
+#include "risc-interpret.inc"
+
+int risc_interpret(struct RISC *risc, int cycles) {
+  return risc->interpret(risc, cycles);
+}
+
+#undef FETCH
+#undef NEXT
+#undef DISPATCH
+#undef HANDLER
+
+// C and V are only computed when needed, see risc_flag_c().
+static uint32_t risc_add(struct RISC *risc, uint32_t b_val, uint32_t c_val, uint32_t carry) {
+  risc->flag_b = b_val;
+  risc->flag_c = c_val;
+  risc->flag_op = (uint8_t)(FLAGS_ADD + carry);
+  return b_val + c_val + carry;
+}
+
+static uint32_t risc_sub(struct RISC *risc, uint32_t b_val, uint32_t c_val, uint32_t carry) {
+  risc->flag_b = b_val;
+  risc->flag_c = c_val;
+  risc->flag_op = (uint8_t)(FLAGS_SUB + carry);
+  return b_val - c_val - carry;
+}
+
+static uint32_t risc_mul(struct RISC *risc, uint32_t b_val, uint32_t c_val, bool u) {
+  uint64_t tmp;
+  if (!u) {
+    tmp = (int64_t)(int32_t)b_val * (int64_t)(int32_t)c_val;
+  } else {
+    tmp = (uint64_t)b_val * (uint64_t)c_val;
+  }
+  risc->H = (uint32_t)(tmp >> 32);
+  return (uint32_t)tmp;
+}
+
+uint32_t risc_div(struct RISC *risc, uint32_t b_val, uint32_t c_val, bool u) {
+  uint32_t a_val;
+  if ((int32_t)c_val > 0) {
+    if (!u) {
+      a_val = (int32_t)b_val / (int32_t)c_val;
+      risc->H = (int32_t)b_val % (int32_t)c_val;
+      if ((int32_t)risc->H < 0) {
+        a_val--;
+        risc->H += c_val;
+      }
+    } else {
+      a_val = b_val / c_val;
+      risc->H = b_val % c_val;
+    }
+  } else {
+    struct idiv q = idiv(b_val, c_val, u);
+    a_val = q.quot;
+    risc->H = q.rem;
+  }
+  return a_val;
+}
+
+uint32_t risc_fpu(uint32_t ir, uint32_t b_val, uint32_t c_val) {
+  const uint32_t qbit = 0x40000000;
+  const uint32_t ubit = 0x20000000;
+  const uint32_t vbit = 0x10000000;
+  if ((ir & qbit) != 0) {
+    c_val = ir & 0x0000FFFF;
+    if ((ir & vbit) != 0) {
+      c_val |= 0xFFFF0000;
+    }
+  }
+  switch ((ir & 0x000F0000) >> 16) {
+    case FAD: return fp_add(b_val, c_val, ir & ubit, ir & vbit);
+    case FSB: return fp_add(b_val, c_val ^ 0x80000000, ir & ubit, ir & vbit);
+    case FML: return fp_mul(b_val, c_val);
+    default:  return fp_div(b_val, c_val);
+  }
 }
 
 static void risc_set_register(struct RISC *risc, int reg, uint32_t value) {
   risc->R[reg] = value;
-  risc->Z = value == 0;
-  risc->N = (int32_t)value < 0;
+  risc->flag_res = value;
+}
+
+void risc_set_flags(struct RISC *risc, bool z, bool n, bool c, bool v) {
+  // Z and N are never both set by an instruction.
+  risc->flag_res = z ? 0 : n ? 0x80000000 : 1;
+  risc->C = c;
+  risc->V = v;
+  risc->flag_op = FLAGS_CV;
 }
 
-static uint32_t risc_load_word(struct RISC *risc, uint32_t address) {
+uint32_t risc_load_word(struct RISC *risc, uint32_t address) {
   if (address < risc->mem_size) {
     return risc->RAM[address/4];
   } else {
@@ -457,57 +602,100 @@ static uint32_t risc_load_word(struct RISC *risc, uint32_t address) {
   }
 }
 
-static uint8_t risc_load_byte(struct RISC *risc, uint32_t address) {
+uint8_t risc_load_byte(struct RISC *risc, uint32_t address) {
   uint32_t w = risc_load_word(risc, address);
   return (uint8_t)(w >> (address % 4 * 8));
 }
 
-static void risc_update_damage(struct RISC *risc, int w) {
-  int row = w / risc->fb_width;
-  int col = w % risc->fb_width;
-  if (row < risc->fb_height) {
-    if (col < risc->damage.x1) {
-      risc->damage.x1 = col;
-    }
-    if (col > risc->damage.x2) {
-      risc->damage.x2 = col;
-    }
-    if (row < risc->damage.y1) {
-      risc->damage.y1 = row;
-    }
-    if (row > risc->damage.y2) {
-      risc->damage.y2 = row;
-    }
-  }
-}
-
-static void risc_store_word(struct RISC *risc, uint32_t address, uint32_t value) {
+void risc_store_word(struct RISC *risc, uint32_t address, uint32_t value) {
   if (address < risc->display_start) {
     risc->RAM[address/4] = value;
+    risc_invalidate_word(risc, address/4);
   } else if (address < risc->mem_size) {
     risc->RAM[address/4] = value;
+    risc_invalidate_word(risc, address/4);
     risc_update_damage(risc, address/4 - risc->display_start/4);
   } else {
     risc_store_io(risc, address, value);
   }
 }
 
-static void risc_store_byte(struct RISC *risc, uint32_t address, uint8_t value) {
-  if (address < risc->mem_size) {
-    uint32_t w = risc_load_word(risc, address);
-    uint32_t shift = (address & 3) * 8;
-    w &= ~(0xFFu << shift);
-    w |= (uint32_t)value << shift;
-    risc_store_word(risc, address, w);
+void risc_store_byte(struct RISC *risc, uint32_t address, uint8_t value) {
+  if (address < risc->display_start) {
+    risc_poke_byte(risc, address, value);
+    risc_invalidate_word(risc, address/4);
+  } else if (address < risc->mem_size) {
+    risc_poke_byte(risc, address, value);
+    risc_invalidate_word(risc, address/4);
+    risc_update_damage(risc, address/4 - risc->display_start/4);
   } else {
     risc_store_io(risc, address, (uint32_t)value);
   }
 }
 
+static void risc_invalidate_code(struct RISC *risc, uint32_t address, uint32_t len) {
+  uint64_t end = ((uint64_t)address + len + 3) / 4;
+  if (end > risc->mem_size / 4) {
+    end = risc->mem_size / 4;
+  }
+  for (uint32_t i = address / 4; i < end; i++) {
+    risc_invalidate_word(risc, i);
+  }
+}
+
+// The HostFS device writes its results straight into guest memory,
+// bypassing risc_store_word. Most calls only touch the request block,
+// but ReadBuf (op 7) also fills a guest buffer with file data.
+static void risc_hostfs_invalidate(struct RISC *risc, uint32_t address) {
+  uint32_t offset = address / 4;
+  risc_invalidate_code(risc, address, 64);
+  if (offset + 4 < risc->mem_size / 4 && risc->RAM[offset] == 7) {
+    risc_invalidate_code(risc, risc->RAM[offset + 4], risc->RAM[offset + 3]);
+  }
+}
+
+// Paravirtual disk access for a modified Kernel.Mod. The guest
+// passes the address of a request block: SD command (17 to read,
+// 24 to write), first block number, buffer address and block count.
+// The command is cleared once done, so guests running elsewhere can
+// tell that they need to fall back to SPI. Writing zero blocks makes
+// the earlier writes durable.
+static void risc_block_dma(struct RISC *risc, uint32_t address) {
+  const struct RISC_SPI *disk = risc->spi[1];
+  if (disk == NULL || disk->read_block == NULL ||
+      address % 4 != 0 || address >= risc->display_start - 16) {
+    return;
+  }
+  uint32_t *req = &risc->RAM[address/4];
+  uint32_t cmd = req[0], block = req[1], buf = req[2], count = req[3];
+  if ((cmd != 17 && cmd != 24) || buf % 4 != 0 || buf > risc->display_start ||
+      count > (risc->display_start - buf) / 512) {
+    return;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t *words = &risc->RAM[buf/4 + i*128];
+    risc->stats.dma_sectors++;
+    if (cmd == 17) {
+      disk->read_block(disk, block + i, words);
+    } else {
+      disk->write_block(disk, block + i, words);
+    }
+  }
+  if (cmd == 17) {
+    risc_invalidate_code(risc, buf, count * 512);
+  } else if (count == 0 && disk->sync != NULL) {
+    disk->sync(disk);
+  }
+  risc_store_word(risc, address, 0);
+}
+
 static uint32_t risc_load_io(struct RISC *risc, uint32_t address) {
   if (risc->fb_color && address < IOStart && address >= PaletteStart) {
     return risc->Palette[(address - PaletteStart)/4];
   }
+  if (address >= IOStart) {
+    risc->stats.io_loads[(address - IOStart)/4]++;
+  }
   switch (address - IOStart) {
     case 0: {
       // Millisecond counter
@@ -518,24 +706,23 @@ static uint32_t risc_load_io(struct RISC *risc, uint32_t address) {
       // Switches
       return risc->switches;
     }
-    case 8: {
-      // RS232 data
-      if (risc->serial) {
-        return risc->serial->read_data(risc->serial);
-      }
-      return 0;
+    case 8:
+    case 44: {
+      // RS232 data, clipboard data
+      risc->progress = IdlePolls;
+      return risc_host_read(risc, address - IOStart);
     }
-    case 12: {
-      // RS232 status
-      if (risc->serial) {
-        return risc->serial->read_status(risc->serial);
-      }
-      return 0;
+    case 12:
+    case 40: {
+      // RS232 status, clipboard control
+      return risc_host_read(risc, address - IOStart);
     }
     case 16: {
       // SPI data
+      risc->progress = IdlePolls;
       const struct RISC_SPI *spi = risc->spi[risc->spi_selected];
       if (spi != NULL) {
+        risc->stats.spi_bytes[risc->spi_selected]++;
         return spi->read_data(spi);
       }
       return 255;
@@ -549,7 +736,7 @@ static uint32_t risc_load_io(struct RISC *risc, uint32_t address) {
     case 24: {
       // Mouse input / keyboard status
       uint32_t mouse = risc->mouse;
-      if (risc->key_cnt > 0) {
+      if (KEY_LOAD(&risc->key_head) != risc->key_tail) {
         mouse |= 0x10000000;
       } else {
         risc->progress--;
@@ -558,23 +745,52 @@ static uint32_t risc_load_io(struct RISC *risc, uint32_t address) {
     }
     case 28: {
       // Keyboard input
-      if (risc->key_cnt > 0) {
-        uint8_t scancode = risc->key_buf[0];
-        risc->key_cnt--;
-        memmove(&risc->key_buf[0], &risc->key_buf[1], risc->key_cnt);
+      risc->progress = IdlePolls;
+      uint32_t tail = risc->key_tail;
+      if (KEY_LOAD(&risc->key_head) != tail) {
+        uint8_t scancode = risc->key_buf[tail % KeyBufSize];
+        KEY_STORE(&risc->key_tail, tail + 1);
         return scancode;
       }
       return 0;
     }
+    default: {
+      return 0;
+    }
+  }
+}
+
+// The IO registers whose value comes from the host. What they say is
+// part of a recording.
+static uint32_t risc_host_read(struct RISC *risc, uint32_t reg) {
+  if (risc->replay) {
+    return risc_replay_read(risc, reg);
+  }
+  return risc_read_host(risc, reg);
+}
+
+uint32_t risc_read_host(struct RISC *risc, uint32_t reg) {
+  switch (reg) {
+    case 8: {
+      if (risc->serial) {
+        risc->stats.serial_in++;
+        return risc->serial->read_data(risc->serial);
+      }
+      return 0;
+    }
+    case 12: {
+      if (risc->serial) {
+        return risc->serial->read_status(risc->serial);
+      }
+      return 0;
+    }
     case 40: {
-      // Clipboard control
       if (risc->clipboard) {
         return risc->clipboard->read_control(risc->clipboard);
       }
       return 0;
     }
     case 44: {
-      // Clipboard data
       if (risc->clipboard) {
         return risc->clipboard->read_data(risc->clipboard);
       }
@@ -587,16 +803,15 @@ static uint32_t risc_load_io(struct RISC *risc, uint32_t address) {
 }
 
 static void risc_store_io(struct RISC *risc, uint32_t address, uint32_t value) {
+  risc->progress = IdlePolls;
   if (risc->fb_color && address < IOStart && address >= PaletteStart) {
     risc->Palette[(address - PaletteStart)/4] = value;
-    risc->damage = (struct Damage){
-      .x1 = 0,
-      .y1 = 0,
-      .x2 = risc->fb_width - 1,
-      .y2 = risc->fb_height - 1
-    };
+    risc_damage_all(risc);
     return;
   }
+  if (address >= IOStart) {
+    risc->stats.io_stores[(address - IOStart)/4]++;
+  }
   switch (address - IOStart) {
     case 4: {
       // LED control
@@ -608,6 +823,7 @@ static void risc_store_io(struct RISC *risc, uint32_t address, uint32_t value) {
     case 8: {
       // RS232 data
       if (risc->serial) {
+        risc->stats.serial_out++;
         risc->serial->write_data(risc->serial, value);
       }
       break;
@@ -616,6 +832,7 @@ static void risc_store_io(struct RISC *risc, uint32_t address, uint32_t value) {
       // SPI write
       const struct RISC_SPI *spi = risc->spi[risc->spi_selected];
       if (spi != NULL) {
+        risc->stats.spi_bytes[risc->spi_selected]++;
         spi->write_data(spi, value);
       }
       break;
@@ -632,10 +849,20 @@ static void risc_store_io(struct RISC *risc, uint32_t address, uint32_t value) {
     case 32: {
       // Host FS
       if (risc->hostfs) {
-        risc->hostfs->write(risc->hostfs, value, risc->RAM);
+        if (value / 4 < risc->mem_size / 4) {
+          uint32_t op = risc->RAM[value/4];
+          risc->stats.hostfs_calls[op < RISC_HOSTFS_OPS ? op : RISC_HOSTFS_OPS - 1]++;
+        }
+        risc->hostfs->write(risc->hostfs, value, risc->RAM, risc->mem_size);
+        risc_hostfs_invalidate(risc, value);
       }
       break;
     }
+    case 36: {
+      // Block DMA
+      risc_block_dma(risc, value);
+      break;
+    }
     case 40: {
       // Clipboard control
       if (risc->clipboard) {
@@ -655,10 +882,31 @@ static void risc_store_io(struct RISC *risc, uint32_t address, uint32_t value) {
 
 
 void risc_set_time(struct RISC *risc, uint32_t tick) {
+  if (tick == risc->current_tick) {
+    return;
+  }
+  if (risc->replay && !risc_replay_input(risc, 'T', tick, 0)) {
+    return;
+  }
   risc->current_tick = tick;
 }
 
+uint32_t risc_get_time(struct RISC *risc) {
+  return risc->current_tick;
+}
+
+uint64_t risc_get_instructions(struct RISC *risc) {
+  return risc->stats.instructions;
+}
+
+void risc_get_stats(struct RISC *risc, struct RISC_Stats *stats) {
+  *stats = risc->stats;
+}
+
 void risc_mouse_moved(struct RISC *risc, int mouse_x, int mouse_y) {
+  if (risc->replay && !risc_replay_input(risc, 'M', (uint32_t)mouse_x, (uint32_t)mouse_y)) {
+    return;
+  }
   if (mouse_x >= 0 && mouse_x < 4096) {
     risc->mouse = (risc->mouse & ~0x00000FFF) | mouse_x;
   }
@@ -668,6 +916,9 @@ void risc_mouse_moved(struct RISC *risc, int mouse_x, int mouse_y) {
 }
 
 void risc_mouse_button(struct RISC *risc, int button, bool down) {
+  if (risc->replay && !risc_replay_input(risc, 'B', (uint32_t)button, down)) {
+    return;
+  }
   if (button >= 1 && button < 4) {
     uint32_t bit = 1 << (27 - button);
     if (down) {
@@ -678,14 +929,26 @@ void risc_mouse_button(struct RISC *risc, int button, bool down) {
   }
 }
 
-void risc_keyboard_input(struct RISC *risc, uint8_t *scancodes, uint32_t len) {
-  if (sizeof(risc->key_buf) - risc->key_cnt >= len) {
-    memmove(&risc->key_buf[risc->key_cnt], scancodes, len);
-    risc->key_cnt += len;
+// The keyboard buffer is a ring with one writer for each index: the
+// front end moves key_head, the guest moves key_tail. Sequences are
+// added whole, so that the guest never sees half a scancode.
+bool risc_keyboard_input(struct RISC *risc, const uint8_t *scancodes, uint32_t len) {
+  uint32_t head = risc->key_head;
+  if (KeyBufSize - (head - KEY_LOAD(&risc->key_tail)) < len) {
+    return false;
+  }
+  if (risc->replay && !risc_replay_keys(risc, scancodes, len)) {
+    return true;  // replaying, the keys are in the log
   }
+  for (uint32_t i = 0; i < len; i++) {
+    risc->key_buf[(head + i) % KeyBufSize] = scancodes[i];
+  }
+  KEY_STORE(&risc->key_head, head + len);
+  return true;
 }
 
 uint32_t *risc_get_framebuffer_ptr(struct RISC *risc) {
+  risc_map_memory(risc);
   return &risc->RAM[risc->display_start/4];
 }
 
@@ -693,13 +956,424 @@ uint32_t *risc_get_palette_ptr(struct RISC *risc) {
   return risc->Palette;
 }
 
+// Every framebuffer row has a mask of changed columns, with up to
+// 64 columns of 1 << damage_shift words each.
+static void risc_init_damage(struct RISC *risc) {
+  risc->damage_shift = 0;
+  while ((risc->fb_width - 1) >> risc->damage_shift >= 64) {
+    risc->damage_shift++;
+  }
+  risc->damage_recip = ((uint64_t)1 << 32) / (uint32_t)risc->fb_width + 1;
+  risc->damage_row_shift = -1;
+  for (int k = 0; k < 31; k++) {
+    if (risc->fb_width == 1 << k) {
+      risc->damage_row_shift = k;
+    }
+  }
+  free(risc->damage_rows);
+  risc->damage_rows = calloc((size_t)risc->fb_height, sizeof(*risc->damage_rows));
+  risc_damage_all(risc);
+}
+
+static void risc_damage_all(struct RISC *risc) {
+  int columns = ((risc->fb_width - 1) >> risc->damage_shift) + 1;
+  uint64_t mask = columns == 64 ? ~(uint64_t)0 : ((uint64_t)1 << columns) - 1;
+  for (int row = 0; row < risc->fb_height; row++) {
+    risc->damage_rows[row] = mask;
+  }
+}
+
+static void risc_add_damage(struct Damage *rect, const struct Damage *more) {
+  if (more->x1 < rect->x1) {
+    rect->x1 = more->x1;
+  }
+  if (more->x2 > rect->x2) {
+    rect->x2 = more->x2;
+  }
+  if (more->y1 < rect->y1) {
+    rect->y1 = more->y1;
+  }
+  if (more->y2 > rect->y2) {
+    rect->y2 = more->y2;
+  }
+}
+
+// Runs of changed columns become rectangles, which grow downwards as
+// long as the following rows have the same mask.
+int risc_get_framebuffer_damage_rects(struct RISC *risc, struct Damage *rects, int max) {
+  int count = 0, open = 0;
+  bool full = false;
+  uint64_t prev = 0;
+  for (int row = 0; row < risc->fb_height; row++) {
+    uint64_t mask = risc->damage_rows[row];
+    risc->damage_rows[row] = 0;
+    if (mask == 0) {
+      prev = 0;
+      continue;
+    }
+    if (mask == prev && !full) {
+      for (int i = count - open; i < count; i++) {
+        rects[i].y2 = row;
+      }
+      continue;
+    }
+    prev = mask;
+    open = 0;
+    for (int col = 0; col < 64; col++) {
+      if (!((mask >> col) & 1)) {
+        continue;
+      }
+      int first = col;
+      while (col < 63 && ((mask >> (col + 1)) & 1)) {
+        col++;
+      }
+      int x2 = ((col + 1) << risc->damage_shift) - 1;
+      struct Damage rect = {
+        .x1 = first << risc->damage_shift,
+        .x2 = x2 < risc->fb_width ? x2 : risc->fb_width - 1,
+        .y1 = row,
+        .y2 = row
+      };
+      if (count < max && !full) {
+        rects[count++] = rect;
+        open++;
+      } else if (count > 0) {
+        // Out of rectangles, the last one takes the rest.
+        risc_add_damage(&rects[count - 1], &rect);
+        full = true;
+      }
+    }
+  }
+  return count;
+}
+
 struct Damage risc_get_framebuffer_damage(struct RISC *risc) {
-  struct Damage dmg = risc->damage;
-  risc->damage = (struct Damage){
-    .x1 = risc->fb_width,
-    .x2 = 0,
-    .y1 = risc->fb_height,
-    .y2 = 0
-  };
+  struct Damage dmg;
+  if (risc_get_framebuffer_damage_rects(risc, &dmg, 1) == 0) {
+    dmg = (struct Damage){
+      .x1 = risc->fb_width,
+      .x2 = 0,
+      .y1 = risc->fb_height,
+      .y2 = 0
+    };
+  }
   return dmg;
 }
+
+
+// Snapshots are a plain dump of the machine state in host byte order,
+// preceded by the memory configuration, which has to match on load.
+// Front end settings (LEDs, serial line, HostFS, JIT) are not part
+// of it, and neither is the disk image itself.
+//
+// Snapshot files are written and read in place, without a copy of RAM
+// in memory. They are as large as RAM, but pages the guest never
+// touched are left as holes where the file system allows it.
+
+#define StateMagic   0x54534952  // "RIST"
+#define StateVersion 2
+
+struct StateBuf {
+  uint8_t *buf;
+  FILE *file;    // instead of buf
+  size_t pos;
+  size_t hole;   // zero bytes not written to the file yet
+  bool load;
+  bool ok;
+};
+
+// Seeks in steps that fit into a long everywhere.
+static bool state_skip(FILE *f, size_t size) {
+  while (size > 0) {
+    long step = size > 0x40000000 ? 0x40000000 : (long)size;
+    if (fseek(f, step, SEEK_CUR) != 0) {
+      return false;
+    }
+    size -= (size_t)step;
+  }
+  return true;
+}
+
+static void state_write(struct StateBuf *s, const void *data, size_t size) {
+  if (s->hole > 0) {
+    s->ok = s->ok && state_skip(s->file, s->hole);
+    s->hole = 0;
+  }
+  s->ok = s->ok && fwrite(data, size, 1, s->file) == 1;
+}
+
+static void state_bytes(struct StateBuf *s, void *data, size_t size) {
+  if (s->buf) {
+    if (s->load) {
+      memcpy(data, s->buf + s->pos, size);
+    } else {
+      memcpy(s->buf + s->pos, data, size);
+    }
+  } else if (s->file && s->load) {
+    s->ok = s->ok && fread(data, size, 1, s->file) == 1;
+  } else if (s->file) {
+    state_write(s, data, size);
+  }
+  s->pos += size;
+}
+
+#define STATE(s, field) state_bytes(s, &(field), sizeof(field))
+
+// Pages that are zero in the snapshot stay unmapped on load, so that
+// a restored guest takes no more host memory than it did before, and
+// they become holes in snapshot files.
+#define StatePage 4096
+
+static void state_ram(struct RISC *risc, struct StateBuf *s) {
+  static const uint8_t zero[StatePage];
+  if (!s->buf && !s->file) {
+    s->pos += risc->mem_size;
+    return;
+  }
+  if (s->load) {
+    risc_clear_pages(risc->RAM, risc->mem_size);
+  }
+  for (size_t off = 0; off < risc->mem_size; off += StatePage) {
+    size_t len = risc->mem_size - off < StatePage ? risc->mem_size - off : StatePage;
+    uint8_t *ram = (uint8_t *)risc->RAM + off;
+    if (s->load) {
+      uint8_t page[StatePage];
+      const uint8_t *src = s->buf ? s->buf + s->pos : page;
+      if (s->file) {
+        s->ok = s->ok && fread(page, len, 1, s->file) == 1;
+      }
+      if (s->ok && memcmp(src, zero, len) != 0) {
+        memcpy(ram, src, len);
+      }
+      s->pos += len;
+    } else if (s->file && memcmp(ram, zero, len) == 0) {
+      s->hole += len;
+      s->pos += len;
+    } else {
+      state_bytes(s, ram, len);
+    }
+  }
+}
+
+// The disk controllers save their state into a buffer of their own.
+static void state_spi(const struct RISC_SPI *spi, struct StateBuf *s) {
+  size_t size = spi->save_state(spi, NULL);
+  if (s->buf && s->load) {
+    spi->load_state(spi, s->buf + s->pos);
+  } else if (s->buf) {
+    spi->save_state(spi, s->buf + s->pos);
+  } else if (s->file) {
+    uint8_t *buf = malloc(size);
+    if (buf == NULL) {
+      s->ok = false;
+      return;
+    }
+    if (s->load) {
+      s->ok = s->ok && fread(buf, size, 1, s->file) == 1;
+      if (s->ok) {
+        spi->load_state(spi, buf);
+      }
+    } else {
+      spi->save_state(spi, buf);
+      state_write(s, buf, size);
+    }
+    free(buf);
+  }
+  s->pos += size;
+}
+
+static void risc_state_header(struct RISC *risc, uint32_t hdr[static 8]) {
+  hdr[0] = StateMagic;
+  hdr[1] = StateVersion;
+  hdr[2] = risc->mem_size;
+  hdr[3] = risc->display_start;
+  hdr[4] = (uint32_t)risc->fb_width;
+  hdr[5] = (uint32_t)risc->fb_height;
+  hdr[6] = risc->fb_color;
+  hdr[7] = 0;
+  for (int i = 1; i < 3; i++) {
+    const struct RISC_SPI *spi = risc->spi[i];
+    if (spi != NULL && spi->save_state != NULL) {
+      hdr[7] += (uint32_t)spi->save_state(spi, NULL);
+    }
+  }
+}
+
+// The header is checked before loading, and skipped here.
+static void risc_state(struct RISC *risc, struct StateBuf *s) {
+  uint32_t hdr[8];
+  risc_state_header(risc, hdr);
+  if (!s->load) {
+    STATE(s, hdr);
+  } else {
+    s->pos += sizeof(hdr);
+  }
+  STATE(s, risc->PC);
+  STATE(s, risc->R);
+  STATE(s, risc->H);
+  STATE(s, risc->SPC);
+  STATE(s, risc->SZ);
+  STATE(s, risc->SN);
+  STATE(s, risc->SC);
+  STATE(s, risc->SV);
+  STATE(s, risc->C);
+  STATE(s, risc->V);
+  STATE(s, risc->I);
+  STATE(s, risc->E);
+  STATE(s, risc->P);
+  STATE(s, risc->flag_res);
+  STATE(s, risc->flag_b);
+  STATE(s, risc->flag_c);
+  STATE(s, risc->flag_op);
+  STATE(s, risc->progress);
+  STATE(s, risc->current_tick);
+  STATE(s, risc->mouse);
+  STATE(s, risc->key_buf);
+  STATE(s, risc->key_head);
+  STATE(s, risc->key_tail);
+  STATE(s, risc->switches);
+  STATE(s, risc->spi_selected);
+  STATE(s, risc->ROM);
+  STATE(s, risc->Palette);
+  state_ram(risc, s);
+  for (int i = 1; i < 3; i++) {
+    const struct RISC_SPI *spi = risc->spi[i];
+    if (spi != NULL && spi->save_state != NULL) {
+      state_spi(spi, s);
+    }
+  }
+}
+
+// Nothing decoded or translated is left valid.
+static void risc_state_loaded(struct RISC *risc) {
+  if (risc->jit) {
+    risc_jit_flush(risc);
+  }
+  risc_clear_pages(risc->RAM_decoded, risc->mem_size / 4 * sizeof(struct Decoded));
+  memset(risc->ROM_decoded, 0, sizeof(risc->ROM_decoded));
+  risc_damage_all(risc);
+}
+
+size_t risc_save_state(struct RISC *risc, void *buf) {
+  risc_map_memory(risc);
+  struct StateBuf s = { .buf = buf, .load = false };
+  risc_state(risc, &s);
+  return s.pos;
+}
+
+bool risc_load_state(struct RISC *risc, const void *buf, size_t size) {
+  uint32_t hdr[8];
+  risc_state_header(risc, hdr);
+  if (size != risc_save_state(risc, NULL) || memcmp(buf, hdr, sizeof(hdr)) != 0) {
+    return false;
+  }
+  struct StateBuf s = { .buf = (uint8_t *)buf, .load = true, .ok = true };
+  risc_state(risc, &s);
+  risc_state_loaded(risc);
+  return true;
+}
+
+// Snapshots are written to a temporary file of their own first, so
+// that other instances never see half a snapshot, not even when they
+// save the same one at the same time. Returns NULL with errno set, and
+// nothing left behind, on failure.
+static FILE *risc_create_temp(const char *filename, char **tmp) {
+  size_t len = strlen(filename) + 32;
+  *tmp = malloc(len);
+  if (*tmp == NULL) {
+    return NULL;
+  }
+#if defined(__unix__) || defined(__APPLE__)
+  snprintf(*tmp, len, "%s.XXXXXX", filename);
+  FILE *f = NULL;
+  int fd = mkstemp(*tmp);
+  if (fd != -1) {
+    // mkstemp only lets the owner in.
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+    f = fdopen(fd, "wb");
+    if (f == NULL) {
+      int saved = errno;
+      close(fd);
+      remove(*tmp);
+      errno = saved;
+    }
+  }
+#else
+  static unsigned count;
+#if defined(_WIN32)
+  unsigned long pid = GetCurrentProcessId();
+#else
+  unsigned long pid = 0;
+#endif
+  snprintf(*tmp, len, "%s.%lu.%u", filename, pid, count++);
+  FILE *f = fopen(*tmp, "wb");
+#endif
+  if (f == NULL) {
+    free(*tmp);
+    *tmp = NULL;
+  }
+  return f;
+}
+
+bool risc_save_snapshot(struct RISC *risc, const char *filename) {
+  risc_map_memory(risc);
+  char *tmp;
+  FILE *f = risc_create_temp(filename, &tmp);
+  if (f == NULL) {
+    return false;
+  }
+  struct StateBuf s = { .file = f, .load = false, .ok = true };
+  risc_state(risc, &s);
+  if (s.hole > 0) {
+    // The file has to end with the last page, even if it is a hole.
+    s.ok = s.ok && state_skip(f, s.hole - 1) && fputc(0, f) != EOF;
+  }
+  bool ok = s.ok;
+  if (fclose(f) != 0) {
+    ok = false;
+  }
+  ok = ok && rename(tmp, filename) == 0;
+  if (!ok) {
+    int saved = errno;
+    remove(tmp);
+    errno = saved;
+  }
+  free(tmp);
+  return ok;
+}
+
+// The file is checked for the right header and size before anything is
+// loaded, so that a snapshot that doesn't fit, which gives EINVAL,
+// leaves the machine alone. A read error on the way leaves it half
+// loaded, with errno from the read.
+bool risc_load_snapshot(struct RISC *risc, const char *filename) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    return false;
+  }
+  uint32_t hdr[8], file_hdr[8];
+  size_t size = risc_save_state(risc, NULL);
+  risc_state_header(risc, hdr);
+  bool ok = fread(file_hdr, sizeof(file_hdr), 1, f) == 1 &&
+            memcmp(file_hdr, hdr, sizeof(hdr)) == 0 &&
+            state_skip(f, size - sizeof(hdr) - 1) &&
+            fgetc(f) != EOF && fgetc(f) == EOF &&
+            fseek(f, (long)sizeof(hdr), SEEK_SET) == 0;
+  if (ok) {
+    struct StateBuf s = { .file = f, .load = true, .ok = true };
+    risc_state(risc, &s);
+    ok = s.ok;
+    int saved = errno;
+    risc_state_loaded(risc);
+    errno = saved;
+  }
+  // A short read without an error means the file changed meanwhile.
+  int error = ok ? 0 : ferror(f) ? errno : EINVAL;
+  fclose(f);
+  if (!ok) {
+    errno = error;
+  }
+  return ok;
+}
@@ -2,6 +2,7 @@
 #define RISC_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include "risc-io.h"
 
@@ -15,6 +16,26 @@ struct Damage {
   int x1, x2, y1, y2;
 };
 
+// Counters kept since risc_new. IO registers are numbered by their
+// offset from the first one at -64, divided by 4.
+#define RISC_IO_REGISTERS 16
+#define RISC_HOSTFS_OPS 16
+
+struct RISC_Stats {
+  uint64_t instructions;     // retired by risc_run
+  uint64_t branches_taken;   // including calls and returns
+  uint64_t io_loads[RISC_IO_REGISTERS];
+  uint64_t io_stores[RISC_IO_REGISTERS];
+  uint64_t serial_in, serial_out;          // bytes
+  uint64_t spi_bytes[4];                   // both ways, per slave
+  uint64_t dma_sectors;                    // through the block DMA port
+  uint64_t hostfs_calls[RISC_HOSTFS_OPS];  // per op code, the last
+                                           // one counts all the others
+  uint64_t damaged_words;    // stores to the framebuffer
+  uint64_t runs;             // calls to risc_run
+  uint64_t idle_runs;        // that ended early because the guest idled
+};
+
 struct RISC *risc_new(void);
 void risc_configure_memory(struct RISC *risc, int megabytes_ram, bool rtc_option, int screen_width, int screen_height, bool screen_color);
 void risc_set_leds(struct RISC *risc, const struct RISC_LED *leds);
@@ -24,16 +45,79 @@ void risc_set_clipboard(struct RISC *risc, const struct RISC_Clipboard *clipboar
 void risc_set_switches(struct RISC *risc, int switches);
 void risc_set_host_fs(struct RISC *risc, const struct RISC_HostFS *hostfs);
 
+// Translate hot code to native instructions. Returns false if this
+// host has no translator, the interpreter is used then.
+bool risc_set_jit(struct RISC *risc, bool enable);
+
+// Samples the guest's call stack every period instructions, or stops
+// and forgets the samples if period is 0. Returns false if out of
+// memory.
+bool risc_set_profile(struct RISC *risc, uint32_t period);
+// Writes the share of samples per module and procedure to filename,
+// and the sampled stacks to filename.folded, in the collapsed format
+// of flame graph tools. Returns false with errno set on failure.
+bool risc_write_profile(struct RISC *risc, const char *filename);
+
+// A prime, so that samples don't follow the guest's loops.
+#define RISC_PROFILE_PERIOD 10007
+
+// Logs every input from the host to filename, keyed by the number of
+// instructions executed, or ends the recording if filename is NULL.
+// Inputs must come from the thread that calls risc_run. Returns false
+// with errno set on failure.
+bool risc_record(struct RISC *risc, const char *filename);
+// Feeds the inputs logged by risc_record to the guest again, from now
+// on, and drops those from the host. The guest has to start from the
+// same state as the recording did: the same disk, memory configuration
+// and host files. risc_run stops short once the replay is over.
+bool risc_replay(struct RISC *risc, const char *filename);
+
+enum RISC_ReplayState {
+  RISC_REPLAY_OFF,
+  RISC_REPLAY_RUNNING,
+  RISC_REPLAY_DONE,
+  RISC_REPLAY_DIVERGED,  // the guest didn't do what it did before
+};
+enum RISC_ReplayState risc_replay_state(struct RISC *risc);
+
 void risc_reset(struct RISC *risc);
 void risc_trigger_interrupt(struct RISC *risc); 
-void risc_run(struct RISC *risc, int cycles);
+// Returns false if the guest went idle before the cycles were used up.
+bool risc_run(struct RISC *risc, int cycles);
+// Instructions executed by risc_run so far.
+uint64_t risc_get_instructions(struct RISC *risc);
+void risc_get_stats(struct RISC *risc, struct RISC_Stats *stats);
 void risc_set_time(struct RISC *risc, uint32_t tick);
+uint32_t risc_get_time(struct RISC *risc);
 void risc_mouse_moved(struct RISC *risc, int mouse_x, int mouse_y);
 void risc_mouse_button(struct RISC *risc, int button, bool down);
-void risc_keyboard_input(struct RISC *risc, uint8_t *scancodes, uint32_t len);
+// Queues PS/2 scancodes. Returns false, and queues nothing, if there
+// is no room for all of them yet. It is safe to call this from another
+// thread than risc_run, as long as there is only one such thread.
+bool risc_keyboard_input(struct RISC *risc, const uint8_t *scancodes, uint32_t len);
 
 uint32_t *risc_get_framebuffer_ptr(struct RISC *risc);
 uint32_t *risc_get_palette_ptr(struct RISC *risc);
 struct Damage risc_get_framebuffer_damage(struct RISC *risc);
+// Writes up to max rectangles that together cover everything drawn
+// since the last call, and returns how many. If there are more, the
+// last one covers the rest. Coordinates are in framebuffer words and
+// lines, like struct Damage.
+int risc_get_framebuffer_damage_rects(struct RISC *risc, struct Damage *rects, int max);
+
+// Snapshots of the machine and disk controller state. They can only be
+// loaded with the same memory configuration, and the disk image must
+// not have changed in between. risc_save_state returns the size and
+// leaves buf alone if it is NULL. The snapshot functions work on the
+// file directly and return false with errno set on failure;
+// risc_load_snapshot sets it to ENOENT if there is no such file, and
+// to EINVAL if the file doesn't fit, which leaves the machine alone. A
+// read error on the way leaves the machine half loaded. Snapshot files are
+// as large as RAM, with untouched pages left as holes where the file
+// system supports them.
+size_t risc_save_state(struct RISC *risc, void *buf);
+bool risc_load_state(struct RISC *risc, const void *buf, size_t size);
+bool risc_save_snapshot(struct RISC *risc, const char *filename);
+bool risc_load_snapshot(struct RISC *risc, const char *filename);
 
 #endif  // RISC_H
@@ -0,0 +1,252 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "scheduler.h"
+
+// Every worker has its own queue of machines. It runs the one at the
+// front for a slice of SliceTicks milliseconds and puts it at the back,
+// so a machine tends to stay on the same host core, with its memory
+// and translated code in that core's cache. A worker whose queue runs
+// dry steals from the back of another queue.
+//
+// Idle milliseconds cost next to nothing, so guests waiting for the
+// timer still run at full speed. But a guest that stays idle for
+// ParkTicks is probably waiting for input, and it is parked for
+// ParkNanos of wall clock time between slices instead of keeping a
+// worker spinning.
+//
+// Slices are long enough that a single lock for all queues is fine.
+
+#define CPU_HZ 25000000
+#define SliceTicks 10
+#define ParkTicks 100
+#define ParkNanos 10000000L
+
+struct Machine {
+  struct RISC *risc;
+  bool (*poll)(void *arg, uint32_t tick);
+  void *arg;
+  uint32_t tick;
+  uint32_t idle_ticks;
+  bool parked;
+  struct timespec wake;
+};
+
+struct Worker {
+  struct Scheduler *sched;
+  pthread_t thread;
+  struct Machine **queue;  // ring buffer
+  int head, count;
+};
+
+struct Scheduler {
+  pthread_mutex_t lock;  // protects everything below
+  pthread_cond_t cond;
+  struct Machine *machines;
+  int machine_cnt;
+  int running, parked, waiting;
+  struct Worker *workers;
+  int worker_cnt;
+};
+
+struct Scheduler *scheduler_new(int workers) {
+  struct Scheduler *sched = calloc(1, sizeof(*sched));
+  if (sched == NULL) {
+    fprintf(stderr, "Can't allocate scheduler\n");
+    exit(1);
+  }
+  pthread_mutex_init(&sched->lock, NULL);
+  pthread_cond_init(&sched->cond, NULL);
+  sched->worker_cnt = workers > 0 ? workers : 1;
+  return sched;
+}
+
+void scheduler_add(struct Scheduler *sched, struct RISC *risc,
+                   bool (*poll)(void *arg, uint32_t tick), void *arg) {
+  int n = sched->machine_cnt;
+  sched->machines = realloc(sched->machines, (size_t)(n + 1) * sizeof(*sched->machines));
+  if (sched->machines == NULL) {
+    fprintf(stderr, "Can't allocate scheduler\n");
+    exit(1);
+  }
+  sched->machines[n] = (struct Machine){
+    .risc = risc,
+    .poll = poll,
+    .arg = arg,
+    .tick = risc_get_time(risc)
+  };
+  sched->machine_cnt = n + 1;
+}
+
+static void push(struct Worker *worker, struct Machine *m) {
+  int cap = worker->sched->machine_cnt;
+  worker->queue[(worker->head + worker->count) % cap] = m;
+  worker->count++;
+}
+
+static struct Machine *pop(struct Worker *worker, bool front) {
+  if (worker->count == 0) {
+    return NULL;
+  }
+  int cap = worker->sched->machine_cnt;
+  worker->count--;
+  if (front) {
+    struct Machine *m = worker->queue[worker->head];
+    worker->head = (worker->head + 1) % cap;
+    return m;
+  }
+  return worker->queue[(worker->head + worker->count) % cap];
+}
+
+static bool before(const struct timespec *a, const struct timespec *b) {
+  return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Returns a parked machine whose time has come, or sets wake to the
+// earliest time one will.
+static struct Machine *unpark(struct Scheduler *sched, struct timespec *wake) {
+  if (sched->parked == 0) {
+    return NULL;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  bool first = true;
+  for (int i = 0; i < sched->machine_cnt; i++) {
+    struct Machine *m = &sched->machines[i];
+    if (!m->parked) {
+      continue;
+    }
+    if (!before(&now, &m->wake)) {
+      m->parked = false;
+      sched->parked--;
+      return m;
+    }
+    if (first || before(&m->wake, wake)) {
+      *wake = m->wake;
+      first = false;
+    }
+  }
+  return NULL;
+}
+
+// Called with the lock held. Returns NULL once all machines are done.
+static struct Machine *next_machine(struct Worker *self) {
+  struct Scheduler *sched = self->sched;
+  int me = (int)(self - sched->workers);
+  while (sched->running > 0) {
+    struct timespec wake;
+    struct Machine *m = unpark(sched, &wake);
+    if (m == NULL) {
+      m = pop(self, true);
+    }
+    for (int i = 1; m == NULL && i < sched->worker_cnt; i++) {
+      m = pop(&sched->workers[(me + i) % sched->worker_cnt], false);
+    }
+    if (m != NULL) {
+      return m;
+    }
+    sched->waiting++;
+    if (sched->parked > 0) {
+      pthread_cond_timedwait(&sched->cond, &sched->lock, &wake);
+    } else {
+      pthread_cond_wait(&sched->cond, &sched->lock);
+    }
+    sched->waiting--;
+  }
+  return NULL;
+}
+
+// Returns false once the machine is done.
+static bool run_slice(struct Machine *m) {
+  for (int i = 0; i < SliceTicks; i++) {
+    if (!m->poll(m->arg, m->tick)) {
+      return false;
+    }
+    risc_set_time(m->risc, m->tick);
+    if (risc_run(m->risc, CPU_HZ / 1000)) {
+      m->idle_ticks = 0;
+    } else {
+      m->idle_ticks++;
+    }
+    risc_trigger_interrupt(m->risc);
+    m->tick++;
+  }
+  return true;
+}
+
+static void *worker_main(void *arg) {
+  struct Worker *self = arg;
+  struct Scheduler *sched = self->sched;
+  pthread_mutex_lock(&sched->lock);
+  struct Machine *m;
+  while ((m = next_machine(self)) != NULL) {
+    pthread_mutex_unlock(&sched->lock);
+    bool more = run_slice(m);
+    pthread_mutex_lock(&sched->lock);
+    if (!more) {
+      sched->running--;
+      if (sched->running == 0) {
+        pthread_cond_broadcast(&sched->cond);
+      }
+      continue;
+    }
+    if (m->idle_ticks >= ParkTicks) {
+      clock_gettime(CLOCK_REALTIME, &m->wake);
+      m->wake.tv_nsec += ParkNanos;
+      if (m->wake.tv_nsec >= 1000000000L) {
+        m->wake.tv_sec++;
+        m->wake.tv_nsec -= 1000000000L;
+      }
+      m->parked = true;
+      sched->parked++;
+    } else {
+      push(self, m);
+    }
+    // Let a waiting worker steal it, or pick a new wake time.
+    if (sched->waiting > 0) {
+      pthread_cond_signal(&sched->cond);
+    }
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return NULL;
+}
+
+void scheduler_run(struct Scheduler *sched) {
+  int n = sched->machine_cnt;
+  if (n == 0) {
+    return;
+  }
+  sched->workers = calloc((size_t)sched->worker_cnt, sizeof(*sched->workers));
+  if (sched->workers == NULL) {
+    fprintf(stderr, "Can't allocate scheduler\n");
+    exit(1);
+  }
+  for (int i = 0; i < sched->worker_cnt; i++) {
+    struct Worker *worker = &sched->workers[i];
+    worker->sched = sched;
+    worker->queue = calloc((size_t)n, sizeof(*worker->queue));
+    if (worker->queue == NULL) {
+      fprintf(stderr, "Can't allocate scheduler\n");
+      exit(1);
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    push(&sched->workers[i % sched->worker_cnt], &sched->machines[i]);
+  }
+  sched->running = n;
+
+  for (int i = 0; i < sched->worker_cnt; i++) {
+    if (pthread_create(&sched->workers[i].thread, NULL, worker_main, &sched->workers[i]) != 0) {
+      fprintf(stderr, "Can't start worker thread\n");
+      exit(1);
+    }
+  }
+  for (int i = 0; i < sched->worker_cnt; i++) {
+    pthread_join(sched->workers[i].thread, NULL);
+    free(sched->workers[i].queue);
+  }
+  free(sched->workers);
+  sched->workers = NULL;
+}
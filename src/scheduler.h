@@ -0,0 +1,25 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "risc.h"
+
+// Runs many machines on a pool of worker threads. Guest time follows
+// the emulated cycles, like in risc-headless.
+
+struct Scheduler;
+
+struct Scheduler *scheduler_new(int workers);
+
+// poll is called from a worker thread before each emulated millisecond,
+// with the guest time it is about to run. The machine is done once it
+// returns false. Calls for one machine never overlap, but different
+// machines are polled concurrently.
+void scheduler_add(struct Scheduler *sched, struct RISC *risc,
+                   bool (*poll)(void *arg, uint32_t tick), void *arg);
+
+// Returns when all machines are done.
+void scheduler_run(struct Scheduler *sched);
+
+#endif  // SCHEDULER_H
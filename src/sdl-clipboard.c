@@ -6,33 +6,48 @@
 
 enum State { IDLE, GET, PUT };
 
-static enum State state = IDLE;
-static char *data = NULL;
-static size_t data_ptr = 0;
-static size_t data_len = 0;
+struct Clipboard {
+  struct RISC_Clipboard clipboard;
+  enum State state;
+  char *data;
+  size_t data_ptr;
+  size_t data_len;
+  // Set by sdl_clipboard_detach().
+  void (*put)(void *arg, const char *text);
+  void *put_arg;
+  char *text;  // as of the last sdl_clipboard_offer()
+};
+
+static void reset(struct Clipboard *c) {
+  c->state = IDLE;
+  free(c->data);
+  c->data = NULL;
+  c->data_len = 0;
+  c->data_ptr = 0;
+}
 
-static void reset() {
-  state = IDLE;
-  free(data);
-  data = NULL;
-  data_len = 0;
-  data_ptr = 0;
+static char *get_text(struct Clipboard *c) {
+  if (c->put == NULL) {
+    return SDL_GetClipboardText();
+  }
+  return c->text ? SDL_strdup(c->text) : NULL;
 }
 
 static uint32_t clipboard_control_read(const struct RISC_Clipboard *clip) {
+  struct Clipboard *c = (struct Clipboard *)clip;
   uint32_t r = 0;
-  reset();
-  data = SDL_GetClipboardText();
-  if (data) {
-    data_len = strlen(data);
-    if (data_len > UINT32_MAX) {
-      reset();
+  reset(c);
+  c->data = get_text(c);
+  if (c->data) {
+    c->data_len = strlen(c->data);
+    if (c->data_len > UINT32_MAX) {
+      reset(c);
     }
-    else if (data_len > 0) {
-      state = GET;
-      r = (uint32_t)data_len;
+    else if (c->data_len > 0) {
+      c->state = GET;
+      r = (uint32_t)c->data_len;
       // Decrease length if data contains CR/LF line endings
-      const char *p = data;
+      const char *p = c->data;
       while ((p = strchr(p, '\r')) != NULL) {
         if (*++p == '\n') {
           r--;
@@ -44,54 +59,84 @@ static uint32_t clipboard_control_read(const struct RISC_Clipboard *clip) {
 }
 
 static void clipboard_control_write(const struct RISC_Clipboard *clip, uint32_t len) {
-  reset();
+  struct Clipboard *c = (struct Clipboard *)clip;
+  reset(c);
   if (len < UINT32_MAX) {
     char *buf = malloc(len + 1);
     if (buf != 0) {
-      data = buf;
-      data_len = len;
-      state = PUT;
+      c->data = buf;
+      c->data_len = len;
+      c->state = PUT;
     }
   }
 }
 
 static uint32_t clipboard_data_read(const struct RISC_Clipboard *clip) {
+  struct Clipboard *c = (struct Clipboard *)clip;
   uint32_t result = 0;
-  if (state == GET) {
-    assert(data && data_ptr < data_len);
-    result = (uint8_t)data[data_ptr];
-    data_ptr++;
-    if (result == '\r' && data[data_ptr] == '\n') {
-      data_ptr++;
+  if (c->state == GET) {
+    assert(c->data && c->data_ptr < c->data_len);
+    result = (uint8_t)c->data[c->data_ptr];
+    c->data_ptr++;
+    if (result == '\r' && c->data[c->data_ptr] == '\n') {
+      c->data_ptr++;
     } else if (result == '\n') {
       result = '\r';
     }
-    if (data_ptr == data_len) {
-      reset();
+    if (c->data_ptr == c->data_len) {
+      reset(c);
     }
   }
   return result;
 }
 
-static void clipboard_data_write(const struct RISC_Clipboard *clip, uint32_t c) {
-  if (state == PUT) {
-    assert(data && data_ptr < data_len);
-    if ((char)c == '\r') {
-      c = '\n';
+static void clipboard_data_write(const struct RISC_Clipboard *clip, uint32_t ch) {
+  struct Clipboard *c = (struct Clipboard *)clip;
+  if (c->state == PUT) {
+    assert(c->data && c->data_ptr < c->data_len);
+    if ((char)ch == '\r') {
+      ch = '\n';
     }
-    data[data_ptr] = (char)c;
-    ++data_ptr;
-    if (data_ptr == data_len) {
-      data[data_ptr] = 0;
-      SDL_SetClipboardText(data);
-      reset();
+    c->data[c->data_ptr] = (char)ch;
+    ++c->data_ptr;
+    if (c->data_ptr == c->data_len) {
+      c->data[c->data_ptr] = 0;
+      if (c->put == NULL) {
+        SDL_SetClipboardText(c->data);
+      } else {
+        // Until the host's clipboard comes back, the guest sees its own text.
+        c->put(c->put_arg, c->data);
+        SDL_free(c->text);
+        c->text = SDL_strdup(c->data);
+      }
+      reset(c);
     }
   }
 }
 
-const struct RISC_Clipboard sdl_clipboard = {
-  .write_control = clipboard_control_write,
-  .read_control = clipboard_control_read,
-  .write_data = clipboard_data_write,
-  .read_data = clipboard_data_read
-};
+struct RISC_Clipboard *sdl_clipboard_new(void) {
+  struct Clipboard *c = calloc(1, sizeof(*c));
+  if (c == NULL) {
+    return NULL;
+  }
+  c->clipboard = (struct RISC_Clipboard){
+    .write_control = clipboard_control_write,
+    .read_control = clipboard_control_read,
+    .write_data = clipboard_data_write,
+    .read_data = clipboard_data_read
+  };
+  return &c->clipboard;
+}
+
+void sdl_clipboard_detach(struct RISC_Clipboard *clip,
+                          void (*put)(void *arg, const char *text), void *arg) {
+  struct Clipboard *c = (struct Clipboard *)clip;
+  c->put = put;
+  c->put_arg = arg;
+}
+
+void sdl_clipboard_offer(struct RISC_Clipboard *clip, char *text) {
+  struct Clipboard *c = (struct Clipboard *)clip;
+  SDL_free(c->text);
+  c->text = text;
+}
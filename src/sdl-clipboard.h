@@ -3,6 +3,15 @@
 
 #include "risc-io.h"
 
-extern const struct RISC_Clipboard sdl_clipboard;
+struct RISC_Clipboard *sdl_clipboard_new(void);
+
+// SDL's clipboard only works on the main thread. When the guest runs on
+// another one, the main thread hands it the host's text instead, with
+// sdl_clipboard_offer(), which takes over text and frees it with
+// SDL_free(). Text the guest copies goes to put(), which runs on the
+// guest's thread and has to get it to the main thread.
+void sdl_clipboard_detach(struct RISC_Clipboard *clip,
+                          void (*put)(void *arg, const char *text), void *arg);
+void sdl_clipboard_offer(struct RISC_Clipboard *clip, char *text);
 
 #endif  // SDL_CLIPBOARD_H
@@ -1,4 +1,5 @@
 #include <SDL.h>
+#include <errno.h>
 #include <getopt.h>
 #include <math.h>
 #include <stdarg.h>
@@ -10,6 +11,7 @@
 #include "risc.h"
 #include "risc-io.h"
 #include "disk.h"
+#include "fb-convert.h"
 #include "pclink.h"
 #include "raw-serial.h"
 #include "sdl-ps2.h"
@@ -26,6 +28,69 @@ static uint32_t BLACK = 0x657b83, WHITE = 0xfdf6e3;
 
 #define MAX_HEIGHT 2048
 #define MAX_WIDTH  2048
+#define MAX_DAMAGE_RECTS 64
+
+// With --cpu-thread, the guest runs in a thread of its own, so that a
+// slow texture upload or a present waiting for vsync doesn't cost it
+// any cycles. Input goes to that thread through a ring buffer. Frames
+// come back through three buffers: the CPU thread fills one, the
+// display shows another, and the middle one holds the latest frame
+// that hasn't been shown yet.
+#define INPUT_QUEUE 256
+#define FRESH 4  // or'ed into the middle buffer index
+
+struct Input {
+  enum { INPUT_MOUSE_MOVED, INPUT_MOUSE_BUTTON, INPUT_KEYS, INPUT_RESET, INPUT_DROP, INPUT_CLIPBOARD } type;
+  int x, y;
+  int button;
+  bool down;
+  int len;
+  uint8_t keys[MAX_PS2_CODE_LEN];
+  char *path;  // a dropped file, freed with SDL_free()
+  const char *name;  // the last part of path
+  char *text;  // the host's clipboard, freed with SDL_free()
+};
+
+struct Frame {
+  uint32_t *fb;
+  uint32_t palette[16];
+  struct Damage rects[MAX_DAMAGE_RECTS];
+  int count;
+};
+
+struct Emulator {
+  struct RISC *risc;
+  struct RISC_Serial *pclink;  // NULL if the serial line is raw
+  struct RISC_SPI *disk;
+  struct RISC_Clipboard *clipboard;
+  bool turbo;
+  uint32_t tick_offset;  // see main()
+  uint32_t guest_tick;
+  uint32_t last_flush;
+  // Counters as of the last --stats line.
+  uint32_t stats_interval, last_stats;
+  struct RISC_Stats stats;
+  struct DiskStats disk_stats;
+
+  bool threaded;
+  SDL_atomic_t quit;
+  // Written by the main thread at head, read by the CPU thread at tail.
+  // The indices run modulo 2 * INPUT_QUEUE, to tell full from empty.
+  struct Input queue[INPUT_QUEUE];
+  SDL_atomic_t queue_head, queue_tail;
+  SDL_sem *input_ready;
+  struct Frame frames[3];
+  size_t fb_words;
+  int fb_width, fb_height;  // words, lines
+  int back, front;          // owned by the CPU and the main thread
+  SDL_atomic_t middle;
+  // Damage of a frame the display skipped, added to the next one.
+  struct Damage carry[MAX_DAMAGE_RECTS];
+  int carry_cnt;
+  Uint32 frame_event;
+  Uint32 clipboard_event;  // text the guest copied, in data1
+  SDL_Thread *thread;
+};
 
 static int best_display(const SDL_Rect *rect);
 static int clamp(int x, int min, int max);
@@ -33,6 +98,15 @@ static enum Action map_keyboard_event(SDL_KeyboardEvent *event);
 static void show_leds(const struct RISC_LED *leds, uint32_t value);
 static double scale_display(SDL_Window *window, const SDL_Rect *risc_rect, SDL_Rect *display_rect);
 static void update_texture(struct RISC *risc, SDL_Texture *texture, const SDL_Rect *risc_rect, bool color);
+static void upload_rects(SDL_Texture *texture, const SDL_Rect *risc_rect, bool color,
+                         const uint32_t *in, const uint32_t *pal,
+                         const struct Damage *rects, int count);
+static void send_input(struct Emulator *emu, struct Input input);
+static void offer_clipboard(struct Emulator *emu);
+static void run_frame(struct Emulator *emu, uint32_t frame_start);
+static void show_stats(struct Emulator *emu, uint32_t now);
+static void start_cpu_thread(struct Emulator *emu, const SDL_Rect *risc_rect, bool color);
+static struct Frame *take_frame(struct Emulator *emu);
 
 enum Action {
   ACTION_OBERON_INPUT,
@@ -74,6 +148,15 @@ static struct option long_options[] = {
   { "boot-from-serial", no_argument,       NULL, 'S' },
   { "color",            no_argument,       NULL, 'c' },
   { "hostfs",           required_argument, NULL, 'H' },
+  { "jit",              no_argument,       NULL, 'j' },
+  { "turbo",            no_argument,       NULL, 't' },
+  { "disk-sync",        required_argument, NULL, 'D' },
+  { "overlay",          required_argument, NULL, 'o' },
+  { "snapshot",         required_argument, NULL, 'N' },
+  { "cpu-thread",       no_argument,       NULL, 'T' },
+  { "profile",          required_argument, NULL, 'p' },
+  { "stats",            required_argument, NULL, 'x' },
+  { "record",           required_argument, NULL, 'W' },
   { NULL,               no_argument,       NULL, 0   }
 };
 
@@ -100,14 +183,26 @@ static void usage() {
        "  --serial-in FILE      Read serial input from FILE\n"
        "  --serial-out FILE     Write serial output to FILE\n"
        "  --hostfs DIRECTORY    Use DIRECTORY as HostFS directory\n"
+       "  --disk-sync MODE      Flush disk writes: none, async or full\n"
+       "  --overlay FILE        Keep disk changes in FILE, not in DISK-IMAGE\n"
+       "  --snapshot FILE       Resume from FILE, and save the state there on exit\n"
+       "  --jit                 Translate hot code to native instructions\n"
+       "  --turbo               Run faster than real time when the guest is busy\n"
+       "  --cpu-thread          Run the guest in its own thread, apart from the display\n"
+       "  --profile FILE        Write where the guest spent its time to FILE\n"
+       "                        and FILE.folded on exit\n"
+       "  --stats SECONDS       Print what the guest did every SECONDS on stderr\n"
+       "  --record FILE         Log all input to FILE, for risc-headless --replay\n"
        );
   exit(1);
 }
 
 int main (int argc, char *argv[]) {
   struct RISC *risc = risc_new();
-  risc_set_serial(risc, &pclink);
-  risc_set_clipboard(risc, &sdl_clipboard);
+  struct RISC_Serial *pclink = pclink_new(NULL);
+  risc_set_serial(risc, pclink);
+  struct RISC_Clipboard *clipboard = sdl_clipboard_new();
+  risc_set_clipboard(risc, clipboard);
 
   struct RISC_LED leds = {
     .write = show_leds
@@ -124,9 +219,16 @@ int main (int argc, char *argv[]) {
   const char *serial_in = NULL;
   const char *serial_out = NULL;
   bool boot_from_serial = false;
+  enum DiskSync disk_sync = DISK_SYNC_NONE;
+  const char *overlay = NULL;
+  const char *snapshot = NULL;
+  const char *profile = NULL;
+  const char *record = NULL;
+  int stats_interval = 0;
+  bool turbo = false, cpu_thread = false;
 
   int opt;
-  while ((opt = getopt_long(argc, argv, "z:fLrm:s:I:O:ScH:", long_options, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "z:fLrm:s:I:O:ScH:jtD:o:N:Tp:x:W:", long_options, NULL)) != -1) {
     switch (opt) {
       case 'z': {
         double x = strtod(optarg, 0);
@@ -184,6 +286,57 @@ int main (int argc, char *argv[]) {
         risc_set_host_fs(risc, host_fs_new(optarg));
         break;
       }
+      case 'N': {
+        snapshot = optarg;
+        break;
+      }
+      case 'o': {
+        overlay = optarg;
+        break;
+      }
+      case 'D': {
+        if (strcmp(optarg, "none") == 0) {
+          disk_sync = DISK_SYNC_NONE;
+        } else if (strcmp(optarg, "async") == 0) {
+          disk_sync = DISK_SYNC_ASYNC;
+        } else if (strcmp(optarg, "full") == 0) {
+          disk_sync = DISK_SYNC_FULL;
+        } else {
+          usage();
+        }
+        break;
+      }
+      case 'j': {
+        if (!risc_set_jit(risc, true)) {
+          fprintf(stderr, "No JIT for this host, using the interpreter.\n");
+        }
+        break;
+      }
+      case 't': {
+        turbo = true;
+        break;
+      }
+      case 'T': {
+        cpu_thread = true;
+        break;
+      }
+      case 'p': {
+        profile = optarg;
+        if (!risc_set_profile(risc, RISC_PROFILE_PERIOD)) {
+          fail(1, "Can't allocate the profiler");
+        }
+        break;
+      }
+      case 'x': {
+        if (sscanf(optarg, "%d", &stats_interval) != 1 || stats_interval < 1) {
+          usage();
+        }
+        break;
+      }
+      case 'W': {
+        record = optarg;
+        break;
+      }
       default: {
         usage();
       }
@@ -194,14 +347,19 @@ int main (int argc, char *argv[]) {
     risc_configure_memory(risc, mem_option, rtc_option, risc_rect.w, risc_rect.h, color_option);
   }
 
-  if (optind == argc - 1) {
-    risc_set_spi(risc, 1, disk_new(argv[optind]));
+  struct RISC_SPI *disk = NULL;
+  if (optind == argc - 1 && overlay) {
+    disk = disk_new_overlay(argv[optind], overlay);
+  } else if (optind == argc - 1) {
+    disk = disk_new(argv[optind]);
   } else if (optind == argc && boot_from_serial) {
     /* Allow diskless boot */
-    risc_set_spi(risc, 1, disk_new(NULL));
+    disk = disk_new(NULL);
   } else {
     usage();
   }
+  disk_set_sync(disk, disk_sync);
+  risc_set_spi(risc, 1, disk);
 
   if (serial_in || serial_out) {
     if (!serial_in) {
@@ -211,6 +369,16 @@ int main (int argc, char *argv[]) {
       serial_out = "/dev/null";
     }
     risc_set_serial(risc, raw_serial_new(serial_in, serial_out));
+    pclink = NULL;
+  }
+
+  bool resumed = false;
+  if (snapshot) {
+    resumed = risc_load_snapshot(risc, snapshot);
+    if (!resumed && errno != ENOENT) {
+      fprintf(stderr, "Can't load snapshot \"%s\": %s\n", snapshot, strerror(errno));
+      exit(1);
+    }
   }
 
   if (SDL_Init(SDL_INIT_VIDEO) != 0) {
@@ -270,6 +438,29 @@ int main (int argc, char *argv[]) {
 
   bool done = false;
   bool mouse_was_offscreen = false;
+  // Resumed guests expect their clock to continue where it was.
+  struct Emulator emu = {
+    .risc = risc,
+    .pclink = pclink,
+    .disk = disk,
+    .clipboard = clipboard,
+    .turbo = turbo,
+    .tick_offset = resumed ? risc_get_time(risc) - SDL_GetTicks() : 0
+  };
+  emu.guest_tick = SDL_GetTicks() + emu.tick_offset;
+  emu.last_flush = emu.guest_tick;
+  emu.stats_interval = (uint32_t)stats_interval * 1000;
+  emu.last_stats = SDL_GetTicks();
+  risc_get_stats(risc, &emu.stats);
+  disk_get_stats(disk, &emu.disk_stats);
+  if (record && !risc_record(risc, record)) {
+    fail(1, "Can't record to \"%s\": %s", record, strerror(errno));
+  }
+  if (cpu_thread) {
+    start_cpu_thread(&emu, &risc_rect, color_option);
+  }
+  // Set when the window needs presenting again even without a new frame.
+  bool redraw = false;
   while (!done) {
     uint32_t frame_start = SDL_GetTicks();
 
@@ -284,7 +475,15 @@ int main (int argc, char *argv[]) {
         case SDL_WINDOWEVENT: {
           if (event.window.event == SDL_WINDOWEVENT_RESIZED) {
             display_scale = scale_display(window, &risc_rect, &display_rect);
+          } else if (event.window.event == SDL_WINDOWEVENT_FOCUS_GAINED) {
+            offer_clipboard(&emu);  // may have changed meanwhile
           }
+          redraw = true;
+          break;
+        }
+
+        case SDL_CLIPBOARDUPDATE: {
+          offer_clipboard(&emu);
           break;
         }
 
@@ -298,12 +497,9 @@ int main (int argc, char *argv[]) {
           else
             dropped_file_name = dropped_file;
           printf("Dropped %s [%s]\n", dropped_file, dropped_file_name);
-          FILE *f = fopen("PCLink.REC", "w");
-          fputs(dropped_file_name, f);
-          fputs(" ", f);
-          fputs(dropped_file, f);
-          fclose(f);
-          SDL_free(dropped_file);
+          send_input(&emu, (struct Input){
+            .type = INPUT_DROP, .path = dropped_file, .name = dropped_file_name
+          });
           break;
         }
 
@@ -317,14 +513,18 @@ int main (int argc, char *argv[]) {
             SDL_ShowCursor(mouse_is_offscreen);
             mouse_was_offscreen = mouse_is_offscreen;
           }
-          risc_mouse_moved(risc, x, risc_rect.h - y - 1);
+          send_input(&emu, (struct Input){
+            .type = INPUT_MOUSE_MOVED, .x = x, .y = risc_rect.h - y - 1
+          });
           break;
         }
 
         case SDL_MOUSEBUTTONDOWN:
         case SDL_MOUSEBUTTONUP: {
           bool down = event.button.state == SDL_PRESSED;
-          risc_mouse_button(risc, event.button.button, down);
+          send_input(&emu, (struct Input){
+            .type = INPUT_MOUSE_BUTTON, .button = event.button.button, .down = down
+          });
           break;
         }
 
@@ -333,7 +533,7 @@ int main (int argc, char *argv[]) {
           bool down = event.key.state == SDL_PRESSED;
           switch (map_keyboard_event(&event.key)) {
             case ACTION_RESET: {
-              risc_reset(risc);
+              send_input(&emu, (struct Input){ .type = INPUT_RESET });
               break;
             }
             case ACTION_TOGGLE_FULLSCREEN: {
@@ -343,6 +543,7 @@ int main (int argc, char *argv[]) {
               } else {
                 SDL_SetWindowFullscreen(window, 0);
               }
+              redraw = true;
               break;
             }
             case ACTION_QUIT: {
@@ -350,42 +551,83 @@ int main (int argc, char *argv[]) {
               break;
             }
             case ACTION_FAKE_MOUSE1: {
-              risc_mouse_button(risc, 1, down);
+              send_input(&emu, (struct Input){ .type = INPUT_MOUSE_BUTTON, .button = 1, .down = down });
               break;
             }
             case ACTION_FAKE_MOUSE2: {
-              risc_mouse_button(risc, 2, down);
+              send_input(&emu, (struct Input){ .type = INPUT_MOUSE_BUTTON, .button = 2, .down = down });
               break;
             }
             case ACTION_FAKE_MOUSE3: {
-              risc_mouse_button(risc, 3, down);
+              send_input(&emu, (struct Input){ .type = INPUT_MOUSE_BUTTON, .button = 3, .down = down });
               break;
             }
             case ACTION_OBERON_INPUT: {
-              uint8_t ps2_bytes[MAX_PS2_CODE_LEN];
-              int len = ps2_encode(event.key.keysym.scancode, down, ps2_bytes);
-              risc_keyboard_input(risc, ps2_bytes, len);
+              struct Input input = { .type = INPUT_KEYS };
+              input.len = ps2_encode(event.key.keysym.scancode, down, input.keys);
+              send_input(&emu, input);
               break;
             }
           }
+          break;
+        }
+
+        default: {
+          if (emu.threaded && event.type == emu.clipboard_event) {
+            SDL_SetClipboardText(event.user.data1);
+            SDL_free(event.user.data1);
+          }
+          break;
         }
       }
     }
+    if (done) {
+      break;
+    }
 
-    risc_set_time(risc, frame_start);
-    for (int i=0; i<MSPF; i++) {
-      risc_run(risc, CPU_HZ / 1000 * MSPF);
-      uint32_t frame_end = SDL_GetTicks();
-      int delay = frame_start + MSPF - frame_end;
-      if (delay > 0) {
-        SDL_Delay(delay);
+    if (emu.threaded) {
+      // Sleep until the CPU thread has a new frame, or input arrives.
+      // Without a new frame the texture is still good for a redraw.
+      struct Frame *frame = take_frame(&emu);
+      if (frame == NULL && !redraw) {
+        SDL_WaitEvent(NULL);
+        continue;
       }
-      risc_trigger_interrupt(risc);
+      if (frame != NULL) {
+        upload_rects(texture, &risc_rect, color_option, frame->fb, frame->palette,
+                     frame->rects, frame->count);
+      }
+    } else {
+      run_frame(&emu, frame_start);
+      update_texture(risc, texture, &risc_rect, color_option);
     }
-    update_texture(risc, texture, &risc_rect, color_option);
     SDL_RenderClear(renderer);
     SDL_RenderCopy(renderer, texture, &risc_rect, &display_rect);
     SDL_RenderPresent(renderer);
+    redraw = false;
+
+    if (!emu.threaded && frame_start - emu.last_flush >= 1000) {
+      disk_flush(disk);
+      emu.last_flush = frame_start;
+    }
+    if (!emu.threaded) {
+      show_stats(&emu, frame_start);
+    }
+  }
+  if (emu.threaded) {
+    SDL_AtomicSet(&emu.quit, 1);
+    SDL_SemPost(emu.input_ready);
+    SDL_WaitThread(emu.thread, NULL);
+  }
+  disk_flush(disk);
+  if (record && !risc_record(risc, NULL)) {
+    fail(1, "Can't record to \"%s\": %s", record, strerror(errno));
+  }
+  if (snapshot && !risc_save_snapshot(risc, snapshot)) {
+    fail(1, "Can't save snapshot \"%s\": %s", snapshot, strerror(errno));
+  }
+  if (profile && !risc_write_profile(risc, profile)) {
+    fail(1, "Can't write profile \"%s\": %s", profile, strerror(errno));
   }
   return 0;
 }
@@ -465,38 +707,310 @@ static double scale_display(SDL_Window *window, const SDL_Rect *risc_rect, SDL_R
 static uint32_t pixel_buf[MAX_WIDTH * MAX_HEIGHT];
 
 static void update_texture(struct RISC *risc, SDL_Texture *texture, const SDL_Rect *risc_rect, bool color) {
-  struct Damage damage = risc_get_framebuffer_damage(risc);
-  if (damage.y1 <= damage.y2) {
-    uint32_t *in = risc_get_framebuffer_ptr(risc);
-    uint32_t *pal = color ? risc_get_palette_ptr(risc) : NULL;
+  struct Damage rects[MAX_DAMAGE_RECTS];
+  int count = risc_get_framebuffer_damage_rects(risc, rects, MAX_DAMAGE_RECTS);
+  upload_rects(texture, risc_rect, color, risc_get_framebuffer_ptr(risc),
+               risc_get_palette_ptr(risc), rects, count);
+}
+
+static void upload_rects(SDL_Texture *texture, const SDL_Rect *risc_rect, bool color,
+                         const uint32_t *in, const uint32_t *pal,
+                         const struct Damage *rects, int count) {
+  int pixels_per_word = color ? 8 : 32;
+
+  for (int i = 0; i < count; i++) {
+    struct Damage damage = rects[i];
+    int words = damage.x2 - damage.x1 + 1;
     uint32_t out_idx = 0;
 
     for (int line = damage.y2; line >= damage.y1; line--) {
-      int line_start = line * (risc_rect->w / (color ? 8 : 32));
-      for (int col = damage.x1; col <= damage.x2; col++) {
-        uint32_t pixels = in[line_start + col];
-        if (color) {
-          for (int b = 0; b < 8; b++) {
-            pixel_buf[out_idx] = pal[pixels & 0xF];
-            pixels >>= 4;
-            out_idx++;
-          }
-        } else {
-          for (int b = 0; b < 32; b++) {
-            pixel_buf[out_idx] = (pixels & 1) ? WHITE : BLACK;
-            pixels >>= 1;
-            out_idx++;
-          }
-        }
+      int line_start = line * (risc_rect->w / pixels_per_word);
+      if (color) {
+        fb_convert_color(in + line_start + damage.x1, words, pixel_buf + out_idx, pal);
+      } else {
+        fb_convert_mono(in + line_start + damage.x1, words, pixel_buf + out_idx, BLACK, WHITE);
       }
+      out_idx += words * pixels_per_word;
     }
 
     SDL_Rect rect = {
-      .x = damage.x1 * (color ? 8 : 32),
+      .x = damage.x1 * pixels_per_word,
       .y = risc_rect->h - damage.y2 - 1,
-      .w = (damage.x2 - damage.x1 + 1) * (color ? 8 : 32),
+      .w = words * pixels_per_word,
       .h = (damage.y2 - damage.y1 + 1)
     };
     SDL_UpdateTexture(texture, &rect, pixel_buf, rect.w * 4);
   }
 }
+
+static void apply_input(struct Emulator *emu, const struct Input *input) {
+  struct RISC *risc = emu->risc;
+  switch (input->type) {
+    case INPUT_MOUSE_MOVED: {
+      risc_mouse_moved(risc, input->x, input->y);
+      break;
+    }
+    case INPUT_MOUSE_BUTTON: {
+      risc_mouse_button(risc, input->button, input->down);
+      break;
+    }
+    case INPUT_KEYS: {
+      risc_keyboard_input(risc, input->keys, (uint32_t)input->len);
+      break;
+    }
+    case INPUT_RESET: {
+      risc_reset(risc);
+      break;
+    }
+    case INPUT_DROP: {
+      if (emu->pclink == NULL || !pclink_queue_rec(emu->pclink, input->name, input->path)) {
+        fprintf(stderr, "Can't transfer %s without PCLink\n", input->path);
+      }
+      SDL_free(input->path);
+      break;
+    }
+    case INPUT_CLIPBOARD: {
+      sdl_clipboard_offer(emu->clipboard, input->text);
+      break;
+    }
+  }
+}
+
+// Input is dropped if the CPU thread is that far behind.
+static void send_input(struct Emulator *emu, struct Input input) {
+  if (!emu->threaded) {
+    apply_input(emu, &input);
+    return;
+  }
+  int head = SDL_AtomicGet(&emu->queue_head);
+  int tail = SDL_AtomicGet(&emu->queue_tail);
+  if ((head - tail + 2 * INPUT_QUEUE) % (2 * INPUT_QUEUE) == INPUT_QUEUE) {
+    SDL_free(input.path);
+    SDL_free(input.text);
+    return;
+  }
+  emu->queue[head % INPUT_QUEUE] = input;
+  SDL_MemoryBarrierRelease();
+  SDL_AtomicSet(&emu->queue_head, (head + 1) % (2 * INPUT_QUEUE));
+  SDL_SemPost(emu->input_ready);
+}
+
+// The CPU thread can't ask SDL for the clipboard, so it gets a copy
+// whenever that may have changed.
+static void offer_clipboard(struct Emulator *emu) {
+  if (emu->threaded && emu->clipboard != NULL) {
+    send_input(emu, (struct Input){ .type = INPUT_CLIPBOARD, .text = SDL_GetClipboardText() });
+  }
+}
+
+// Runs on the CPU thread, the main thread sets the clipboard.
+static void post_clipboard(void *arg, const char *text) {
+  struct Emulator *emu = arg;
+  SDL_Event event = { .user = { .type = emu->clipboard_event, .data1 = SDL_strdup(text) } };
+  if (event.user.data1 == NULL || SDL_PushEvent(&event) != 1) {
+    SDL_free(event.user.data1);
+  }
+}
+
+static void receive_input(struct Emulator *emu) {
+  // Forget about wakeups for input that's handled now.
+  while (SDL_SemTryWait(emu->input_ready) == 0) {
+  }
+  int head = SDL_AtomicGet(&emu->queue_head);
+  int tail = SDL_AtomicGet(&emu->queue_tail);
+  SDL_MemoryBarrierAcquire();
+  while (tail != head) {
+    apply_input(emu, &emu->queue[tail % INPUT_QUEUE]);
+    tail = (tail + 1) % (2 * INPUT_QUEUE);
+  }
+  SDL_AtomicSet(&emu->queue_tail, tail);
+}
+
+// Once the guest goes idle, nothing happens before the clock ticks or
+// input arrives.
+static void wait_for_input(struct Emulator *emu, int delay) {
+  if (emu->threaded) {
+    SDL_SemWaitTimeout(emu->input_ready, (Uint32)delay);
+  } else {
+    SDL_WaitEventTimeout(NULL, delay);
+  }
+}
+
+// Sleeps until either the next frame or the next input, which then
+// ends the frame early.
+static void run_frame(struct Emulator *emu, uint32_t frame_start) {
+  struct RISC *risc = emu->risc;
+  if (emu->turbo) {
+    // The guest clock advances by one millisecond per CPU_HZ / 1000
+    // cycles, and we run as many of those as fit into a frame. Only
+    // an idle guest is held back to real time.
+    do {
+      risc_set_time(risc, emu->guest_tick++);
+      bool busy = risc_run(risc, CPU_HZ / 1000);
+      risc_trigger_interrupt(risc);
+      if (!busy) {
+        uint32_t idle_start = SDL_GetTicks();
+        int delay = frame_start + MSPF - idle_start;
+        if (delay > 0) {
+          wait_for_input(emu, delay);
+        }
+        emu->guest_tick += SDL_GetTicks() - idle_start;
+        break;
+      }
+    } while (SDL_GetTicks() - frame_start < MSPF);
+  } else {
+    risc_set_time(risc, frame_start + emu->tick_offset);
+    for (int i=0; i<MSPF; i++) {
+      bool busy = risc_run(risc, CPU_HZ / 1000 * MSPF);
+      uint32_t frame_end = SDL_GetTicks();
+      int delay = frame_start + MSPF - frame_end;
+      if (!busy) {
+        if (delay > 0) {
+          wait_for_input(emu, delay);
+        }
+        risc_trigger_interrupt(risc);
+        break;
+      }
+      if (delay > 0) {
+        SDL_Delay(delay);
+      }
+      risc_trigger_interrupt(risc);
+    }
+  }
+}
+
+// Prints one line with what happened since the last one. Runs on the
+// CPU thread, if there is one, so the counters are not read while they
+// change.
+static void show_stats(struct Emulator *emu, uint32_t now) {
+  uint32_t ms = now - emu->last_stats;
+  if (emu->stats_interval == 0 || ms < emu->stats_interval) {
+    return;
+  }
+  struct RISC_Stats s, *o = &emu->stats;
+  struct DiskStats d, *od = &emu->disk_stats;
+  risc_get_stats(emu->risc, &s);
+  disk_get_stats(emu->disk, &d);
+  uint64_t runs = s.runs - o->runs;
+  fprintf(stderr, "stats: ms=%u mips=%.2f branches=%llu idle=%.0f%% serial=%llu/%llu"
+          " spi=%llu sectors=%llu/%llu dma=%llu damaged=%llu",
+          ms, (double)(s.instructions - o->instructions) / ms / 1000,
+          (unsigned long long)(s.branches_taken - o->branches_taken),
+          runs ? 100.0 * (double)(s.idle_runs - o->idle_runs) / (double)runs : 0.0,
+          (unsigned long long)(s.serial_in - o->serial_in),
+          (unsigned long long)(s.serial_out - o->serial_out),
+          (unsigned long long)(d.spi_bytes - od->spi_bytes),
+          (unsigned long long)(d.sectors_read - od->sectors_read),
+          (unsigned long long)(d.sectors_written - od->sectors_written),
+          (unsigned long long)(s.dma_sectors - o->dma_sectors),
+          (unsigned long long)(s.damaged_words - o->damaged_words));
+  // Loads/stores per IO register, and calls per HostFS op, if any.
+  for (int i = 0; i < RISC_IO_REGISTERS; i++) {
+    uint64_t loads = s.io_loads[i] - o->io_loads[i], stores = s.io_stores[i] - o->io_stores[i];
+    if (loads || stores) {
+      fprintf(stderr, " io%d=%llu/%llu", i * 4 - 64,
+              (unsigned long long)loads, (unsigned long long)stores);
+    }
+  }
+  for (int i = 0; i < RISC_HOSTFS_OPS; i++) {
+    if (s.hostfs_calls[i] != o->hostfs_calls[i]) {
+      fprintf(stderr, " hostfs%d=%llu", i,
+              (unsigned long long)(s.hostfs_calls[i] - o->hostfs_calls[i]));
+    }
+  }
+  fputc('\n', stderr);
+  *o = s;
+  *od = d;
+  emu->last_stats = now;
+}
+
+// Every frame is a full copy of the framebuffer, but the rectangles
+// only cover what changed since the display took the previous one.
+static void publish_frame(struct Emulator *emu) {
+  struct Frame *frame = &emu->frames[emu->back];
+  frame->count = risc_get_framebuffer_damage_rects(emu->risc, frame->rects, MAX_DAMAGE_RECTS);
+  if (frame->count == 0 && emu->carry_cnt == 0) {
+    return;
+  }
+  if (frame->count + emu->carry_cnt > MAX_DAMAGE_RECTS) {
+    frame->rects[0] = (struct Damage){
+      .x1 = 0,
+      .y1 = 0,
+      .x2 = emu->fb_width - 1,
+      .y2 = emu->fb_height - 1
+    };
+    frame->count = 1;
+  } else {
+    memcpy(frame->rects + frame->count, emu->carry, (size_t)emu->carry_cnt * sizeof(emu->carry[0]));
+    frame->count += emu->carry_cnt;
+  }
+  memcpy(frame->fb, risc_get_framebuffer_ptr(emu->risc), emu->fb_words * sizeof(uint32_t));
+  memcpy(frame->palette, risc_get_palette_ptr(emu->risc), sizeof(frame->palette));
+
+  SDL_MemoryBarrierRelease();
+  int old = SDL_AtomicSet(&emu->middle, emu->back | FRESH);
+  emu->back = old & ~FRESH;
+  emu->carry_cnt = 0;
+  if (old & FRESH) {
+    struct Frame *skipped = &emu->frames[emu->back];
+    memcpy(emu->carry, skipped->rects, (size_t)skipped->count * sizeof(emu->carry[0]));
+    emu->carry_cnt = skipped->count;
+  }
+  SDL_PushEvent(&(SDL_Event){ .type = emu->frame_event });
+}
+
+static struct Frame *take_frame(struct Emulator *emu) {
+  if (!(SDL_AtomicGet(&emu->middle) & FRESH)) {
+    return NULL;
+  }
+  emu->front = SDL_AtomicSet(&emu->middle, emu->front) & ~FRESH;
+  SDL_MemoryBarrierAcquire();
+  return &emu->frames[emu->front];
+}
+
+static int cpu_main(void *arg) {
+  struct Emulator *emu = arg;
+  while (!SDL_AtomicGet(&emu->quit)) {
+    uint32_t frame_start = SDL_GetTicks();
+    receive_input(emu);
+    run_frame(emu, frame_start);
+    publish_frame(emu);
+    if (frame_start - emu->last_flush >= 1000) {
+      disk_flush(emu->disk);
+      emu->last_flush = frame_start;
+    }
+    show_stats(emu, frame_start);
+  }
+  return 0;
+}
+
+static void start_cpu_thread(struct Emulator *emu, const SDL_Rect *risc_rect, bool color) {
+  emu->fb_width = risc_rect->w / (color ? 8 : 32);
+  emu->fb_height = risc_rect->h;
+  emu->fb_words = (size_t)emu->fb_width * (size_t)emu->fb_height;
+  for (int i = 0; i < 3; i++) {
+    emu->frames[i].fb = calloc(emu->fb_words, sizeof(uint32_t));
+    if (emu->frames[i].fb == NULL) {
+      fail(1, "Could not allocate frame buffers");
+    }
+  }
+  emu->back = 0;
+  SDL_AtomicSet(&emu->middle, 1);
+  emu->front = 2;
+
+  emu->frame_event = SDL_RegisterEvents(2);
+  emu->clipboard_event = emu->frame_event + 1;
+  emu->input_ready = SDL_CreateSemaphore(0);
+  if (emu->frame_event == (Uint32)-1 || emu->input_ready == NULL) {
+    fail(1, "Could not set up the CPU thread: %s", SDL_GetError());
+  }
+  emu->threaded = true;
+  if (emu->clipboard != NULL) {
+    sdl_clipboard_detach(emu->clipboard, post_clipboard, emu);
+    offer_clipboard(emu);
+  }
+  emu->thread = SDL_CreateThread(cpu_main, "CPU", emu);
+  if (emu->thread == NULL) {
+    fail(1, "Could not start the CPU thread: %s", SDL_GetError());
+  }
+}